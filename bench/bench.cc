@@ -0,0 +1,128 @@
+// Runs every program of the benchmark corpus under each execution mode and
+// reports guest instructions, wall time and MIPS. Each measurement is the
+// best of several runs, each on a Cpu freshly forked from the loaded image.
+//
+// The corpus programs are assembled from the .s files next to them with
+//   as --32 X.s -o X.o && ld -m elf_i386 -Ttext=0x100 --oformat=binary X.o -o X.com
+#include "corpus.h"
+#include "cpu.h"
+#include "loader.h"
+#include <chrono>
+
+struct Mode {
+  const char *name;
+  bool block_cache;
+  bool fusion;
+  bool jit;
+};
+
+static const Mode kModes[] = {
+  {"interp", false, false, false},
+  {"cache",  true,  false, false},
+  {"fused",  true,  true,  false},
+  {"jit",    true,  false, true},
+};
+
+struct Result {
+  std::string program;
+  const char *mode;
+  bool halted;
+  uint64_t instructions;
+  double seconds;
+};
+
+static Result measure(const std::string &name, const GuestImage &image,
+                      const Mode &mode, int runs) {
+  Result r = {name, mode.name, true, 0, 0};
+  for (int i = 0; i < runs; ++i) {
+    std::unique_ptr<Cpu> cpu(new Cpu(image));
+    cpu->out_.redirect(nullptr);    // capture what the guest prints
+    cpu->use_block_cache_ = mode.block_cache;
+    cpu->use_fusion_ = mode.fusion;
+    cpu->use_jit_ = mode.jit;
+
+    auto begin = std::chrono::steady_clock::now();
+    Cpu::ExitStatus st = cpu->run();
+    double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - begin).count();
+
+    r.halted = r.halted && st == Cpu::kExitHalt;
+    r.instructions = cpu->retired_;
+    if (i == 0 || seconds < r.seconds) r.seconds = seconds;
+  }
+  return r;
+}
+
+static void write_json(const char *path, const std::vector<Result> &results) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    fprintf(stderr, "Failed to write %s.\n", path);
+    return;
+  }
+  fprintf(f, "{\n  \"results\": [\n");
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result &r = results[i];
+    fprintf(f, "    {\"program\": \"%s\", \"mode\": \"%s\", \"halted\": %s, "
+               "\"instructions\": %llu, \"seconds\": %.6f, \"mips\": %.2f}%s\n",
+            r.program.c_str(), r.mode, r.halted ? "true" : "false",
+            (unsigned long long) r.instructions, r.seconds,
+            r.instructions / r.seconds / 1e6,
+            i + 1 < results.size() ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+  fclose(f);
+}
+
+int main(int argc, char **argv) {
+  const char *corpus = TOY8086_BENCH_CORPUS;
+  const char *json = nullptr;
+  const char *only = nullptr;
+  int runs = 3;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--corpus") && i + 1 < argc) corpus = argv[++i];
+    else if (!strcmp(argv[i], "--json") && i + 1 < argc) json = argv[++i];
+    else if (!strcmp(argv[i], "--mode") && i + 1 < argc) only = argv[++i];
+    else if (!strcmp(argv[i], "--runs") && i + 1 < argc) runs = atoi(argv[++i]);
+    else {
+      fprintf(stderr, "Usage: %s [--corpus DIR] "
+                      "[--mode interp|cache|fused|jit]\n"
+                      "           [--runs N] [--json FILE]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (runs < 1) runs = 1;
+
+  std::vector<std::string> programs = list_corpus(corpus);
+  if (programs.empty()) {
+    fprintf(stderr, "No programs in %s.\n", corpus);
+    return 2;
+  }
+
+  Loader loader;
+  std::vector<Result> results;
+  bool ok = true;
+  printf("%-12s %-8s %12s %10s %10s\n",
+         "program", "mode", "instructions", "seconds", "MIPS");
+  for (const std::string &name : programs) {
+    std::string path = std::string(corpus) + "/" + name + ".com";
+    std::shared_ptr<GuestImage> image = loader.load(path.c_str());
+    if (!image) {
+      fprintf(stderr, "Failed to load %s.\n", path.c_str());
+      ok = false;
+      continue;
+    }
+    for (const Mode &mode : kModes) {
+      if (only && strcmp(only, mode.name)) continue;
+      Result r = measure(name, *image, mode, runs);
+      printf("%-12s %-8s %12llu %10.4f %10.2f%s\n",
+             r.program.c_str(), r.mode, (unsigned long long) r.instructions,
+             r.seconds, r.instructions / r.seconds / 1e6,
+             r.halted ? "" : "  (did not halt)");
+      ok = ok && r.halted;
+      results.push_back(r);
+    }
+  }
+
+  if (json) write_json(json, results);
+  return ok ? 0 : 3;
+}
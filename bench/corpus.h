@@ -0,0 +1,65 @@
+// Helpers shared by the bench programs: finding and reading the benchmark
+// corpus, and asking the kernel how much memory the process uses.
+#ifndef _BENCH_CORPUS_H_
+#define _BENCH_CORPUS_H_
+
+#include <algorithm>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#ifndef TOY8086_BENCH_CORPUS
+#  define TOY8086_BENCH_CORPUS "bench/corpus"
+#endif
+
+// Names of the .com programs in dir, without the extension, sorted.
+inline std::vector<std::string> list_corpus(const char *dir) {
+  std::vector<std::string> names;
+  if (DIR *d = opendir(dir)) {
+    while (dirent *e = readdir(d)) {
+      std::string name = e->d_name;
+      if (name.size() > 4 && name.compare(name.size() - 4, 4, ".com") == 0) {
+        names.push_back(name.substr(0, name.size() - 4));
+      }
+    }
+    closedir(d);
+  }
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+// Appends the contents of the file at path to data.
+template<typename T>
+inline bool append_file(const std::string &path, std::vector<T> &data) {
+  static_assert(sizeof(T) == 1, "append_file reads bytes");
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) return false;
+  T buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    data.insert(data.end(), buf, buf + n);
+  }
+  fclose(f);
+  return true;
+}
+
+// A field of /proc/self/smaps_rollup in KiB, e.g. "Rss:", or the
+// proportional "Pss:", where pages shared with another mapping count once
+// rather than once per mapping. 0 where the kernel does not tell.
+inline long memory_kib(const char *field) {
+  FILE *f = fopen("/proc/self/smaps_rollup", "r");
+  if (!f) return 0;
+  char line[256];
+  size_t len = strlen(field);
+  long kib = 0;
+  while (fgets(line, sizeof(line), f)) {
+    if (!strncmp(line, field, len)) kib = atol(line + len);
+  }
+  fclose(f);
+  return kib;
+}
+
+#endif
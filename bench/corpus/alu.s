@@ -0,0 +1,27 @@
+# Register arithmetic with flag-driven branches.
+        .code16
+        .intel_syntax noprefix
+        .text
+        .globl _start
+_start:
+
+        mov dx, 200
+outer:  mov cx, 10000
+        mov ax, 1
+        mov bx, 0x1234
+inner:  add ax, bx
+        xor bx, ax
+        sub ax, cx
+        adc bx, 3
+        and ax, 0x7fff
+        or bx, 1
+        cmp ax, bx
+        jb 1f
+        sbb ax, bx
+1:      inc si
+        dec di
+        xchg ax, bx
+        loop inner
+        dec dx
+        jnz outer
+        hlt
@@ -0,0 +1,27 @@
+# Recursive Fibonacci: call/ret, push/pop and short branches.
+        .code16
+        .intel_syntax noprefix
+        .text
+        .globl _start
+_start:
+
+        mov di, 100
+1:      mov ax, 20
+        call fib
+        dec di
+        jnz 1b
+        hlt
+
+# ax = fib(ax)
+fib:    cmp ax, 2
+        jb 9f
+        push ax
+        dec ax
+        call fib
+        pop bx
+        push ax
+        lea ax, [bx-2]
+        call fib
+        pop bx
+        add ax, bx
+9:      ret
@@ -0,0 +1,104 @@
+# Dhrystone-style mix: procedures with BP frames, record copies, string
+# compares, array stores, multiply/divide and globals in memory.
+        .code16
+        .intel_syntax noprefix
+        .text
+        .globl _start
+_start:
+
+        mov word ptr [count], 60000
+main:   mov ax, 3
+        push ax
+        mov ax, 7
+        push ax
+        call proc7
+        mov [int_glob], ax
+
+        mov ax, 5
+        mov bx, [int_glob]
+        call proc8
+
+        mov al, 'A'
+        mov ah, 'B'
+        call func1
+        mov [bool_glob], al
+        call func2
+        add [bool_glob], al
+        call reccopy
+
+        mov ax, [int_glob]
+        mov bx, 7
+        mul bx
+        mov bx, 3
+        xor dx, dx
+        div bx
+        mov [int2], ax
+
+        sub word ptr [count], 1
+        jnz main
+        hlt
+
+# ax = a + b + 2
+proc7:  push bp
+        mov bp, sp
+        mov ax, [bp+4]
+        add ax, [bp+6]
+        add ax, 2
+        pop bp
+        ret 4
+
+# arr1[ax] = arr1[ax + 1] = bx; arr1[ax + 30] = arr1[ax]; int_glob += 5
+proc8:  mov si, ax
+        shl si, 1
+        mov [si+arr1], bx
+        mov [si+arr1+2], bx
+        mov dx, [si+arr1]
+        mov [si+arr1+60], dx
+        add word ptr [int_glob], 5
+        ret
+
+# al = (al == ah)
+func1:  cmp al, ah
+        jne 1f
+        mov al, 1
+        ret
+1:      xor al, al
+        ret
+
+# ax = (str1 != str2)
+func2:  mov si, offset str1
+        mov di, offset str2
+        mov cx, 30
+1:      mov al, [si]
+        cmp al, [di]
+        jne 2f
+        inc si
+        inc di
+        loop 1b
+        xor ax, ax
+        ret
+2:      mov ax, 1
+        ret
+
+reccopy:
+        mov si, offset rec1
+        mov di, offset rec2
+        mov cx, 16
+1:      mov ax, [si]
+        mov [di], ax
+        add si, 2
+        add di, 2
+        loop 1b
+        ret
+
+        .balign 256, 0          # keep the data off the code pages
+str1:   .ascii "DHRYSTONE PROGRAM, 1'ST STRING"
+str2:   .ascii "DHRYSTONE PROGRAM, 1'ST STRINX"
+rec1:   .fill 16, 2, 0x5a5a
+rec2:   .fill 16, 2, 0
+count:  .word 0
+int_glob: .word 0
+int2:   .word 0
+bool_glob: .byte 0
+        .balign 2, 0
+arr1:   .fill 64, 2, 0
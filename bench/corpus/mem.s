@@ -0,0 +1,35 @@
+# Word and byte loads and stores through most addressing modes.
+        .code16
+        .intel_syntax noprefix
+        .text
+        .globl _start
+_start:
+
+        .equ src, 0x2000
+        .equ dst, 0x4000
+        .equ words, 1024
+
+        mov si, src             # src[i] = i * 3
+        xor ax, ax
+        mov cx, words
+1:      mov [si], ax
+        add ax, 3
+        add si, 2
+        loop 1b
+
+        mov dx, 3000
+outer:  mov si, src
+        mov bx, dst
+        xor di, di
+        mov cx, words
+1:      mov ax, [si]
+        add ax, [bx+di]
+        mov [bx+di], ax
+        xor [si], al
+        add byte ptr [si+1], 1
+        add si, 2
+        add di, 2
+        loop 1b
+        dec dx
+        jnz outer
+        hlt
@@ -0,0 +1,27 @@
+# Console output: '$'-terminated lines through AH=09 and single characters
+# through AH=02.
+        .code16
+        .intel_syntax noprefix
+        .text
+        .globl _start
+_start:
+
+        mov bx, 20000
+1:      mov dx, offset line     # a line of text
+        mov ah, 9
+        int 0x21
+
+        mov cx, 8               # and a row of digits
+        mov dl, '0'
+        mov ah, 2
+2:      int 0x21
+        add dl, 1
+        loop 2b
+        mov dl, '\n'
+        int 0x21
+
+        dec bx
+        jnz 1b
+        hlt
+
+line:   .ascii "The quick brown fox jumps over the lazy dog.\n$"
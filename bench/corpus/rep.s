@@ -0,0 +1,54 @@
+# The work of string.s done with REP string instructions: word copies, word
+# fills, a zero-byte scan and a compare of the copy against its source.
+        .code16
+        .intel_syntax noprefix
+        .text
+        .globl _start
+_start:
+
+        .equ src, 0x2000
+        .equ dst, 0x4000
+        .equ fill, 0x6000
+        .equ size, 4096
+
+        cld
+        mov ax, ds
+        mov es, ax
+
+        mov si, src             # src[i] = (i & 0x7f) | 1, then a zero
+        mov cx, size - 1
+        xor ax, ax
+1:      mov bl, al
+        and bl, 0x7f
+        or bl, 1
+        mov [si], bl
+        inc ax
+        inc si
+        loop 1b
+        mov byte ptr [si], 0
+
+        mov dx, 20000
+outer:  mov si, src             # copy
+        mov di, dst
+        mov cx, size / 2
+        rep movsw
+
+        mov di, fill            # fill
+        mov cx, size / 2
+        mov ax, 0x2020
+        rep stosw
+
+        mov di, dst             # scan
+        mov cx, size
+        xor al, al
+        repne scasb
+
+        mov si, src             # compare
+        mov di, dst
+        mov cx, size
+        repe cmpsb
+        jne 2f
+
+        dec dx
+        jnz outer
+2:      hlt
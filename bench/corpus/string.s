@@ -0,0 +1,49 @@
+# Byte copies, word fills and a zero-byte scan over 4 KiB buffers.
+        .code16
+        .intel_syntax noprefix
+        .text
+        .globl _start
+_start:
+
+        .equ src, 0x2000
+        .equ dst, 0x4000
+        .equ fill, 0x6000
+        .equ size, 4096
+
+        mov si, src             # src[i] = (i & 0x7f) | 1, then a zero
+        mov cx, size - 1
+        xor ax, ax
+1:      mov bl, al
+        and bl, 0x7f
+        or bl, 1
+        mov [si], bl
+        inc ax
+        inc si
+        loop 1b
+        mov byte ptr [si], 0
+
+        mov dx, 400
+outer:  mov si, src             # copy
+        mov di, dst
+        mov cx, size
+1:      mov al, [si]
+        mov [di], al
+        inc si
+        inc di
+        loop 1b
+
+        mov di, fill            # fill
+        mov cx, size / 2
+        mov ax, 0x2020
+2:      mov [di], ax
+        add di, 2
+        loop 2b
+
+        mov si, dst             # scan
+3:      cmp byte ptr [si], 0
+        je 4f
+        inc si
+        jmp 3b
+4:      dec dx
+        jnz outer
+        hlt
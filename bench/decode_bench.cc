@@ -0,0 +1,80 @@
+// Measures decoder throughput: decodes a code corpus from start to end, over
+// and over, and reports instructions and bytes decoded per second. The
+// corpus is the benchmark programs followed by a pseudo-random byte stream,
+// so every opcode and ModRM form shows up, not just the common ones.
+#include "corpus.h"
+#include "decoder.h"
+#include <chrono>
+
+static void append_corpus(const char *dir, std::vector<byte> &code) {
+  for (const std::string &name : list_corpus(dir)) {
+    if (!append_file(std::string(dir) + "/" + name + ".com", code)) {
+      fprintf(stderr, "Failed to read %s/%s.com.\n", dir, name.c_str());
+    }
+  }
+}
+
+static void append_random(size_t size, std::vector<byte> &code) {
+  uint32_t x = 0x8086;
+  for (size_t i = 0; i < size; ++i) {
+    x ^= x << 13;   // xorshift32
+    x ^= x >> 17;
+    x ^= x << 5;
+    code.push_back(byte(x));
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *corpus = TOY8086_BENCH_CORPUS;
+  size_t random_kb = 1024;
+  int passes = 20;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--corpus") && i + 1 < argc) corpus = argv[++i];
+    else if (!strcmp(argv[i], "--random-kb") && i + 1 < argc) {
+      random_kb = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--passes") && i + 1 < argc) {
+      passes = atoi(argv[++i]);
+    } else {
+      fprintf(stderr, "Usage: %s [--corpus DIR] [--random-kb N] "
+                      "[--passes N]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (passes < 1) passes = 1;
+
+  std::vector<byte> code;
+  append_corpus(corpus, code);
+  size_t programs = code.size();
+  append_random(random_kb << 10, code);
+  if (code.empty()) {
+    fprintf(stderr, "Nothing to decode.\n");
+    return 2;
+  }
+
+  uint64_t instrs = 0;
+  uint64_t checksum = 0;    // keeps the decoded fields alive
+  double best = 0;
+  for (int i = 0; i < passes; ++i) {
+    uint64_t n = 0;
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t pos = 0; pos < code.size();) {
+      Instr in;
+      decode_instr(code.data() + pos, code.size() - pos, in);
+      checksum += in.kind + in.disp + in.imm;
+      pos += in.length;
+      ++n;
+    }
+    double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - begin).count();
+    instrs = n;
+    if (i == 0 || seconds < best) best = seconds;
+  }
+
+  printf("corpus:       %zu bytes of programs, %zu bytes random\n",
+         programs, code.size() - programs);
+  printf("instructions: %llu per pass (checksum %llx)\n",
+         (unsigned long long) instrs, (unsigned long long) checksum);
+  printf("best pass:    %.4f s, %.1f M instructions/s, %.1f MB/s\n",
+         best, instrs / best / 1e6, code.size() / best / 1e6);
+  return 0;
+}
@@ -0,0 +1,468 @@
+// Differential check of the execution modes: runs every program under the
+// interpreter, the block cache, fused superinstructions and the JIT, and
+// compares what each leaves behind with what the interpreter does: exit
+// status, instructions retired, registers, flags, all of guest memory and
+// console output. Programs are the .com files of the directories and files
+// given (the benchmark corpus if none), then pseudo-random programs made
+// from a run of seeds. Reports the first divergence of each program, and
+// exits with 3 if there was any, so that it can gate a build.
+#include "corpus.h"
+#include "cpu.h"
+#include "loader.h"
+
+struct Mode {
+  const char *name;
+  bool block_cache;
+  bool fusion;
+  bool jit;
+};
+
+// The first one is the reference.
+static const Mode kModes[] = {
+  {"interp", false, false, false},
+  {"cache",  true,  false, false},
+  {"fused",  true,  true,  false},
+  {"jit",    true,  false, true},
+};
+
+// Where a guest is left when it stops.
+struct Outcome {
+  Cpu::ExitStatus status;
+  uint64_t retired;
+  Context ctx;
+  std::vector<byte> mem;
+  std::string output;
+};
+
+static constexpr size_t kMemorySize = Memory::kPages << Memory::kPageBits;
+
+static Outcome run(const GuestImage &image, const Mode &mode,
+                   const std::string &input, uint64_t budget) {
+  FILE *in = tmpfile();
+  if (in) {
+    fwrite(input.data(), 1, input.size(), in);
+    rewind(in);
+  }
+
+  Outcome o;
+  {
+    std::unique_ptr<Cpu> cpu(new Cpu(image));
+    cpu->out_.redirect(nullptr);    // capture what the guest prints
+    if (in) cpu->in_.redirect(in);
+    cpu->use_block_cache_ = mode.block_cache;
+    cpu->use_fusion_ = mode.fusion;
+    cpu->use_jit_ = mode.jit;
+
+    o.status = cpu->run_for(budget);
+    o.retired = cpu->retired_;
+    o.ctx = cpu->ctx_;
+    byte *mem = cpu->mem_.at<byte>(0);
+    o.mem.assign(mem, mem + kMemorySize);
+    o.output = cpu->out_.take();
+  }
+  if (in) fclose(in);
+  return o;
+}
+
+// Prints the first difference of |o| from |ref|, if any.
+static bool same(const char *program, const char *mode, const Outcome &ref,
+                 const Outcome &o) {
+  static const char *const kRegs[] = {
+    "AX", "CX", "DX", "BX", "SP", "BP", "SI", "DI",
+  };
+  static const char *const kSegs[] = {"ES", "CS", "SS", "DS"};
+  char what[96] = "";
+  if (o.status != ref.status) {
+    snprintf(what, sizeof(what), "exit status %d, not %d",
+             o.status, ref.status);
+  } else if (o.retired != ref.retired) {
+    snprintf(what, sizeof(what), "%llu instructions retired, not %llu",
+             (unsigned long long) o.retired,
+             (unsigned long long) ref.retired);
+  } else if (o.ctx.ip != ref.ctx.ip) {
+    snprintf(what, sizeof(what), "IP = %04X, not %04X",
+             o.ctx.ip, ref.ctx.ip);
+  } else if (o.ctx.flag.get() != ref.ctx.flag.get()) {
+    snprintf(what, sizeof(what), "FLAGS = %04X, not %04X",
+             o.ctx.flag.get(), ref.ctx.flag.get());
+  }
+  for (int i = 0; i < 8 && !*what; ++i) {
+    if (o.ctx.reg_all[i] != ref.ctx.reg_all[i]) {
+      snprintf(what, sizeof(what), "%s = %04X, not %04X",
+               kRegs[i], o.ctx.reg_all[i], ref.ctx.reg_all[i]);
+    }
+  }
+  for (int i = 0; i < 4 && !*what; ++i) {
+    if (o.ctx.seg.reg_seg[i] != ref.ctx.seg.reg_seg[i]) {
+      snprintf(what, sizeof(what), "%s = %04X, not %04X",
+               kSegs[i], o.ctx.seg.reg_seg[i], ref.ctx.seg.reg_seg[i]);
+    }
+  }
+  if (!*what && o.mem != ref.mem) {
+    auto d = std::mismatch(o.mem.begin(), o.mem.end(), ref.mem.begin());
+    snprintf(what, sizeof(what), "memory at %05zX = %02X, not %02X",
+             size_t(d.first - o.mem.begin()), *d.first, *d.second);
+  }
+  if (!*what && o.output != ref.output) {
+    snprintf(what, sizeof(what), "output of %zu bytes differs from the "
+             "%zu expected", o.output.size(), ref.output.size());
+  }
+  if (!*what) return true;
+  printf("%s: %s: %s\n", program, mode, what);
+  return false;
+}
+
+// Makes COM programs out of the instruction forms the execution modes treat
+// differently: ALU and MOV forms over registers and memory, flag setters
+// right before a Jcc, stack pairs, calls, and stores into the immediates of
+// instructions the loop runs again. Code only jumps forward, apart from the
+// one loop around all of it, so every program halts. Data goes to DS:8000h
+// and up, out of the way of the code.
+class Generator {
+public:
+  explicit Generator(uint32_t seed) : x_(seed * 2654435761u + 1) {}
+
+  std::vector<byte> program();
+
+private:
+  enum Kind { kBytes, kJcc, kCall, kStore };
+  struct Item {
+    Kind kind;
+    std::vector<byte> bytes;
+    byte cc;
+    size_t skip;      // kJcc: items jumped over
+    bool joined;      // to the item before; no jump lands on it
+  };
+
+  // Registers an instruction may write: the rest are the loop counter and
+  // the address registers.
+  static constexpr byte kReg16[] = {0, 2};          // AX DX
+  static constexpr byte kReg8[] = {0, 4, 2, 6};     // AL AH DL DH
+
+  uint32_t x_;
+
+  uint32_t next() {
+    x_ ^= x_ << 13;   // xorshift32
+    x_ ^= x_ >> 17;
+    x_ ^= x_ << 5;
+    return x_;
+  }
+  size_t below(size_t n) { return next() % n; }
+  bool chance(int percent) { return below(100) < size_t(percent); }
+  template<typename T, size_t N>
+  T pick(const T (&a)[N]) { return a[below(N)]; }
+  byte reg(bool is8) { return is8 ? pick(kReg8) : pick(kReg16); }
+
+  static void put16(std::vector<byte> &v, word w) {
+    v.push_back(byte(w));
+    v.push_back(byte(w >> 8));
+  }
+  void imm(std::vector<byte> &v, bool is8) {
+    if (is8) v.push_back(byte(next()));
+    else put16(v, word(next()));
+  }
+
+  void mem_operand(std::vector<byte> &v, byte r);
+  void rm_operand(std::vector<byte> &v, byte r, bool is8, bool dst);
+  Item instr();
+  Item flag_setter();
+
+  static Item bytes(std::vector<byte> v, bool joined = false) {
+    return {kBytes, std::move(v), 0, 0, joined};
+  }
+};  // Generator
+
+constexpr byte Generator::kReg16[];
+constexpr byte Generator::kReg8[];
+
+// A ModRM memory operand with register field |r|, in the data area.
+void Generator::mem_operand(std::vector<byte> &v, byte r) {
+  r <<= 3;
+  switch (below(7)) {
+    case 0: v.push_back(0x00 | r | 0); break;                    // [BX+SI]
+    case 1: v.push_back(0x00 | r | 7); break;                    // [BX]
+    case 2: v.push_back(0x00 | r | 6); put16(v, 0x8000 + below(0x200)); break;
+    case 3: v.push_back(0x40 | r | 2); v.push_back(byte(below(120) - 20)); break;
+    case 4: v.push_back(0x40 | r | 3); v.push_back(byte(below(100))); break;
+    case 5: v.push_back(0x80 | r | 4); put16(v, 0x8000 + below(0x100)); break;
+    default: v.push_back(0x40 | r | 1); v.push_back(byte(below(120))); break;
+  }
+}
+
+// A register or memory operand; a register one is one of the writable
+// registers if |dst|.
+void Generator::rm_operand(std::vector<byte> &v, byte r, bool is8, bool dst) {
+  if (chance(50)) {
+    v.push_back(0xc0 | r << 3 | (dst ? reg(is8) : below(8)));
+  } else {
+    mem_operand(v, r);
+  }
+}
+
+Generator::Item Generator::instr() {
+  static const std::vector<byte> kMisc[] = {
+    {0xd1, 0xe0}, {0xf7, 0xd2}, {0xf6, 0xe2}, {0xd0, 0xec}, {0xe4, 0x61},
+    {0x1e, 0x1f}, {0x9c, 0x58}, {0x9f}, {0xf5}, {0xf8}, {0xf9}, {0x9c, 0x9d},
+  };
+  std::vector<byte> v;
+  size_t k = below(20);
+  if (k < 6) {              // ALU Eb,Gb .. AX,Iv
+    byte form = below(6);
+    bool is8 = form % 2 == 0;
+    v.push_back(byte(below(8) << 3 | form));
+    if (form < 2) rm_operand(v, below(8), is8, true);
+    else if (form < 4) rm_operand(v, reg(is8), is8, false);
+    else imm(v, is8);
+  } else if (k < 8) {       // group 1
+    static const byte kOps[] = {0x80, 0x81, 0x83};
+    byte b = pick(kOps);
+    v.push_back(b);
+    rm_operand(v, below(8), b == 0x80, true);
+    imm(v, b != 0x81);
+  } else if (k == 8) {      // MOV E,G / G,E
+    byte b = 0x88 + below(4);
+    bool is8 = b % 2 == 0;
+    v.push_back(b);
+    if (b < 0x8a) rm_operand(v, below(8), is8, true);
+    else rm_operand(v, reg(is8), is8, false);
+  } else if (k == 9) {      // MOV E,I
+    bool is8 = chance(50);
+    v.push_back(is8 ? 0xc6 : 0xc7);
+    rm_operand(v, 0, is8, true);
+    imm(v, is8);
+  } else if (k == 10) {     // MOV r,I
+    bool is8 = chance(50);
+    v.push_back((is8 ? 0xb0 : 0xb8) + reg(is8));
+    imm(v, is8);
+  } else if (k == 11) {     // MOV AL/AX, moffs and back
+    v.push_back(0xa0 + below(4));
+    put16(v, 0x8000 + below(0x200));
+  } else if (k == 12) {     // INC / DEC
+    v.push_back(0x40 + 8 * below(2) + reg(false));
+  } else if (k == 13) {     // PUSH, then POP into a writable register
+    v.push_back(chance(90) ? 0x50 + below(8) : 0x0e);
+    v.push_back(0x58 + reg(false));
+  } else if (k == 14) {     // XCHG AX,DX / NOP
+    v.push_back(chance(50) ? 0x92 : 0x90);
+  } else if (k == 15) {     // LEA
+    v.push_back(0x8d);
+    mem_operand(v, reg(false));
+  } else if (k == 16) {
+    v = pick(kMisc);
+  } else if (k == 17) {
+    return {kJcc, {}, byte(0x70 + below(16)), 1 + below(3), false};
+  } else if (k == 18) {
+    return {kCall, {}, 0, 0, false};
+  } else {
+    return {kStore, {}, 0, 0, false};
+  }
+  return bytes(std::move(v));
+}
+
+// What fusion pairs with a Jcc: CMP, TEST, INC and DEC.
+Generator::Item Generator::flag_setter() {
+  std::vector<byte> v;
+  switch (below(10)) {
+    case 0: v.push_back(0x38 + below(4)); rm_operand(v, reg(false), false, true); break;
+    case 1: v.push_back(0x3c); imm(v, true); break;
+    case 2: v.push_back(0x3d); imm(v, false); break;
+    case 3:
+      v.push_back(chance(50) ? 0x80 : 0x83);
+      rm_operand(v, 7, false, true);
+      imm(v, true);
+      break;
+    case 4: v.push_back(0x81); rm_operand(v, 7, false, true); imm(v, false); break;
+    case 5: v.push_back(0xa8); imm(v, true); break;
+    case 6: v.push_back(0xa9); imm(v, false); break;
+    case 7: v.push_back(0xf6); rm_operand(v, 0, true, true); imm(v, true); break;
+    case 8: v.push_back(0xf7); rm_operand(v, 0, false, true); imm(v, false); break;
+    default: {
+      static const byte kIncDec[] = {0x40, 0x42, 0x48, 0x4a, 0x46, 0x4f};
+      v.push_back(pick(kIncDec));
+      break;
+    }
+  }
+  return bytes(std::move(v));
+}
+
+std::vector<byte> Generator::program() {
+  std::vector<byte> out;
+  out.push_back(0xb8); put16(out, word(next()));          // MOV AX,
+  out.push_back(0xbb); put16(out, 0x8000);                // MOV BX,
+  out.push_back(0xbe); put16(out, word(below(64)));       // MOV SI,
+  out.push_back(0xbf); put16(out, word(below(64)));       // MOV DI,
+  out.push_back(0xbd); put16(out, 0x8100);                // MOV BP,
+  out.push_back(0xba); put16(out, word(next()));          // MOV DX,
+  out.push_back(0xb9); put16(out, word(40 + below(260))); // MOV CX, the loop
+
+  std::vector<Item> items;
+  for (size_t n = 5 + below(35); n > 0; --n) {
+    Item it = instr();
+    if (it.kind == kJcc && chance(80)) items.push_back(flag_setter());
+    if (it.kind == kCall && chance(70)) {
+      // Saved around the call, as compilers do
+      static const byte kSaved[] = {0x50, 0x52, 0x56, 0x57};
+      std::vector<byte> push, pop;
+      for (size_t i = 1 + below(2); i > 0; --i) {
+        push.push_back(pick(kSaved));
+        pop.push_back(0x58 + reg(false));
+      }
+      items.push_back(bytes(push));
+      it.joined = true;
+      items.push_back(it);
+      items.push_back(bytes(pop, true));
+      continue;
+    }
+    items.push_back(it);
+    if (chance(5)) {        // a frame: PUSH BP, MOV BP,SP .. POP BP
+      items.push_back(bytes(chance(50) ? std::vector<byte>{0x55, 0x8b, 0xec}
+                                       : std::vector<byte>{0x55, 0x89, 0xe5}));
+      items.push_back(bytes({0x5d}, true));
+    }
+  }
+  static const std::vector<byte> kSteps[] = {
+    {0x46}, {0x4f}, {0x83, 0xc6, 0x01}, {0x83, 0xef, 0x02},
+    {0x81, 0xc7, 0x03, 0x00}, {0x83, 0xc0, 0xff},
+  };
+  for (size_t i = 1 + below(2); i > 0; --i) items.push_back(bytes(pick(kSteps)));
+
+  std::vector<Item> sub;
+  for (size_t n = 1 + below(5); n > 0; --n) {
+    Item it = instr();
+    if (it.kind == kBytes) sub.push_back(it);
+  }
+  if (chance(50)) sub.push_back(bytes({0x50, 0x52, 0x5a, 0x58}));
+
+  // Lay the loop out: its body, the jump back, HLT, then the subroutine.
+  size_t base = 0x100 + out.size();
+  std::vector<size_t> addrs;
+  size_t end = base;
+  for (const Item &it : items) {
+    addrs.push_back(end);
+    end += it.kind == kBytes ? it.bytes.size() : it.kind == kJcc ? 2
+         : it.kind == kCall ? 3 : 4;
+  }
+  bool short_loop = end + 2 - base < 126;
+  size_t sub_addr = end + (short_loop ? 2 : 6) + 1;
+  std::vector<size_t> immediates;     // of MOV AX/DX,Iw in the body
+  for (size_t i = 0; i < items.size(); ++i) {
+    const std::vector<byte> &b = items[i].bytes;
+    if (b.size() == 3 && (b[0] == 0xb8 || b[0] == 0xba)) {
+      immediates.push_back(addrs[i] + 1);
+    }
+  }
+
+  for (size_t i = 0; i < items.size(); ++i) {
+    const Item &it = items[i];
+    switch (it.kind) {
+      case kBytes:
+        out.insert(out.end(), it.bytes.begin(), it.bytes.end());
+        break;
+      case kJcc: {
+        size_t j = i + it.skip;
+        while (j < items.size() && items[j].joined) ++j;
+        size_t to = j < items.size() ? addrs[j] : end;
+        out.push_back(it.cc);
+        out.push_back(byte(to - (addrs[i] + 2)));
+        break;
+      }
+      case kCall:
+        out.push_back(0xe8);
+        put16(out, word(sub_addr - (addrs[i] + 3)));
+        break;
+      case kStore:          // MOV [moffs],DX
+        out.push_back(0x89);
+        out.push_back(0x16);
+        put16(out, word(immediates.empty() ? 0x8000
+                                           : immediates[below(immediates.size())]));
+        break;
+    }
+  }
+  if (short_loop) {
+    out.push_back(0xe2);    // LOOP
+    out.push_back(byte(base - (end + 2)));
+  } else {
+    out.insert(out.end(), {0x49, 0x74, 0x03, 0xe9});      // DEC CX, JZ, JMP
+    put16(out, word(base - (end + 6)));
+  }
+  out.push_back(0xf4);      // HLT
+  for (const Item &it : sub) {
+    out.insert(out.end(), it.bytes.begin(), it.bytes.end());
+  }
+  if (chance(50)) out.push_back(0xc3);                    // RET
+  else out.insert(out.end(), {0xc2, 0x00, 0x00});         // RET 0
+  return out;
+}
+
+// Runs |image| in every mode; false if any diverges from the reference.
+static bool check(const char *program, const GuestImage &image,
+                  const std::string &input, uint64_t budget) {
+  Outcome ref = run(image, kModes[0], input, budget);
+  bool ok = true;
+  for (size_t i = 1; i < sizeof(kModes) / sizeof(kModes[0]); ++i) {
+    ok = same(program, kModes[i].name, ref,
+              run(image, kModes[i], input, budget)) && ok;
+  }
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  std::vector<std::string> paths;
+  uint32_t first_seed = 1;
+  uint32_t seeds = 500;
+  uint64_t budget = 50000000;
+  std::string input = "34\n";
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--seeds") && i + 1 < argc) {
+      seeds = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--first-seed") && i + 1 < argc) {
+      first_seed = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--budget") && i + 1 < argc) {
+      budget = strtoull(argv[++i], nullptr, 0);
+    } else if (!strcmp(argv[i], "--input") && i + 1 < argc) {
+      input = argv[++i];
+    } else if (argv[i][0] != '-') {
+      paths.push_back(argv[i]);
+    } else {
+      fprintf(stderr, "Usage: %s [--seeds N] [--first-seed N] [--budget N] "
+                      "[--input TEXT]\n"
+                      "           [DIR|PROGRAM]...\n", argv[0]);
+      return 1;
+    }
+  }
+  if (paths.empty()) paths.push_back(TOY8086_BENCH_CORPUS);
+
+  // Programs from directories of .com files, and ones named directly
+  std::vector<std::string> programs;
+  for (const std::string &path : paths) {
+    std::vector<std::string> names = list_corpus(path.c_str());
+    for (const std::string &name : names) {
+      programs.push_back(path + "/" + name + ".com");
+    }
+    if (names.empty()) programs.push_back(path);
+  }
+
+  Loader loader;
+  size_t checked = 0, failed = 0;
+  for (const std::string &path : programs) {
+    std::shared_ptr<GuestImage> image = loader.load(path.c_str());
+    if (!image) {
+      fprintf(stderr, "Failed to load %s.\n", path.c_str());
+      return 2;
+    }
+    ++checked;
+    if (!check(path.c_str(), *image, input, budget)) ++failed;
+  }
+  for (uint32_t seed = first_seed; seed - first_seed < seeds; ++seed) {
+    std::vector<byte> code = Generator(seed).program();
+    std::shared_ptr<GuestImage> image = loader.load(code.data(), code.size());
+    char name[32];
+    snprintf(name, sizeof(name), "seed %u", seed);
+    ++checked;
+    if (!image || !check(name, *image, input, budget)) ++failed;
+  }
+
+  printf("%zu programs, %zu modes each: %zu diverged\n", checked,
+         sizeof(kModes) / sizeof(kModes[0]), failed);
+  return failed ? 3 : 0;
+}
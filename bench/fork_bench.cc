@@ -0,0 +1,73 @@
+// Guest startup cost: constructing and loading a Cpu from scratch versus
+// forking it from a frozen GuestImage. Prints one line per mode:
+//   <mode> instances=N startup_us=... rss_kib_per_instance=...
+#include "corpus.h"
+#include "cpu.h"
+#include <chrono>
+#include <memory>
+#include <stdlib.h>
+#include <vector>
+
+// Stores into three pages of the data segment, then halts.
+static const byte kProgram[] = {
+  0xb8, 0x34, 0x12,     // mov ax, 1234h
+  0xa3, 0x00, 0x20,     // mov [2000h], ax
+  0xa3, 0x00, 0x60,     // mov [6000h], ax
+  0xa3, 0x00, 0xa0,     // mov [a000h], ax
+  0xf4,                 // hlt
+};
+
+// Size of the stand-in for the rest of the loaded image.
+static constexpr size_t kImageBytes = 60 << 10;
+
+static void load(Cpu &cpu) {
+  cpu.ctx_.seg.cs = cpu.ctx_.seg.ds =
+    cpu.ctx_.seg.es = cpu.ctx_.seg.ss = 0x700;
+  cpu.ctx_.sp = 0xfffe;
+  cpu.ctx_.ip = 0x100;
+  byte *code = cpu.mem_.get<byte>(0x700, 0x100);
+  for (size_t i = 0; i < kImageBytes; ++i) code[i] = byte(i * 7);
+  memcpy(code, kProgram, sizeof(kProgram));
+}
+
+template<typename Make>
+static void measure(const char *mode, size_t instances, Make make) {
+  std::vector<std::unique_ptr<Cpu>> cpus;
+  cpus.reserve(instances);
+  long rss_before = memory_kib("Rss:");
+
+  double startup = 0;
+  for (size_t i = 0; i < instances; ++i) {
+    auto begin = std::chrono::steady_clock::now();
+    cpus.push_back(make());
+    startup += std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - begin).count();
+    if (cpus.back()->run() != Cpu::kExitHalt) {
+      fprintf(stderr, "%s: guest %zu did not halt\n", mode, i);
+      exit(1);
+    }
+  }
+
+  long rss = memory_kib("Rss:") - rss_before;
+  printf("%s instances=%zu startup_us=%.2f rss_kib_per_instance=%.1f\n",
+         mode, instances, startup / instances * 1e6,
+         double(rss) / instances);
+}
+
+int main(int argc, char **argv) {
+  size_t instances = argc > 1 ? atoi(argv[1]) : 256;
+
+  measure("fresh", instances, [] {
+    std::unique_ptr<Cpu> cpu(new Cpu);
+    load(*cpu);
+    return cpu;
+  });
+
+  Cpu parent;
+  load(parent);
+  std::shared_ptr<GuestImage> image = parent.freeze();
+  measure("fork", instances, [&] {
+    return std::unique_ptr<Cpu>(new Cpu(*image));
+  });
+  return 0;
+}
@@ -0,0 +1,143 @@
+// Load test for GuestLoop: thousands of guests on one thread, each an
+// interactive program that mostly waits for keys on a pipe. Reports what a
+// waiting guest costs in memory and how long a key takes to be echoed,
+// one key at a time and with every guest hit at once.
+#include "corpus.h"
+#include "guest_loop.h"
+#include "loader.h"
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <vector>
+
+// Echoes keys read through INT 21h AH=08 until 'q'.
+static const byte kEcho[] = {
+  0xb4, 0x08,         // start: mov ah, 08h
+  0xcd, 0x21,         //        int 21h
+  0x3c, 0x71,         //        cmp al, 'q'
+  0x74, 0x08,         //        je quit
+  0x88, 0xc2,         //        mov dl, al
+  0xb4, 0x02,         //        mov ah, 02h
+  0xcd, 0x21,         //        int 21h
+  0xeb, 0xf0,         //        jmp start
+  0xb8, 0x00, 0x4c,   // quit:  mov ax, 4c00h
+  0xcd, 0x21,         //        int 21h
+};
+
+struct Guest {
+  Cpu *cpu;
+  int key_fd;         // write end of its input pipe
+};
+
+static double micros(std::chrono::steady_clock::time_point begin) {
+  return std::chrono::duration<double, std::micro>(
+    std::chrono::steady_clock::now() - begin).count();
+}
+
+static double percentile(std::vector<double> v, double p) {
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size() - 1, size_t(p * v.size()))];
+}
+
+int main(int argc, char **argv) {
+  size_t guests = 4000;
+  int keys = 2000;
+  bool jit = false;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--guests") && i + 1 < argc) {
+      guests = atol(argv[++i]);
+    } else if (!strcmp(argv[i], "--keys") && i + 1 < argc) {
+      keys = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--jit")) {
+      jit = true;
+    } else {
+      fprintf(stderr, "Usage: %s [--guests N] [--keys N] [--jit]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (!guests || keys < 1) return 1;
+
+  // Two pipe ends per guest
+  rlimit files;
+  getrlimit(RLIMIT_NOFILE, &files);
+  files.rlim_cur = files.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &files);
+  if (files.rlim_cur < 2 * guests + 16) {
+    guests = (files.rlim_cur - 16) / 2;
+    printf("Limited to %zu guests by the open file limit.\n", guests);
+  }
+
+  Loader loader;
+  std::shared_ptr<GuestImage> image = loader.load(kEcho, sizeof(kEcho));
+  size_t halted = 0;
+  GuestLoop loop([&](Cpu &, Cpu::ExitStatus st) {
+    halted += st == Cpu::kExitHalt;
+  });
+
+  long memory_before = memory_kib("Pss:");
+  std::vector<Guest> all;
+  for (size_t i = 0; i < guests; ++i) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+      perror("pipe");
+      return 2;
+    }
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    std::unique_ptr<Cpu> cpu(new Cpu(*image));
+    cpu->in_.redirect(fdopen(fds[0], "rb"));
+    cpu->out_.redirect(nullptr);
+    cpu->use_jit_ = jit;
+    all.push_back(Guest{&loop.add(std::move(cpu)), fds[1]});
+  }
+  while (loop.waiting() < guests) loop.run_once(0);
+  long memory_waiting = memory_kib("Pss:");
+  printf("%zu guests waiting for input: %.1f KiB per guest\n",
+         guests, double(memory_waiting - memory_before) / guests);
+
+  // One key at a time, to a guest picked at random
+  std::vector<double> latency;
+  uint32_t x = 0x8086;
+  for (int k = 0; k < keys; ++k) {
+    x ^= x << 13;   // xorshift32
+    x ^= x >> 17;
+    x ^= x << 5;
+    Guest &g = all[x % guests];
+    size_t seen = g.cpu->out_.captured().size();
+    char key = 'a' + k % 16;   // short of 'q'
+    auto begin = std::chrono::steady_clock::now();
+    if (write(g.key_fd, &key, 1) != 1) return 2;
+    while (g.cpu->out_.captured().size() == seen) loop.run_once();
+    latency.push_back(micros(begin));
+  }
+  printf("key to echo, one at a time: p50 %.1f us, p99 %.1f us, "
+         "max %.1f us\n", percentile(latency, 0.5),
+         percentile(latency, 0.99), percentile(latency, 1.0));
+
+  // A key to every guest at once
+  auto begin = std::chrono::steady_clock::now();
+  for (Guest &g : all) {
+    if (write(g.key_fd, "z", 1) != 1) return 2;
+  }
+  do {
+    loop.run_once(0);
+  } while (loop.waiting() < guests);
+  double burst = micros(begin);
+  printf("a key to every guest at once: all echoed in %.1f ms, "
+         "%.2f us per guest\n", burst / 1e3, burst / guests);
+  printf("%.1f KiB per guest after its first keys\n",
+         double(memory_kib("Pss:") - memory_before) / guests);
+
+  for (Guest &g : all) {
+    if (write(g.key_fd, "q", 1) != 1) return 2;
+    close(g.key_fd);
+  }
+  loop.run();
+  if (halted != guests) {
+    fprintf(stderr, "Only %zu of %zu guests exited.\n", halted, guests);
+    return 3;
+  }
+  return 0;
+}
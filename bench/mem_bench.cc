@@ -0,0 +1,111 @@
+// Measures what page dirty tracking costs guest writes: the same stream of
+// byte and word stores into Memory, untracked and through Memory::mark(),
+// plus bulk writes through mark_range() and the bulk query and clear.
+#include "mem.h"
+#include <chrono>
+#include <stdlib.h>
+#include <vector>
+
+template<typename F>
+static double best_of(int runs, F f) {
+  double best = 0;
+  for (int i = 0; i < runs; ++i) {
+    auto begin = std::chrono::steady_clock::now();
+    f();
+    double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - begin).count();
+    if (i == 0 || seconds < best) best = seconds;
+  }
+  return best;
+}
+
+int main(int argc, char **argv) {
+  size_t writes = 16 << 20;
+  int runs = 5;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--writes") && i + 1 < argc) {
+      writes = atol(argv[++i]);
+    } else if (!strcmp(argv[i], "--runs") && i + 1 < argc) {
+      runs = atoi(argv[++i]);
+    } else {
+      fprintf(stderr, "Usage: %s [--writes N] [--runs N]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (runs < 1) runs = 1;
+
+  // Addresses as a guest spreads them: mostly a stack and a few data areas,
+  // now and then anywhere.
+  std::vector<dword> addrs(writes);
+  uint32_t x = 0x8086;
+  for (dword &a : addrs) {
+    x ^= x << 13;   // xorshift32
+    x ^= x >> 17;
+    x ^= x << 5;
+    static const dword kHot[] = {0x1fff0, 0x20100, 0x28000, 0xb8000};
+    a = x % 8 ? kHot[x % 4] + (x >> 20) % 0x800 : x >> 12;
+  }
+
+  Memory mem;
+  word sum = 0;
+  auto untracked = [&]() {
+    for (size_t i = 0; i < writes; ++i) {
+      if (i & 1) *mem.at<word>(addrs[i]) = word(i);
+      else *mem.at<byte>(addrs[i]) = byte(i);
+    }
+  };
+  auto tracked = [&]() {
+    for (size_t i = 0; i < writes; ++i) {
+      if (i & 1) {
+        *mem.at<word>(addrs[i]) = word(i);
+        sum += mem.mark(addrs[i], sizeof(word));
+      } else {
+        *mem.at<byte>(addrs[i]) = byte(i);
+        sum += mem.mark(addrs[i], sizeof(byte));
+      }
+    }
+  };
+
+  double plain = best_of(runs, untracked);
+  double marked = best_of(runs, tracked);
+  printf("%zu writes: untracked %.2f ns, tracked %.2f ns per write (+%.0f%%)\n",
+         writes, plain / writes * 1e9, marked / writes * 1e9,
+         (marked / plain - 1) * 100);
+
+  // 64 KiB block copies, as REP MOVSB does them
+  const size_t kBlock = 0x10000;
+  const int kCopies = 256;
+  double copy = best_of(runs, [&]() {
+    for (int i = 0; i < kCopies; ++i) {
+      dword dst = (i * 0x3100) % (0x100000 - kBlock);
+      memmove(mem.at<byte>(dst), mem.at<byte>(0x80000), kBlock);
+    }
+  });
+  double copy_marked = best_of(runs, [&]() {
+    for (int i = 0; i < kCopies; ++i) {
+      dword dst = (i * 0x3100) % (0x100000 - kBlock);
+      memmove(mem.at<byte>(dst), mem.at<byte>(0x80000), kBlock);
+      sum += mem.mark_range(dst, kBlock);
+    }
+  });
+  printf("64 KiB copies: untracked %.2f us, tracked %.2f us per copy\n",
+         copy / kCopies * 1e6, copy_marked / kCopies * 1e6);
+
+  size_t dirty = mem.count_dirty();
+  double query = best_of(runs, [&]() {
+    size_t n = 0;
+    mem.for_each_dirty([&](size_t) { ++n; });
+    sum += n;
+  });
+  double clear = best_of(runs, [&]() { mem.clear_dirty(); });
+  printf("%zu of %zu pages dirty: for_each_dirty %.2f us, clear_dirty %.2f us\n",
+         dirty, Memory::kPages, query * 1e6, clear * 1e6);
+  mem.clear_dirty();
+  query = best_of(runs, [&]() {
+    size_t n = 0;
+    mem.for_each_dirty([&](size_t) { ++n; });
+    sum += n;
+  });
+  printf("0 pages dirty: for_each_dirty %.2f us\n", query * 1e6);
+  return sum == 0xffff ? 1 : 0;   // keeps |sum| alive
+}
@@ -0,0 +1,109 @@
+// Runs the benchmark corpus through the embedding API of toy8086.h, once in
+// a single toy8086_run_for() and then in slices of a few sizes, to show what
+// giving the thread back every so many instructions costs. Every slicing
+// must retire the same instructions and print the same output.
+#include "corpus.h"
+#include "toy8086.h"
+#include <chrono>
+#include <string.h>
+
+static const uint64_t kSlices[] = {UINT64_MAX, 1000000, 10000, 100};
+
+struct Run {
+  toy8086_exit exit;
+  uint64_t instructions;
+  uint64_t slices;
+  std::string output;
+  double seconds;
+};
+
+static bool run(const std::vector<char> &program, bool jit, uint64_t slice,
+                Run &r) {
+  toy8086_guest *g = toy8086_create();
+  toy8086_use_jit(g, jit);
+  toy8086_capture_output(g);
+  if (toy8086_load(g, program.data(), program.size()) != 0) {
+    toy8086_destroy(g);
+    return false;
+  }
+
+  r.slices = 0;
+  auto begin = std::chrono::steady_clock::now();
+  do {
+    r.exit = toy8086_run_for(g, slice);
+    ++r.slices;
+  } while (r.exit == TOY8086_EXIT_BUDGET);
+  r.seconds = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - begin).count();
+
+  r.instructions = toy8086_retired(g);
+  r.output.clear();
+  char buf[4096];
+  while (size_t n = toy8086_read_output(g, buf, sizeof(buf))) {
+    r.output.append(buf, n);
+  }
+  toy8086_destroy(g);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  const char *corpus = TOY8086_BENCH_CORPUS;
+  int runs = 3;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--corpus") && i + 1 < argc) corpus = argv[++i];
+    else if (!strcmp(argv[i], "--runs") && i + 1 < argc) runs = atoi(argv[++i]);
+    else {
+      fprintf(stderr, "Usage: %s [--corpus DIR] [--runs N]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (runs < 1) runs = 1;
+
+  std::vector<std::string> programs = list_corpus(corpus);
+  if (programs.empty()) {
+    fprintf(stderr, "No programs in %s.\n", corpus);
+    return 2;
+  }
+
+  bool ok = true;
+  printf("%-12s %-6s %10s %12s %10s %10s\n",
+         "program", "mode", "slice", "slices", "seconds", "MIPS");
+  for (const std::string &name : programs) {
+    std::vector<char> program;
+    if (!append_file(std::string(corpus) + "/" + name + ".com", program)) {
+      fprintf(stderr, "Failed to read %s.\n", name.c_str());
+      ok = false;
+      continue;
+    }
+    for (bool jit : {false, true}) {
+      Run whole;
+      for (uint64_t slice : kSlices) {
+        Run best;
+        for (int i = 0; i < runs; ++i) {
+          Run r;
+          if (!run(program, jit, slice, r)) {
+            fprintf(stderr, "Failed to load %s.\n", name.c_str());
+            return 2;
+          }
+          if (i == 0 || r.seconds < best.seconds) best = r;
+        }
+        if (slice == UINT64_MAX) whole = best;
+        bool same = best.exit == whole.exit &&
+                    best.instructions == whole.instructions &&
+                    best.output == whole.output;
+        ok = ok && same && best.exit == TOY8086_EXIT_HALT;
+
+        char size[24] = "-";
+        if (slice != UINT64_MAX) {
+          snprintf(size, sizeof(size), "%llu", (unsigned long long) slice);
+        }
+        printf("%-12s %-6s %10s %12llu %10.4f %10.2f%s\n",
+               name.c_str(), jit ? "jit" : "cache", size,
+               (unsigned long long) best.slices, best.seconds,
+               best.instructions / best.seconds / 1e6,
+               same ? "" : "  (differs from a single run)");
+      }
+    }
+  }
+  return ok ? 0 : 3;
+}
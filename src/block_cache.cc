@@ -0,0 +1,88 @@
+#include "block_cache.h"
+#include <algorithm>
+
+Block &BlockCache::insert(Block &&blk) {
+  dword start = blk.start;
+  for (dword p = start >> kPageBits; p <= (blk.end - 1) >> kPageBits; ++p) {
+    pages_[p & (kPages - 1)].push_back(start);
+    tags_[p & (kPages - 1)] |= kPageCode;
+  }
+  return blocks_[start] = std::move(blk);
+}
+
+void BlockCache::watch(dword linear, size_t size, WriteWatcher *watcher) {
+  watches_.push_back({linear, dword(linear + size), watcher});
+  for (dword p = linear >> kPageBits; p <= (linear + size - 1) >> kPageBits;
+       ++p) {
+    tags_[p & (kPages - 1)] |= kPageWatched;
+  }
+}
+
+void BlockCache::map(dword linear, size_t size, MemoryDevice *device) {
+  watch(linear, size, device);
+  if (!device->traps_reads()) return;
+  readers_.push_back({linear, dword(linear + size), device});
+  // A word read from the end of the page before reaches into the device
+  dword first = ((linear - 1) & kMask) >> kPageBits;
+  dword last = ((linear + size - 1) & kMask) >> kPageBits;
+  for (dword p = first;; p = (p + 1) & (kPages - 1)) {
+    tags_[p] |= kPageDevice;
+    if (p == last) break;
+  }
+}
+
+void BlockCache::on_read(dword linear, size_t size) {
+  for (const Reader &r : readers_) {
+    if (linear < r.end && linear + size > r.start) {
+      r.device->on_read(linear, size);
+    }
+  }
+}
+
+void BlockCache::on_write(dword linear, size_t size) {
+  dword first = linear >> kPageBits;
+  dword last = ((linear + size - 1) & kMask) >> kPageBits;
+
+  for (const Watch &w : watches_) {
+    if (linear < w.end && linear + size > w.start) {
+      w.watcher->on_write(linear, size);
+    }
+  }
+
+  for (dword p = first;; p = (p + 1) & (kPages - 1)) {
+    auto it = pages_.find(p);
+    if (it != pages_.end()) {
+      for (dword start : it->second) {
+        const Block &blk = blocks_[start];
+        if (linear < blk.end && linear + size > blk.start) {
+          pending_.push_back(start);
+          stale_ = true;
+        }
+      }
+    }
+    if (p == last) break;
+  }
+}
+
+void BlockCache::flush() {
+  for (dword start : pending_) {
+    auto it = blocks_.find(start);
+    if (it == blocks_.end()) continue;   // reported more than once
+
+    const Block &blk = it->second;
+    for (dword p = start >> kPageBits; p <= (blk.end - 1) >> kPageBits; ++p) {
+      auto page = pages_.find(p & (kPages - 1));
+      auto &starts = page->second;
+      starts.erase(std::find(starts.begin(), starts.end(), start));
+      if (starts.empty()) {
+        tags_[p & (kPages - 1)] &= ~kPageCode;
+        pages_.erase(page);
+      }
+    }
+    Block *&hint = recent_[start & (kRecent - 1)];
+    if (hint == &it->second) hint = nullptr;
+    blocks_.erase(it);
+  }
+  pending_.clear();
+  stale_ = false;
+}
@@ -0,0 +1,114 @@
+#ifndef _BLOCK_CACHE_H_
+#define _BLOCK_CACHE_H_
+
+#include "decoder.h"
+#include "mem.h"
+#include <unordered_map>
+#include <vector>
+
+struct JitBlock;
+
+// A straight-line run of instructions ending at a control transfer.
+struct Block {
+  static constexpr size_t kMaxLength = 64;    // instructions
+
+  dword start;    // linear address of the first byte
+  dword end;      // linear address past the last byte
+  std::vector<Instr> instrs;
+  uint32_t hits = 0;
+  JitBlock *native = nullptr;
+};  // Block
+
+// Told about guest writes into the range it watches; see BlockCache::watch().
+class WriteWatcher {
+public:
+  virtual ~WriteWatcher() {}
+  virtual void on_write(dword linear, size_t size) = 0;
+};  // WriteWatcher
+
+// Memory other than RAM, such as ROM or the registers of a device, mapped
+// over a range of guest memory with BlockCache::map(). Its bytes stay in
+// guest memory, where the guest accesses them directly: the device hears of
+// each write after it lands, to act on it or undo it, and, if it traps
+// reads, of each read before it happens, to bring the bytes up to date.
+class MemoryDevice : public WriteWatcher {
+public:
+  virtual bool traps_reads() const { return false; }
+  virtual void on_read(dword linear, size_t size) {}
+};  // MemoryDevice
+
+// Blocks keyed by linear CS:IP. The pages holding cached code are tagged in
+// the guest Memory; writes that Memory::mark() finds tagged are to be passed
+// to on_write(). The affected blocks are dropped by the next flush() so that
+// the block being executed stays valid until the current instruction retires.
+// Writes into watched ranges are passed on to their watchers as they happen,
+// and so are reads of pages tagged kPageDevice to their devices.
+class BlockCache {
+public:
+  static constexpr size_t kPageBits = Memory::kPageBits;
+
+  // Bits of the Memory::tags() of each page
+  enum PageFlag {
+    kPageCode    = 1,
+    kPageWatched = 2,
+    kPageDevice  = 4,   // reads go to a MemoryDevice first
+  };
+
+  explicit BlockCache(byte *tags) : tags_(tags), recent_(kRecent),
+                                    stale_(false) {}
+
+  Block *find(dword linear) {
+    Block *&hint = recent_[linear & (kRecent - 1)];
+    if (hint && hint->start == linear) return hint;
+    auto it = blocks_.find(linear);
+    if (it == blocks_.end()) return nullptr;
+    return hint = &it->second;
+  }
+
+  Block &insert(Block &&blk);
+
+  // Reports a write into [|linear|, |linear| + |size|), of any size.
+  void on_write(dword linear, size_t size);
+
+  // Reports writes into [|linear|, |linear| + |size|) to |watcher|.
+  void watch(dword linear, size_t size, WriteWatcher *watcher);
+
+  // Maps |device| over [|linear|, |linear| + |size|). Devices trapping reads
+  // get their pages tagged kPageDevice, whole, and the page before as well,
+  // so that the page a read starts in tells whether to pass it to on_read().
+  void map(dword linear, size_t size, MemoryDevice *device);
+  // Reports a read of [|linear|, |linear| + |size|), of any size, starting
+  // in a page tagged kPageDevice.
+  void on_read(dword linear, size_t size);
+
+  bool stale() const { return stale_; }
+  const std::vector<dword> &pending() const { return pending_; }
+  void flush();
+
+private:
+  static constexpr size_t kMask = (1 << 20) - 1;
+  static constexpr size_t kPages = Memory::kPages;
+  static constexpr size_t kRecent = 1024;
+
+  struct Watch {
+    dword start, end;
+    WriteWatcher *watcher;
+  };
+  struct Reader {
+    dword start, end;
+    MemoryDevice *device;
+  };
+
+  std::unordered_map<dword, Block> blocks_;
+  std::vector<Watch> watches_;
+  std::vector<Reader> readers_;             // devices trapping reads
+  // Page -> start of the blocks in it. Sparse, as guests are many and their
+  // code pages few; only tagged pages are ever looked up.
+  std::unordered_map<dword, std::vector<dword>> pages_;
+  byte *tags_;                              // Memory::tags()
+  std::vector<Block *> recent_;             // direct-mapped in front of blocks_
+  std::vector<dword> pending_;
+  bool stale_;
+};  // BlockCache
+
+#endif
@@ -0,0 +1,67 @@
+#include "clock.h"
+#include <algorithm>
+#include <ctime>
+#include <thread>
+
+void Clock::set_mode(Mode mode) {
+  mode_ = mode;
+  started_ = false;
+  start_ticks_ = 0;
+  if (mode == kRealTime) {
+    time_t now = time(NULL);
+    struct tm *local = localtime(&now);
+    start_ticks_ = (local->tm_hour * 3600 + local->tm_min * 60 +
+                    local->tm_sec) * uint64_t(kTicksPerDay) / (24 * 60 * 60);
+  }
+}
+
+dword Clock::ticks(uint64_t cycles, bool &midnight) {
+  uint64_t ticks = start_ticks_ + cycles / kCyclesPerTick;
+  uint64_t days = ticks / kTicksPerDay;
+  midnight = days != days_;
+  days_ = days;
+  return ticks % kTicksPerDay;
+}
+
+void Clock::pace(uint64_t cycles) {
+  if (mode_ != kRealTime) return;
+
+  auto now = std::chrono::steady_clock::now();
+  if (!started_) {
+    started_ = true;
+    start_ = now;
+    start_cycles_ = cycles;
+    return;
+  }
+  auto guest = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+    std::chrono::duration<double>(double(cycles - start_cycles_) / kHz));
+  if (now - start_ < guest) std::this_thread::sleep_for(guest - (now - start_));
+}
+
+void Throttle::set_hz(uint64_t hz) {
+  hz_ = hz;
+  batch_ = std::max<uint64_t>(hz / kBatchesPerSecond, 1);
+  next_ = hz ? 0 : UINT64_MAX;
+  started_ = false;
+}
+
+void Throttle::wait(uint64_t cycles) {
+  // The guest may fall this far behind before pacing starts over from now
+  constexpr std::chrono::milliseconds kMaxLag(100);
+
+  auto now = std::chrono::steady_clock::now();
+  if (started_) {
+    auto guest =
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(double(cycles - start_cycles_) / hz_));
+    auto host = now - start_;
+    if (host < guest) std::this_thread::sleep_for(guest - host);
+    else if (host - guest > kMaxLag) started_ = false;
+  }
+  if (!started_) {
+    started_ = true;
+    start_ = now;
+    start_cycles_ = cycles;
+  }
+  next_ = cycles + batch_;
+}
@@ -0,0 +1,75 @@
+#ifndef _CLOCK_H_
+#define _CLOCK_H_
+
+#include "helper.h"
+#include <chrono>
+
+// Guest time, counted in CPU cycles of a 4.77 MHz PC rather than read from
+// the host. The BIOS tick count follows from it, so a run sees the same
+// clock every time. In real-time mode the guest is also kept from getting
+// ahead of the host: reading the clock waits for the host to catch up.
+class Clock {
+public:
+  static constexpr uint64_t kHz = 4772727;
+  // The PIT runs at kHz / 4 and counter 0 wraps every 65536 counts.
+  static constexpr uint64_t kCyclesPerTick = 4 << 16;
+  static constexpr dword kTicksPerDay = 0x1800b0;
+  // Without TOY8086_CYCLES, every instruction counts as this many.
+  static constexpr uint64_t kCyclesPerInstruction = 12;
+
+  enum Mode {
+    kFastForward,   // never waits; the day starts at midnight
+    kRealTime,      // paced to the host; the day starts at host local time
+  };
+
+  explicit Clock(Mode mode = kFastForward) { set_mode(mode); }
+
+  Mode mode() const { return mode_; }
+  void set_mode(Mode mode);
+
+  // BIOS tick count since midnight at guest time |cycles|. |midnight| tells
+  // whether a midnight passed since the last call.
+  dword ticks(uint64_t cycles, bool &midnight);
+
+  // In real-time mode, sleeps until the host has spent as long as the
+  // guest since the first call.
+  void pace(uint64_t cycles);
+
+private:
+  Mode mode_;
+  uint64_t start_ticks_;      // ticks since midnight at cycle 0
+  uint64_t days_ = 0;         // midnights reported so far
+  bool started_ = false;      // host time to pace against is known
+  uint64_t start_cycles_ = 0;
+  std::chrono::steady_clock::time_point start_;
+};  // Clock
+
+// Keeps the guest from running faster than a target clock rate. Checked as
+// execution goes, it only looks at the host clock once per batch of guest
+// cycles, and then sleeps off whatever the batch got ahead, so the guest
+// runs in short bursts rather than sleeping per instruction. Time the guest
+// spent stalled (on input, say) is not made up for afterwards.
+class Throttle {
+public:
+  static constexpr uint64_t kBatchesPerSecond = 500;
+
+  // 0 to run unthrottled.
+  void set_hz(uint64_t hz);
+  bool enabled() const { return hz_ != 0; }
+
+  void pace(uint64_t cycles) {
+    if (cycles >= next_) wait(cycles);
+  }
+
+private:
+  void wait(uint64_t cycles);
+
+  uint64_t hz_ = 0;
+  uint64_t batch_ = 0;
+  uint64_t next_ = UINT64_MAX;  // cycles at which to check the host clock
+  bool started_ = false;
+  uint64_t start_cycles_ = 0;
+  std::chrono::steady_clock::time_point start_;
+};  // Throttle
+
+#endif
@@ -0,0 +1,107 @@
+#include "console.h"
+#include <cerrno>
+#ifdef TOY8086_UNIX
+#  include <poll.h>
+#endif
+#ifdef TOY8086_WIN32
+#  include <io.h>
+#endif
+
+void Console::flush() {
+  if (!sink_ || buf_.empty()) return;
+  fwrite(buf_.data(), 1, buf_.size(), sink_);
+  fflush(sink_);
+  buf_.clear();
+}
+
+static bool is_terminal(FILE *f) {
+#ifdef TOY8086_UNIX
+  return isatty(fileno(f));
+#elif defined(TOY8086_WIN32)
+  return _isatty(_fileno(f));
+#else
+  return false;
+#endif
+}
+
+ConsoleIn::ConsoleIn(FILE *source)
+    : source_(source), tty_(is_terminal(source)) {}
+
+void ConsoleIn::redirect(FILE *source) {
+  release();
+  source_ = source;
+  tty_ = is_terminal(source);
+  head_ = tail_ = 0;
+}
+
+void ConsoleIn::release() {
+#ifdef TOY8086_UNIX
+  if (raw_) tcsetattr(fileno(source_), TCSANOW, &saved_);
+#endif
+  raw_ = false;
+}
+
+#ifdef TOY8086_UNIX
+// Without line mode, a terminal has input as soon as a key is pressed.
+void ConsoleIn::make_raw() {
+  int fd = fileno(source_);
+  if (tty_ && !raw_ && tcgetattr(fd, &saved_) == 0) {
+    termios raw = saved_;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    raw_ = tcsetattr(fd, TCSANOW, &raw) == 0;
+  }
+}
+#endif
+
+bool ConsoleIn::ready() {
+  if (head_ != tail_) return true;
+#ifdef TOY8086_UNIX
+  make_raw();
+  pollfd p = {fileno(source_), POLLIN, 0};
+  int n;
+  do {
+    n = poll(&p, 1, 0);
+  } while (n < 0 && errno == EINTR);
+  return n != 0;    // errors are left for the read to report
+#else
+  return true;
+#endif
+}
+
+// Called with the ring empty; reads into the room up to its end.
+bool ConsoleIn::fill() {
+  if (!ring_) ring_.reset(new char[kBufferSize]);
+  char *at = &ring_[tail_ & (kBufferSize - 1)];
+  size_t room = kBufferSize - (tail_ & (kBufferSize - 1));
+
+#ifdef TOY8086_UNIX
+  int fd = fileno(source_);
+  make_raw();
+  ssize_t n;
+  do {
+    n = read(fd, at, room);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) return false;
+#else
+  size_t n;
+  if (tty_) {
+#  ifdef TOY8086_MSVC
+    *at = static_cast<char>(_getch());
+    n = 1;
+#  else
+    int c = fgetc(source_);
+    if (c == EOF) return false;
+    *at = static_cast<char>(c);
+    n = 1;
+#  endif
+  } else {
+    n = fread(at, 1, room, source_);
+    if (!n) return false;
+  }
+#endif
+
+  tail_ += n;
+  return true;
+}
@@ -0,0 +1,108 @@
+#ifndef _CONSOLE_H_
+#define _CONSOLE_H_
+
+#include "helper.h"
+#include <memory>
+#include <string>
+
+// Console output of a guest. Bytes collect in a buffer that reaches the sink
+// in large writes: when it fills up, before the guest reads input and when
+// the guest stops. Without a sink the output is captured in memory instead.
+class Console {
+public:
+  static constexpr size_t kFlushSize = 64 << 10;
+
+  explicit Console(FILE *sink = stdout) : sink_(sink) {}
+  ~Console() { flush(); }
+
+  Console(const Console &) = delete;
+  Console &operator=(const Console &) = delete;
+
+  void put(char c) {
+    buf_ += c;
+    if (buf_.size() >= kFlushSize) flush();
+  }
+
+  void write(const char *s, size_t n) {
+    buf_.append(s, n);
+    if (buf_.size() >= kFlushSize) flush();
+  }
+
+  // Hands the buffered output to the sink. Nothing to do when capturing.
+  void flush();
+
+  // Sends output written from now on to |sink|; null captures it.
+  void redirect(FILE *sink) {
+    flush();
+    sink_ = sink;
+  }
+
+  bool capturing() const { return !sink_; }
+
+  // Output captured so far. take() also clears it.
+  const std::string &captured() const { return buf_; }
+  std::string take() {
+    std::string out;
+    out.swap(buf_);
+    return out;
+  }
+
+private:
+  FILE *sink_;
+  std::string buf_;
+};  // Console
+
+// Console input of a guest. Bytes come out of a ring buffer refilled in
+// blocks of whatever the source has ready, so piped input costs a read per
+// block rather than per byte. A terminal source is put into raw mode (no
+// line editing, no echo) on the first read and restored by release().
+class ConsoleIn {
+public:
+  static constexpr size_t kBufferSize = 64 << 10;   // a power of 2
+
+  explicit ConsoleIn(FILE *source = stdin);
+  ~ConsoleIn() { release(); }
+
+  ConsoleIn(const ConsoleIn &) = delete;
+  ConsoleIn &operator=(const ConsoleIn &) = delete;
+
+  // The next byte, or -1 at the end of the input.
+  int get() {
+    if (head_ == tail_ && !fill()) return -1;
+    return static_cast<byte>(ring_[head_++ & (kBufferSize - 1)]);
+  }
+
+  // True if the source is a terminal, which does not echo by itself.
+  bool interactive() const { return tty_; }
+
+  // True if get() would not block: a byte is buffered, or the source has
+  // more or is at its end. Always true where that can't be told.
+  bool ready();
+#ifdef TOY8086_UNIX
+  // To wait for the source with, e.g. in poll().
+  int fd() const { return fileno(source_); }
+#endif
+
+  // Reads from |source| from now on, dropping anything buffered.
+  void redirect(FILE *source);
+
+  // Gives a terminal back its own settings.
+  void release();
+
+private:
+  bool fill();
+#ifdef TOY8086_UNIX
+  void make_raw();
+#endif
+
+  FILE *source_;
+  bool tty_;
+  bool raw_ = false;
+#ifdef TOY8086_UNIX
+  termios saved_;
+#endif
+  std::unique_ptr<char[]> ring_;  // allocated on the first read
+  size_t head_ = 0, tail_ = 0;    // free running; masked on access
+};  // ConsoleIn
+
+#endif
@@ -1,8 +1,38 @@
 #include "cpu.h"
-#ifdef TOY8086_WIN32
-#  include <windows.h>
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__GNUC__) && !defined(TOY8086_SWITCH_DISPATCH)
+#  define TOY8086_THREADED_DISPATCH
+#endif
+
+// Counts an instruction about to retire; IP still points to it. UNRETIRE
+// takes the count back once IP points to it again.
+#ifdef TOY8086_PROFILE
+#  define PROFILE_RETIRE(in)                                  \
+  (++handler_hits_[(in).handler],                             \
+   ++ip_hits_[linear(ctx_.seg.cs, ctx_.ip)])
+#  define PROFILE_UNRETIRE(in)                                \
+  (--handler_hits_[(in).handler],                             \
+   --ip_hits_[linear(ctx_.seg.cs, ctx_.ip)])
+#else
+#  define PROFILE_RETIRE(in) ((void) 0)
+#  define PROFILE_UNRETIRE(in) ((void) 0)
+#endif
+
+// Adds the decode-time cycles of an instruction about to retire, and the
+// cycles that depend on how it executes. UNRETIRE takes the decode-time
+// ones back from an instruction that did not retire after all.
+#ifdef TOY8086_CYCLES
+#  define CYCLES_RETIRE(in) (cycles_ += (in).cycles)
+#  define CYCLES_UNRETIRE(in) (cycles_ -= (in).cycles)
+#  define ADD_CYCLES(n) (cycles_ += (n))
+#else
+#  define CYCLES_RETIRE(in) ((void) 0)
+#  define CYCLES_UNRETIRE(in) ((void) 0)
+#  define ADD_CYCLES(n) ((void) 0)
 #endif
-#include <ctime>
 
 template<typename T>
 constexpr int sgnbit() {
@@ -12,76 +42,49 @@ constexpr int sgnbit() {
 template<typename T>
 inline void Cpu::op_add(T &dst, T &src) {
   T sum = dst + src;
-
-  // Algorithm for setting the overflow flag:
-  //    if dst and src have different signs (dst ^ src), won't overflow
-  //    if dst and src have the same sign (dst ^ src ^ 0x80)
-  //        if the result have different sign (sum ^ src)
-  //            set OF = 1
-  //
-  // finally, only keep the sign bit (& 0x80) and ignore other bits
-  ctx_.flag.o = (dst ^ src ^ sgnbit<T>()) & (sum ^ src) & sgnbit<T>();
-  ctx_.flag.c = sum < src;
-  ctx_.flag.set_a(dst, src, sum);
-  ctx_.flag.set_szp(sum);
+  ctx_.flag.set_lazy(Flag::kOpAdd, dst, src, sum);
   dst = sum;
 }
 
 template<typename T>
 inline void Cpu::op_adc(T &dst, T &src) {
-  T sum = dst + src + ctx_.flag.c;
-  ctx_.flag.o = (dst ^ src ^ sgnbit<T>()) & ((sum ^ src) & sgnbit<T>());
-  ctx_.flag.c = (sum < src) | (sum == src && ctx_.flag.c);
-  ctx_.flag.set_a(dst, src, sum);
-  ctx_.flag.set_szp(sum);
+  bool c = ctx_.flag.c();
+  T sum = dst + src + c;
+  ctx_.flag.set_lazy(Flag::kOpAdc, dst, src, sum, c);
   dst = sum;
 }
 
 template<typename T>
 inline void Cpu::op_sub(T &dst, T &src) {
   T result = dst - src;
-  ctx_.flag.c = result > dst;
-
-  // Algorithm for setting the overflow flag (result = dst - src):
-  //    if dst and src have the same sign, won't overflow
-  //    if dst and src have different signs
-  //        if result and dst have different sign
-  //            set OF = 1
-  ctx_.flag.o = (dst ^ src) & (result ^ dst) & sgnbit<T>();
-  ctx_.flag.set_a(dst, src, result);
-  ctx_.flag.set_szp(result);
+  ctx_.flag.set_lazy(Flag::kOpSub, dst, src, result);
   dst = result;
 }
 
 template<typename T>
 inline void Cpu::op_sbb(T &dst, T &src) {
-  T result = dst - src - ctx_.flag.c;
-  ctx_.flag.c = (result > dst) | (ctx_.flag.c && result == dst);
-  ctx_.flag.o = (dst ^ src) & (result ^ dst) & sgnbit<T>();
-  ctx_.flag.set_a(dst, src, result);
-  ctx_.flag.set_szp(result);
+  bool c = ctx_.flag.c();
+  T result = dst - src - c;
+  ctx_.flag.set_lazy(Flag::kOpSbb, dst, src, result, c);
   dst = result;
 }
 
 template<typename T>
 inline void Cpu::op_and(T &dst, T &src) {
   dst &= src;
-  ctx_.flag.c = ctx_.flag.o = 0;
-  ctx_.flag.set_szp(dst);
+  ctx_.flag.set_lazy(Flag::kOpLogic, dst, src, dst);   // AF is undefined
 }
 
 template<typename T>
 inline void Cpu::op_or(T &dst, T &src) {
   dst |= src;
-  ctx_.flag.c = ctx_.flag.o = 0;
-  ctx_.flag.set_szp(dst);
+  ctx_.flag.set_lazy(Flag::kOpLogic, dst, src, dst);   // AF is undefined
 }
 
 template<typename T>
 inline void Cpu::op_xor(T &dst, T &src) {
   dst ^= src;
-  ctx_.flag.c = ctx_.flag.o = 0;
-  ctx_.flag.set_szp(dst);
+  ctx_.flag.set_lazy(Flag::kOpLogic, dst, src, dst);   // AF is undefined
 }
 
 template<typename T>
@@ -94,6 +97,20 @@ inline void Cpu::op_test(T dst, T src) {
   op_and(dst, src);
 }
 
+template<typename T>
+inline void Cpu::op_inc(T &dst) {   // keeps CF
+  T result = dst + 1;
+  ctx_.flag.set_lazy(Flag::kOpInc, dst, T(1), result, ctx_.flag.c());
+  dst = result;
+}
+
+template<typename T>
+inline void Cpu::op_dec(T &dst) {   // keeps CF
+  T result = dst - 1;
+  ctx_.flag.set_lazy(Flag::kOpDec, dst, T(1), result, ctx_.flag.c());
+  dst = result;
+}
+
 template<typename T>
 inline void Cpu::op_not(T &dst) {
   dst = ~dst;
@@ -127,8 +144,8 @@ void Cpu::op_rcr(T &dst, T src) {
 template<typename T>
 void Cpu::op_shl(T &dst, T src) {
   T ret = dst << src;
-  ctx_.flag.c = dst & (1 << src);
-  ctx_.flag.o = (dst ^ ret) & sgnbit<T>();
+  ctx_.flag.set_c(dst & (1 << src));
+  ctx_.flag.set_o((dst ^ ret) & sgnbit<T>());
   // XXX AF
   ctx_.flag.set_szp(ret);
   dst = ret;
@@ -137,8 +154,8 @@ void Cpu::op_shl(T &dst, T src) {
 template<typename T>
 void Cpu::op_shr(T &dst, T src) {
   T ret = dst >> src;
-  if (src > 0) ctx_.flag.c = false;
-  ctx_.flag.o = (dst ^ ret) & sgnbit<T>();
+  if (src > 0) ctx_.flag.set_c(false);
+  ctx_.flag.set_o((dst ^ ret) & sgnbit<T>());
   // XXX AF
   ctx_.flag.set_szp(dst);
   dst = ret;
@@ -239,11 +256,13 @@ inline void Cpu::op_idiv(word imm) {
 
 inline void Cpu::op_push(word data) {
   ctx_.sp -= sizeof(word);
-  *mem_.get<word>(ctx_.seg.get(Segment::kSegSs), ctx_.sp) = data;
+  *mem_.get<word>(ctx_.seg.ss, ctx_.sp) = data;
+  on_write(linear(ctx_.seg.ss, ctx_.sp), sizeof(word));
 }
 
 inline void Cpu::op_pop(word &data) {
-  data = *mem_.get<word>(ctx_.seg.get(Segment::kSegSs), ctx_.sp);
+  on_read(linear(ctx_.seg.ss, ctx_.sp), sizeof(word));
+  data = *mem_.get<word>(ctx_.seg.ss, ctx_.sp);
   ctx_.sp += sizeof(word);
 }
 
@@ -254,34 +273,205 @@ inline void Cpu::op_xchg(word &dst, word &src) {
 }
 
 template<typename D, typename S> void Cpu::op_in(D &dst, S src) {
-  switch (src) {
-    case 0x61:
-      dst = (D) player_.device_8255;
-      break;
+  uint32_t v;
+  if (replay(kTracePort, v)) {
+    dst = D(v);
+    return;
   }
-  // XXX
+  word port = src;
+  v = io_.in(port, cycles());
+  if (sizeof(D) == 2) v |= io_.in(word(port + 1), cycles()) << 8;
+  dst = D(v);
+  record(kTracePort, v);
 };
 
 template<typename D, typename S> void Cpu::op_out(D dst, S &src) {
-  switch (dst) {
-    case 0x61:
-      player_.device_8255 = src;
-      player_.playing = (player_.device_8255 & 0x3) == 0x3;
+  word port = dst;
+  io_.out(port, byte(src), cycles());
+  if (sizeof(S) == 2) io_.out(word(port + 1), byte(src >> 8), cycles());
+};
+
+// String instructions; |op| is the byte form of the opcode. REP repeats them
+// CX times, and CMPS / SCAS also stop once ZF no longer matches the prefix.
+template<typename T>
+void Cpu::op_string(const Instr &in, byte op) {
+  const bool rep = in.prefix & (Instr::kPfxRepe | Instr::kPfxRepne);
+  const word src_seg = ctx_.seg.reg_seg[in.seg];
+  if (rep && (!ctx_.c.x || op_string_bulk<T>(op, in.prefix, src_seg))) {
+    return;
+  }
+
+  const word step = ctx_.flag.d ? word(-sizeof(T)) : word(sizeof(T));
+  T &acc = *reinterpret_cast<T *>(&ctx_.a.x);
+  for (;;) {
+    T *src = mem_.get<T>(src_seg, ctx_.si);
+    T *dst = mem_.get<T>(ctx_.seg.es, ctx_.di);
+    if (op != 0xaa) {
+      if (op != 0xae) on_read(linear(src_seg, ctx_.si), sizeof(T));
+      if (op == 0xa6 || op == 0xae) {
+        on_read(linear(ctx_.seg.es, ctx_.di), sizeof(T));
+      }
+    }
+    switch (op) {
+      case 0xa4: *dst = *src;             break;   // movs
+      case 0xa6: op_cmp<T>(*src, *dst);   break;   // cmps
+      case 0xaa: *dst = acc;              break;   // stos
+      case 0xac: acc = *src;              break;   // lods
+      case 0xae: op_cmp<T>(acc, *dst);    break;   // scas
+    }
+    if (op == 0xa4 || op == 0xaa) {
+      on_write(linear(ctx_.seg.es, ctx_.di), sizeof(T));
+    }
+    if (op != 0xaa && op != 0xae) ctx_.si += step;
+    if (op != 0xac) ctx_.di += step;
+    if (rep) ADD_CYCLES(rep_cycles(op));
+
+    if (!rep || !--ctx_.c.x) return;
+    if ((op == 0xa6 || op == 0xae) &&
+        ctx_.flag.z() != bool(in.prefix & Instr::kPfxRepe)) {
+      return;
+    }
+  }
+}
+
+// Runs a REP string instruction with CX != 0 in one go on guest memory.
+// Returns false, leaving it to the element loop, if a run wraps around its
+// segment or the end of memory, or if a MOVS overlaps so that the result
+// depends on the element order.
+template<typename T>
+bool Cpu::op_string_bulk(byte op, byte prefix, word src_seg) {
+  constexpr size_t kSize = sizeof(T);
+  const size_t n = ctx_.c.x;
+  const size_t span = n * kSize;
+  const bool backward = ctx_.flag.d;
+  const bool uses_si = op == 0xa4 || op == 0xa6 || op == 0xac;
+  const bool uses_di = op != 0xac;
+
+  // Linear address of the lowest byte the run from |seg|:|off| touches,
+  // or -1 if the run wraps.
+  auto run = [&](word seg, word off) -> long {
+    long lo = backward ? long(off) - long(span - kSize) : long(off);
+    if (lo < 0 || lo + span > 0x10000) return -1;
+    long start = (long(seg) << 4) + lo;
+    return start + span <= 0x100000 ? start : -1;
+  };
+  long src = uses_si ? run(src_seg, ctx_.si) : 0;
+  long dst = uses_di ? run(ctx_.seg.es, ctx_.di) : 0;
+  if (src < 0 || dst < 0) return false;
+
+  if (trap_reads_) {    // each element is a read of its own
+    if (op != 0xaa && op != 0xae &&
+        (mem_.tags_in_range(src, span) & BlockCache::kPageDevice)) {
+      return false;
+    }
+    if ((op == 0xa6 || op == 0xae) &&
+        (mem_.tags_in_range(dst, span) & BlockCache::kPageDevice)) {
+      return false;
+    }
+  }
+
+  byte *s = mem_.at<byte>(src);
+  byte *d = mem_.at<byte>(dst);
+  // Offset into the runs of the |i|th element processed
+  auto pos = [&](size_t i) {
+    return backward ? span - kSize - i * kSize : i * kSize;
+  };
+
+  size_t done = n;
+  switch (op) {
+    case 0xa4:    // movs
+      if (backward ? dst < src && src < dst + long(span)
+                   : src < dst && dst < src + long(span)) {
+        return false;   // copies elements it has written itself
+      }
+      memmove(d, s, span);
+      on_write_range(dst, span);
       break;
-    case 0x42: {
-      static word freq_dividend = 0xffff;
-      static bool writing = false;
-      if (!writing) freq_dividend = (freq_dividend & 0xff00) | src;
-      else freq_dividend = (freq_dividend & 0x00ff) | (src << 8);
-      writing = !writing;
-      if (!writing) {
-        player_.frequency = 0x122870u / freq_dividend;
+
+    case 0xaa: {  // stos
+      T v = T(ctx_.a.x);
+      if (kSize == 1 || byte(v) == byte(v >> 8)) {
+        memset(d, byte(v), span);
+      } else {    // double the filled part until it covers the run
+        memcpy(d, &v, kSize);
+        for (size_t filled = kSize; filled < span; filled *= 2) {
+          memcpy(d + filled, d, std::min(filled, span - filled));
+        }
       }
+      on_write_range(dst, span);
+      break;
+    }
+
+    case 0xac:    // lods: only the last element sticks
+      memcpy(&ctx_.a.x, s + pos(n - 1), kSize);
+      break;
+
+    default: {    // cmps, scas: find the element ending the repeat
+      const bool repe = prefix & Instr::kPfxRepe;
+      const T acc = T(ctx_.a.x);
+      auto lhs = [&](size_t i) {
+        T v = acc;
+        if (op == 0xa6) memcpy(&v, s + pos(i), kSize);
+        return v;
+      };
+      auto rhs = [&](size_t i) {
+        T v;
+        memcpy(&v, d + pos(i), kSize);
+        return v;
+      };
+
+      size_t i = 0;
+      if (op == 0xae && kSize == 1 && !repe && !backward) {   // repne scasb
+        const void *hit = memchr(d, acc, span);
+        i = hit ? static_cast<const byte *>(hit) - d : n - 1;
+      } else {
+        if (op == 0xa6 && repe && !backward) {    // repe cmps
+          constexpr size_t kChunk = 64;
+          size_t same = 0;
+          while (span - same > kChunk && !memcmp(s + same, d + same, kChunk)) {
+            same += kChunk;
+          }
+          i = same / kSize;
+        }
+        while (i < n - 1 && (lhs(i) == rhs(i)) == repe) ++i;
+      }
+      op_cmp<T>(lhs(i), rhs(i));
+      done = i + 1;
       break;
     }
-    // FIXME: Yes, I ignored out 43 for ease.
   }
-};
+
+  word delta = word(done * kSize);
+  if (backward) delta = -delta;
+  if (uses_si) ctx_.si += delta;
+  if (uses_di) ctx_.di += delta;
+  ctx_.c.x -= done;
+  ADD_CYCLES(done * rep_cycles(op));
+  return true;
+}
+
+bool Cpu::open_display(FILE *out, const char *shared_path) {
+  // Blank, as at boot, unless the guest (or a restored state) has been there
+  byte *vram = mem_.at<byte>(TextDisplay::kBase);
+  if (vram[0] == 0xcc && !memcmp(vram, vram + 1, TextDisplay::kSize - 1)) {
+    for (size_t i = 0; i < TextDisplay::kSize; i += 2) {
+      vram[i] = ' ';
+      vram[i + 1] = 0x07;
+    }
+    mem_.mark_range(TextDisplay::kBase, TextDisplay::kSize);
+  }
+  display_.reset(new TextDisplay(vram, out));
+  cache_.watch(TextDisplay::kBase, TextDisplay::kSize, display_.get());
+  return !shared_path || display_->share(shared_path);
+}
+
+void Cpu::map_memory(dword linear, size_t size, MemoryDevice *device) {
+  cache_.map(linear, size, device);
+  if (device->traps_reads()) {
+    trap_reads_ = true;
+    jit_.trap_reads(true);
+  }
+}
 
 void Cpu::dump_status() {
   fprintf(stderr, "AX = %04X CX = %04X DX = %04X BX = %04X\n",
@@ -292,8 +482,8 @@ void Cpu::dump_status() {
           ctx_.seg.cs, ctx_.seg.ss, ctx_.seg.ds,
           ctx_.seg.es, ctx_.seg.fs, ctx_.seg.gs);
   fprintf(stderr, "OF = %d SF = %d ZF = %d AF = %d PF = %d CF = %d\n",
-          ctx_.flag.o, ctx_.flag.s, ctx_.flag.z,
-          ctx_.flag.a, ctx_.flag.p, ctx_.flag.c);
+          ctx_.flag.o(), ctx_.flag.s(), ctx_.flag.z(),
+          ctx_.flag.a(), ctx_.flag.p(), ctx_.flag.c());
 }
 
 #define EXECUTE_OP2(_fn)                                     \
@@ -306,506 +496,1082 @@ void Cpu::dump_status() {
   else         op_##_fn(to_word(dst));  \
   break
 
-Cpu::ExitStatus Cpu::run() {
-  for (;;) {
-    byte b = fetch();
-    switch (b) {
-      // Prefixes
-      case 0xf0: pfx_.lock  = true; continue;
-      case 0xf2: pfx_.repne = true; continue;
-      case 0xf3: pfx_.repe  = true; continue;
-      case 0x26: ctx_.seg.set(Segment::kSegEs); continue;
-      case 0x36: ctx_.seg.set(Segment::kSegSs); continue;
-      case 0x2e: ctx_.seg.set(Segment::kSegCs); continue;
-      case 0x3e: ctx_.seg.set(Segment::kSegDs); continue;
-
-      case 0x80: case 0x81: case 0x82: case 0x83: {   // group 1
-        byte modrm = fetch();
-
-        // 80 82 -> Eb Ib
-        // 81    -> Ev Iv
-        // 83    -> Ev Ib
-        bool is_8bit;
-        word src;
-        switch (b) {
-          case 0x80:
-          case 0x82:
-            src = fetch();
-            is_8bit = true;
-            break;
-
-          case 0x81:
-            src = fetchw();
-            is_8bit = false;
-            break;
-
-          case 0x83:
-            src = fetch();
-            is_8bit = false;
-            break;
-        }
-        void *dst = decode_rm(modrm, is_8bit);
-
-        switch ((modrm >> 3) & 7) {   // group 1
-          case 0: EXECUTE_OP2(add);
-          case 1: EXECUTE_OP2(or);
-          case 2: EXECUTE_OP2(adc);
-          case 3: EXECUTE_OP2(sbb);
-          case 4: EXECUTE_OP2(and);
-          case 5: EXECUTE_OP2(sub);
-          case 6: EXECUTE_OP2(xor);
-          case 7: EXECUTE_OP2(cmp);
-        }
-        goto next_instr;
+// Group opcodes get a handler per ModRM reg field after the 256 opcodes.
+static word handler_index(byte b, byte modrm) {
+  int group;
+  switch (b) {
+    case 0x80: case 0x81: case 0x82: case 0x83:
+      group = b - 0x80;
+      break;
+    case 0xd0: case 0xd1: case 0xd2: case 0xd3:
+      group = b - 0xd0 + 4;
+      break;
+    case 0xf6: case 0xf7:
+      group = b - 0xf6 + 8;
+      break;
+    default:
+      return b;
+  }
+  return 256 + group * 8 + ((modrm >> 3) & 7);
+}
+
+#ifdef TOY8086_PROFILE
+// Group opcodes in the order of their handlers
+static const byte kGroupOpcodes[] = {
+  0x80, 0x81, 0x82, 0x83, 0xd0, 0xd1, 0xd2, 0xd3, 0xf6, 0xf7,
+};
+
+void Cpu::dump_profile(size_t top) {
+  auto dump = [&](const char *title, const uint64_t *hits, size_t n,
+                  void (*name)(size_t, char *)) {
+    std::vector<std::pair<uint64_t, size_t>> hot;
+    for (size_t i = 0; i < n; ++i) {
+      if (hits[i]) hot.emplace_back(hits[i], i);
+    }
+    size_t shown = std::min(top, hot.size());
+    std::partial_sort(hot.begin(), hot.begin() + shown, hot.end(),
+                      [](const std::pair<uint64_t, size_t> &a,
+                         const std::pair<uint64_t, size_t> &b) {
+                        return a.first > b.first;
+                      });
+    fprintf(stderr, "%s\n", title);
+    for (size_t i = 0; i < shown; ++i) {
+      char buf[16];
+      name(hot[i].second, buf);
+      fprintf(stderr, "  %-8s %14llu %6.2f%%\n", buf,
+              (unsigned long long) hot[i].first,
+              retired_ ? 100.0 * hot[i].first / retired_ : 0.0);
+    }
+  };
+
+  dump("Retired instructions by opcode:", handler_hits_, kHandlerCount,
+       [](size_t h, char *buf) {
+         if (h < 256) snprintf(buf, 16, "%02X", (unsigned) h);
+         else snprintf(buf, 16, "%02X /%u", kGroupOpcodes[(h - 256) / 8],
+                       (unsigned) (h - 256) % 8);
+       });
+  dump("Hottest linear CS:IP:", ip_hits_.data(), ip_hits_.size(),
+       [](size_t pc, char *buf) { snprintf(buf, 16, "%05X", (unsigned) pc); });
+}
+#endif
+
+// Decodes the instruction at CS:IP without executing it. Unknown opcodes
+// decode to a single byte and end the block; executing them reports the error.
+void Cpu::decode(Instr &in, word ip) {
+  if (ctx_.seg.cs != fetch_.cs || !fetch_.code) {
+    dword base = linear(ctx_.seg.cs, 0);
+    fetch_.cs = ctx_.seg.cs;
+    fetch_.code = mem_.at<byte>(base);
+    fetch_.size = std::min<dword>(0x10000, 0x100000 - base);
+  }
+  if (ip + kMaxInstrLength <= fetch_.size) {
+    decode_instr(fetch_.code + ip, fetch_.size - ip, in);
+  } else {    // may wrap around the segment or memory
+    byte window[kMaxInstrLength];
+    for (size_t i = 0; i < kMaxInstrLength; ++i) {
+      window[i] = *mem_.get<byte>(ctx_.seg.cs, word(ip + i));
+    }
+    decode_instr(window, kMaxInstrLength, in);
+  }
+  in.handler = handler_index(in.opcode, in.modrm);
+#ifdef TOY8086_CYCLES
+  in.cycles = instr_cycles(in);
+#endif
+}
+
+Block &Cpu::build_block(dword start) {
+  Block blk;
+  blk.start = start;
+  word ip = ctx_.ip;
+  do {
+    Instr in;
+    decode(in, ip);
+    if (word(ip + in.length) < ip) in.ends_block = true;   // IP wraps around
+    ip += in.length;
+    blk.instrs.push_back(in);
+  } while (!blk.instrs.back().ends_block &&
+           blk.instrs.size() < Block::kMaxLength);
+  blk.end = start + word(ip - ctx_.ip);
+#ifdef TOY8086_FUSION
+  if (use_fusion_) fuse(blk);
+#endif
+  return cache_.insert(std::move(blk));
+}
+
+// Executes a decoded instruction. IP already points to the next instruction.
+// |reg| is the ModRM reg field for the group opcodes, or -1 to read it from
+// the instruction. Handlers inline this with constant |b| and |reg| so that
+// the opcode, group and width switches fold away.
+inline Cpu::ExitStatus Cpu::execute(const Instr &in, byte b, int reg) {
+  if (reg < 0) reg = (in.modrm >> 3) & 7;
+  switch (b) {
+    case 0x80: case 0x81: case 0x82: case 0x83: {   // group 1
+      // 80 82 -> Eb Ib
+      // 81    -> Ev Iv
+      // 83    -> Ev Ib (sign-extended)
+      bool is_8bit = (b & 1) == 0;
+      word src = in.imm;
+      void *dst = decode_rm(in, is_8bit);
+
+      switch (reg) {   // group 1
+        case 0: EXECUTE_OP2(add);
+        case 1: EXECUTE_OP2(or);
+        case 2: EXECUTE_OP2(adc);
+        case 3: EXECUTE_OP2(sbb);
+        case 4: EXECUTE_OP2(and);
+        case 5: EXECUTE_OP2(sub);
+        case 6: EXECUTE_OP2(xor);
+        case 7: EXECUTE_OP2(cmp);
       }
+      if (reg != 7) track_rm_write(in, is_8bit ? 1 : 2);
+      return kContinue;
+    }
 
-      case 0xd0: case 0xd1: case 0xd2: case 0xd3: {   // group 2
-        byte modrm = fetch();
-        word one = 1;
-        void *src = b < 0xd2 ? to_ptr(one) : to_ptr(ctx_.c.l);
-        bool is_8bit = (b & 1) == 0;
-        void *dst = decode_rm(modrm, is_8bit);
-
-        switch ((modrm >> 3) & 7) {
-          case 0: EXECUTE_OP2(rol);
-          case 1: EXECUTE_OP2(ror);
-          case 2: EXECUTE_OP2(rcl);
-          case 3: EXECUTE_OP2(rcr);
-          case 4: EXECUTE_OP2(shl);
-          case 5: EXECUTE_OP2(shr);
-          case 6:
-          case 7: EXECUTE_OP2(sar);
-        }
-        goto next_instr;
+    case 0xd0: case 0xd1: case 0xd2: case 0xd3: {   // group 2
+      word one = 1;
+      void *src = b < 0xd2 ? to_ptr(one) : to_ptr(ctx_.c.l);
+      if (b >= 0xd2) ADD_CYCLES(kCyclesPerShift * ctx_.c.l);
+      bool is_8bit = (b & 1) == 0;
+      void *dst = decode_rm(in, is_8bit);
+
+      switch (reg) {
+        case 0: EXECUTE_OP2(rol);
+        case 1: EXECUTE_OP2(ror);
+        case 2: EXECUTE_OP2(rcl);
+        case 3: EXECUTE_OP2(rcr);
+        case 4: EXECUTE_OP2(shl);
+        case 5: EXECUTE_OP2(shr);
+        case 6:
+        case 7: EXECUTE_OP2(sar);
       }
+      track_rm_write(in, is_8bit ? 1 : 2);
+      return kContinue;
+    }
 
-      case 0xf6: case 0xf7: {   // group 3a / 3b
-        byte modrm = fetch();
-        bool is_8bit = b == 0xf6;
-        void *dst = decode_rm(modrm, is_8bit);
+    case 0xf6: case 0xf7: {   // group 3a / 3b
+      bool is_8bit = b == 0xf6;
+      void *dst = decode_rm(in, is_8bit);
 
-        switch ((modrm >> 3) & 7) {
-          case 0: {
-            void *src = is_8bit ? to_ptr(fetch()) : to_ptr(fetchw());
-            EXECUTE_OP2(test);
-          }
-          case 1: return kExitInvalidInstruction;
-          case 2: EXECUTE_OP(not);
-          case 3: {
-            ctx_.flag.c = modrm >> 6;
-            EXECUTE_OP(neg);
-          }
-          case 4: EXECUTE_OP(mul);
-          case 5: EXECUTE_OP(imul);
-          case 6: EXECUTE_OP(div);
-          case 7: EXECUTE_OP(idiv);
+      switch (reg) {
+        case 0: {
+          word src = in.imm;
+          EXECUTE_OP2(test);
         }
-        goto next_instr;
+        case 1: return kExitInvalidInstruction;
+        case 2:
+          if (is_8bit) op_not(to_byte(dst));
+          else         op_not(to_word(dst));
+          track_rm_write(in, is_8bit ? 1 : 2);
+          break;
+        case 3:
+          ctx_.flag.set_c(in.modrm >> 6);
+          if (is_8bit) op_neg(to_byte(dst));
+          else         op_neg(to_word(dst));
+          track_rm_write(in, is_8bit ? 1 : 2);
+          break;
+        case 4: EXECUTE_OP(mul);
+        case 5: EXECUTE_OP(imul);
+        case 6: EXECUTE_OP(div);
+        case 7: EXECUTE_OP(idiv);
       }
+      return kContinue;
+    }
 
-      case 0x00: case 0x01: case 0x02: case 0x03: case 0x04: case 0x05:  // add
-      case 0x10: case 0x11: case 0x12: case 0x13: case 0x14: case 0x15:  // adc
-      case 0x20: case 0x21: case 0x22: case 0x23: case 0x24: case 0x25:  // and
-      case 0x30: case 0x31: case 0x32: case 0x33: case 0x34: case 0x35:  // xor
-      case 0x08: case 0x09: case 0x0a: case 0x0b: case 0x0c: case 0x0d:  // or
-      case 0x18: case 0x19: case 0x1a: case 0x1b: case 0x1c: case 0x1d:  // sbb
-      case 0x28: case 0x29: case 0x2a: case 0x2b: case 0x2c: case 0x2d:  // sub
-      case 0x38: case 0x39: case 0x3a: case 0x3b: case 0x3c: case 0x3d:  // cmp
-      case 0x88: case 0x89: case 0x8a: case 0x8b: {                      // mov
-        void *src, *dst;
-        bool is_8bit = false;
-        byte tmp;
-        switch (b & 7) {
-          case 0:   // Eb Gb
-            is_8bit = true;
-          case 1:   // Ev Gv
-            tmp = fetch();
-            dst = decode_rm(tmp, is_8bit);
-            src = decode_reg(tmp, is_8bit);
-            break;
-
-          case 2:   // Gb Eb
-            is_8bit = true;
-          case 3:   // Gv Ev
-            tmp = fetch();
-            src = decode_rm(tmp, is_8bit);
-            dst = decode_reg(tmp, is_8bit);
-            break;
-
-          case 4:   // AL Ib
-            is_8bit = true;
-          case 5:   // AX Iv
-            dst = &ctx_.a.l;
-            src = is_8bit ? to_ptr(fetch()) : to_ptr(fetchw());
-            break;
-
-          default:
-            goto invalid_instr;
-        }
+    case 0x00: case 0x01: case 0x02: case 0x03: case 0x04: case 0x05:  // add
+    case 0x10: case 0x11: case 0x12: case 0x13: case 0x14: case 0x15:  // adc
+    case 0x20: case 0x21: case 0x22: case 0x23: case 0x24: case 0x25:  // and
+    case 0x30: case 0x31: case 0x32: case 0x33: case 0x34: case 0x35:  // xor
+    case 0x08: case 0x09: case 0x0a: case 0x0b: case 0x0c: case 0x0d:  // or
+    case 0x18: case 0x19: case 0x1a: case 0x1b: case 0x1c: case 0x1d:  // sbb
+    case 0x28: case 0x29: case 0x2a: case 0x2b: case 0x2c: case 0x2d:  // sub
+    case 0x38: case 0x39: case 0x3a: case 0x3b: case 0x3c: case 0x3d:  // cmp
+    case 0x88: case 0x89: case 0x8a: case 0x8b: {                      // mov
+      void *src, *dst;
+      bool is_8bit = false;
+      word imm = in.imm;
+      switch (b & 7) {
+        case 0:   // Eb Gb
+          is_8bit = true;
+        case 1:   // Ev Gv
+          dst = decode_rm(in, is_8bit, b < 0x88);   // mov only writes it
+          src = decode_reg(in, is_8bit);
+          break;
 
-        switch (b & 0xf8) {
-          case 0x00: EXECUTE_OP2(add);
-          case 0x10: EXECUTE_OP2(adc);
-          case 0x20: EXECUTE_OP2(and);
-          case 0x30: EXECUTE_OP2(xor);
-          case 0x08: EXECUTE_OP2(or);
-          case 0x18: EXECUTE_OP2(sbb);
-          case 0x28: EXECUTE_OP2(sub);
-          case 0x38: EXECUTE_OP2(cmp);
-          case 0x88:   // mov (partial)
-            if (is_8bit) to_byte(dst) = to_byte(src);
-            else         to_word(dst) = to_word(src);
-            break;
-
-          default:
-            goto invalid_instr;
-        }
-        goto next_instr;
-      }  // case of some opcode from 0x00 to 0x3d
-
-      case 0x8c: case 0x8e: {   // mov, segment <-> modrm
-        byte modrm = fetch();
-        word &reg = to_word(decode_rm(modrm, false));
-        word seg_id = (modrm >> 3) & 7;
-        if (seg_id >= Segment::kSegMax) return kExitInvalidInstruction;
-
-        word &seg = ctx_.seg.reg_seg[seg_id];
-        if (b == 0x8c) reg = seg;   // Ew Sw
-        else           seg = reg;   // Sw Ew
-        goto next_instr;
-      }
+        case 2:   // Gb Eb
+          is_8bit = true;
+        case 3:   // Gv Ev
+          src = decode_rm(in, is_8bit);
+          dst = decode_reg(in, is_8bit);
+          break;
 
-      case 0x8d: {   // lea Gv M
-        byte modrm = fetch();
-        word &dst = to_word(decode_reg(modrm, false));
-        dst = (byte *)(decode_rm(modrm)) - mem_.get<byte>(ctx_.seg.get(), 0);
-        goto next_instr;
+        case 4:   // AL Ib
+          is_8bit = true;
+        case 5:   // AX Iv
+          dst = &ctx_.a.l;
+          src = &imm;
+          break;
+
+        default:
+          goto invalid_instr;
       }
 
-      case 0xc6: case 0xc7: {   // mov
-        void *ptr = decode_rm(fetch(), b & 0x01);
-        if (b == 0xc6)  to_byte(ptr) = fetch();
-        else            to_word(ptr) = fetchw();
-        goto next_instr;
+      switch (b & 0xf8) {
+        case 0x00: EXECUTE_OP2(add);
+        case 0x10: EXECUTE_OP2(adc);
+        case 0x20: EXECUTE_OP2(and);
+        case 0x30: EXECUTE_OP2(xor);
+        case 0x08: EXECUTE_OP2(or);
+        case 0x18: EXECUTE_OP2(sbb);
+        case 0x28: EXECUTE_OP2(sub);
+        case 0x38: EXECUTE_OP2(cmp);
+        case 0x88:   // mov (partial)
+          if (is_8bit) to_byte(dst) = to_byte(src);
+          else         to_word(dst) = to_word(src);
+          break;
+
+        default:
+          goto invalid_instr;
+      }
+      if ((b & 6) == 0 && (b & 0xf8) != 0x38) {   // destination is Eb / Ev
+        track_rm_write(in, is_8bit ? 1 : 2);
+      }
+      return kContinue;
+    }  // case of some opcode from 0x00 to 0x3d
+
+    case 0x8c: case 0x8e: {   // mov, segment <-> modrm
+      word &reg = to_word(decode_rm(in, false, b == 0x8e));
+      word seg_id = (in.modrm >> 3) & 7;
+      if (seg_id >= Segment::kSegMax) return kExitInvalidInstruction;
+
+      word &seg = ctx_.seg.reg_seg[seg_id];
+      if (b == 0x8c) {    // Ew Sw
+        reg = seg;
+        track_rm_write(in, 2);
+      } else {            // Sw Ew
+        seg = reg;
       }
+      return kContinue;
+    }
 
-      case 0x40: case 0x41: case 0x42: case 0x43:   // inc
-      case 0x44: case 0x45: case 0x46: case 0x47:
-      case 0x48: case 0x49: case 0x4a: case 0x4b:   // dec
-      case 0x4c: case 0x4d: case 0x4e: case 0x4f:
-      case 0x50: case 0x51: case 0x52: case 0x53:   // push
-      case 0x54: case 0x55: case 0x56: case 0x57:
-      case 0x58: case 0x59: case 0x5a: case 0x5b:   // pop
-      case 0x5c: case 0x5d: case 0x5e: case 0x5f:
-      /*90=NOP*/ case 0x91: case 0x92: case 0x93:   // xchg
-      case 0x94: case 0x95: case 0x96: case 0x97:
-      case 0xb8: case 0xb9: case 0xba: case 0xbb:   // mov
-      case 0xbc: case 0xbd: case 0xbe: case 0xbf: {
-        word &reg = ctx_.reg_all[b & 7];
-        switch (b & 0xf8) {
-          case 0x40: {   // inc
-            word v = 1;
-            op_add<word>(reg, v);
-            break;
-          }
+    case 0x8d:    // lea Gv M
+      to_word(decode_reg(in, false)) = ea_offset(in);
+      return kContinue;
+
+    case 0xc6: case 0xc7: {   // mov
+      bool is_8bit = b == 0xc6;
+      void *ptr = decode_rm(in, is_8bit, false);
+      if (is_8bit) to_byte(ptr) = in.imm;
+      else         to_word(ptr) = in.imm;
+      track_rm_write(in, is_8bit ? 1 : 2);
+      return kContinue;
+    }
 
-          case 0x48: {   // dec
-            word v = 1;
-            op_sub<word>(reg, v);
-            break;
-          }
+    case 0x40: case 0x41: case 0x42: case 0x43:   // inc
+    case 0x44: case 0x45: case 0x46: case 0x47:
+    case 0x48: case 0x49: case 0x4a: case 0x4b:   // dec
+    case 0x4c: case 0x4d: case 0x4e: case 0x4f:
+    case 0x50: case 0x51: case 0x52: case 0x53:   // push
+    case 0x54: case 0x55: case 0x56: case 0x57:
+    case 0x58: case 0x59: case 0x5a: case 0x5b:   // pop
+    case 0x5c: case 0x5d: case 0x5e: case 0x5f:
+    /*90=NOP*/ case 0x91: case 0x92: case 0x93:   // xchg
+    case 0x94: case 0x95: case 0x96: case 0x97:
+    case 0xb8: case 0xb9: case 0xba: case 0xbb:   // mov
+    case 0xbc: case 0xbd: case 0xbe: case 0xbf: {
+      word &reg = ctx_.reg_all[b & 7];
+      switch (b & 0xf8) {
+        case 0x40:    // inc
+          op_inc(reg);
+          break;
 
-          case 0x50:    // push
-            op_push(reg);
-            break;
+        case 0x48:    // dec
+          op_dec(reg);
+          break;
 
-          case 0x58:    // pop
-            op_pop(reg);
-            break;
+        case 0x50:    // push
+          op_push(reg);
+          break;
 
-          case 0x90:    // xchg
-            op_xchg(reg, ctx_.a.x);
-            break;
+        case 0x58:    // pop
+          op_pop(reg);
+          break;
 
-          case 0xb8:    // mov
-            reg = fetchw();
-            break;
+        case 0x90:    // xchg
+          op_xchg(reg, ctx_.a.x);
+          break;
 
-          default:
-            goto invalid_instr;
-        }
-        goto next_instr;
-      }   // 16-bit register operations (inc, dec, push, pop, mov)
-
-      case 0xb0: case 0xb1: case 0xb2: case 0xb3: // mov [reg], ib
-      case 0xb4: case 0xb5: case 0xb6: case 0xb7: {
-        byte &reg = ctx_.reg_gen[b & 3].v[(b & 4) / 4];
-        reg = fetch();
-        goto next_instr;
-      }   // 8-bit mov-to-register operations
-
-      case 0x70: case 0x71: case 0x72: case 0x73:
-      case 0x74: case 0x75: case 0x76: case 0x77:
-      case 0x78: case 0x79: case 0x7a: case 0x7b:
-      case 0x7c: case 0x7d: case 0x7e: case 0x7f: {
-        char offset = fetch();  // caution: signed offset
-        bool condition_met;
-        switch (b & 0xf) {
-          case 0x0:   // jo
-            condition_met = ctx_.flag.o;
-            break;
-          case 0x1:   // jno
-            condition_met = !ctx_.flag.o;
-            break;
-          case 0x2:   // jb
-            condition_met = ctx_.flag.c;
-            break;
-          case 0x3:   // jae
-            condition_met = !ctx_.flag.c;
-            break;
-          case 0x4:   // je
-            condition_met = ctx_.flag.z;
-            break;
-          case 0x5:   // jne
-            condition_met = !ctx_.flag.z;
-            break;
-          case 0x6:   // jbe
-            condition_met = ctx_.flag.c || ctx_.flag.z;
-            break;
-          case 0x7:   // ja
-            condition_met = !(ctx_.flag.c || ctx_.flag.z);
-            break;
-          case 0x8:   // js
-            condition_met = ctx_.flag.s;
-            break;
-          case 0x9:   // jns
-            condition_met = !ctx_.flag.s;
-            break;
-          case 0xa:   // jp
-            condition_met = ctx_.flag.p;
-            break;
-          case 0xb:   // jnp
-            condition_met = !ctx_.flag.p;
-            break;
-          case 0xc:   // jl
-            condition_met = ctx_.flag.s != ctx_.flag.o;
-            break;
-          case 0xd:   // jnl
-            condition_met = ctx_.flag.s == ctx_.flag.o;
-            break;
-          case 0xe:   // jle
-            condition_met = ctx_.flag.s != ctx_.flag.o || ctx_.flag.z;
-            break;
-          case 0xf:   // jg
-            condition_met = ctx_.flag.s == ctx_.flag.o && !ctx_.flag.z;
-            break;
-        }
+        case 0xb8:    // mov
+          reg = in.imm;
+          break;
 
-        if (!condition_met) goto next_instr;
-        ctx_.ip += offset;
-        goto next_instr;
-      }   // jcc: jump when condition is met
-
-      case 0x90:    // nop
-        goto next_instr;
-
-      case 0xc2:    // ret Iw
-        ctx_.sp += fetchw();
-      case 0xc3:    // ret
-        op_pop(ctx_.ip);
-        goto next_instr;
-      case 0xca:    // ret FAR Iw
-        ctx_.sp += fetchw();
-      case 0xcb:    // ret FAR
-        op_pop(ctx_.ip);
-        op_pop(ctx_.seg.cs);
-        goto next_instr;
-
-      case 0xcc: case 0xcd: {
-        byte interrupt_no = 0x03;
-        if (b == 0xcd) {
-          interrupt_no = fetch();
-        }
-        if (interrupt_no == 0x03) {
-          dump_status();
-          return kExitDebugInterrupt;
-        } else {
-          Cpu::ExitStatus ret = handle_interrupt(interrupt_no);
-          if (ret == kContinue) goto next_instr;
-          else return ret;
-        }
-      }  // handle interrupt
-
-      case 0xe4:    // in AL, Ib
-        op_in(ctx_.a.l, fetch());
-        goto next_instr;
-      case 0xe5:    // in AX, Ib
-        op_in(ctx_.a.x, fetch());
-        goto next_instr;
-      case 0xe6:    // out AL, Ib
-        op_out(fetch(), ctx_.a.l);
-        goto next_instr;
-      case 0xe7:    // out AX, Ib
-        op_out(fetch(), ctx_.a.x);
-        goto next_instr;
-      case 0xec:    // in AL, DX
-        op_in(ctx_.a.l, ctx_.d.x);
-        goto next_instr;
-      case 0xed:    // in AX, DX
-        op_in(ctx_.a.x, ctx_.d.x);
-        goto next_instr;
-      case 0xee:    // out DX, AL
-        op_out(ctx_.d.x, ctx_.a.l);
-        goto next_instr;
-      case 0xef:    // out DX, AX
-        op_out(ctx_.d.x, ctx_.a.x);
-        goto next_instr;
-
-      case 0xe0: case 0xe1: case 0xe2: {    // loopnz / loopz / loop
-        char offset = fetch();
-        if (!--ctx_.c.x) continue;
-        if ((b == 0xe0 && !ctx_.flag.z) ||  // loopnz
-            (b == 0xe1 && ctx_.flag.z) ||   // loopz
-            (b == 0xe2)) {                  // loop
-          ctx_.ip += offset;
-        }
-        goto next_instr;
+        default:
+          goto invalid_instr;
+      }
+      return kContinue;
+    }   // 16-bit register operations (inc, dec, push, pop, mov)
+
+    case 0xb0: case 0xb1: case 0xb2: case 0xb3: // mov [reg], ib
+    case 0xb4: case 0xb5: case 0xb6: case 0xb7: {
+      byte &reg = ctx_.reg_gen[b & 3].v[(b & 4) / 4];
+      reg = in.imm;
+      return kContinue;
+    }   // 8-bit mov-to-register operations
+
+    case 0x70: case 0x71: case 0x72: case 0x73:
+    case 0x74: case 0x75: case 0x76: case 0x77:
+    case 0x78: case 0x79: case 0x7a: case 0x7b:
+    case 0x7c: case 0x7d: case 0x7e: case 0x7f: {
+      bool condition_met;
+      switch (b & 0xf) {
+        case 0x0:   // jo
+          condition_met = ctx_.flag.o();
+          break;
+        case 0x1:   // jno
+          condition_met = !ctx_.flag.o();
+          break;
+        case 0x2:   // jb
+          condition_met = ctx_.flag.c();
+          break;
+        case 0x3:   // jae
+          condition_met = !ctx_.flag.c();
+          break;
+        case 0x4:   // je
+          condition_met = ctx_.flag.z();
+          break;
+        case 0x5:   // jne
+          condition_met = !ctx_.flag.z();
+          break;
+        case 0x6:   // jbe
+          condition_met = ctx_.flag.c() || ctx_.flag.z();
+          break;
+        case 0x7:   // ja
+          condition_met = !(ctx_.flag.c() || ctx_.flag.z());
+          break;
+        case 0x8:   // js
+          condition_met = ctx_.flag.s();
+          break;
+        case 0x9:   // jns
+          condition_met = !ctx_.flag.s();
+          break;
+        case 0xa:   // jp
+          condition_met = ctx_.flag.p();
+          break;
+        case 0xb:   // jnp
+          condition_met = !ctx_.flag.p();
+          break;
+        case 0xc:   // jl
+          condition_met = ctx_.flag.s() != ctx_.flag.o();
+          break;
+        case 0xd:   // jnl
+          condition_met = ctx_.flag.s() == ctx_.flag.o();
+          break;
+        case 0xe:   // jle
+          condition_met = ctx_.flag.s() != ctx_.flag.o() || ctx_.flag.z();
+          break;
+        case 0xf:   // jg
+          condition_met = ctx_.flag.s() == ctx_.flag.o() && !ctx_.flag.z();
+          break;
       }
 
-      case 0xe8: case 0xe9: {  // call Jv, jmp Jv
-        int16_t offset = fetchw();
-        if (b == 0xe8) {  // call
-          op_push(ctx_.ip);
-        }
-        ctx_.ip += offset;
-        goto next_instr;
+      if (condition_met) {
+        ctx_.ip += in.imm;
+        ADD_CYCLES(kCyclesTaken);
       }
-      case 0x9a: case 0xea: {  // call Ap, jmp Ap
-        word new_ip = fetchw();
-        word new_cs = fetchw();
-        if (b == 0x9a) {  // call
-          op_push(ctx_.seg.cs);
-          op_push(ctx_.ip);
-        }
-        ctx_.seg.cs = new_cs;
-        ctx_.ip = new_ip;
-        goto next_instr;
+      return kContinue;
+    }   // jcc: jump when condition is met
+
+    case 0x90:    // nop
+      return kContinue;
+
+    case 0xc2:    // ret Iw
+      op_pop(ctx_.ip);
+      ctx_.sp += in.imm;
+      return kContinue;
+    case 0xc3:    // ret
+      op_pop(ctx_.ip);
+      return kContinue;
+    case 0xca:    // ret FAR Iw
+    case 0xcb:    // ret FAR
+      op_pop(ctx_.ip);
+      op_pop(ctx_.seg.cs);
+      ctx_.sp += in.imm;
+      return kContinue;
+
+    case 0xcc: case 0xcd: {
+      byte interrupt_no = 0x03;
+      if (b == 0xcd) {
+        interrupt_no = in.imm;
       }
-      case 0xeb: {             // jmp Jb
-        int8_t offset = fetch();
-        ctx_.ip += offset;
-        goto next_instr;
+      if (interrupt_no == 0x03) {
+        dump_status();
+        return kExitDebugInterrupt;
+      }
+      ExitStatus st = handle_interrupt(interrupt_no);
+      if (st == kExitInputWait) {   // to be run again once input arrives
+        ctx_.ip -= in.length;
+        --retired_;
+        PROFILE_UNRETIRE(in);
+        CYCLES_UNRETIRE(in);
+      }
+      return st;
+    }  // handle interrupt
+
+    case 0xe4:    // in AL, Ib
+      op_in(ctx_.a.l, (byte) in.imm);
+      return kContinue;
+    case 0xe5:    // in AX, Ib
+      op_in(ctx_.a.x, (byte) in.imm);
+      return kContinue;
+    case 0xe6: {  // out AL, Ib
+      byte port = in.imm;
+      op_out(port, ctx_.a.l);
+      return kContinue;
+    }
+    case 0xe7: {  // out AX, Ib
+      byte port = in.imm;
+      op_out(port, ctx_.a.x);
+      return kContinue;
+    }
+    case 0xec:    // in AL, DX
+      op_in(ctx_.a.l, ctx_.d.x);
+      return kContinue;
+    case 0xed:    // in AX, DX
+      op_in(ctx_.a.x, ctx_.d.x);
+      return kContinue;
+    case 0xee:    // out DX, AL
+      op_out(ctx_.d.x, ctx_.a.l);
+      return kContinue;
+    case 0xef:    // out DX, AX
+      op_out(ctx_.d.x, ctx_.a.x);
+      return kContinue;
+
+    case 0xe0: case 0xe1: case 0xe2: {    // loopnz / loopz / loop
+      if (!--ctx_.c.x) return kContinue;
+      if ((b == 0xe0 && !ctx_.flag.z()) ||  // loopnz
+          (b == 0xe1 && ctx_.flag.z()) ||   // loopz
+          (b == 0xe2)) {                  // loop
+        ctx_.ip += in.imm;
+        ADD_CYCLES(b == 0xe0 ? kCyclesTakenLoopnz : kCyclesTaken);
       }
+      return kContinue;
+    }
 
-      case 0x0e:    // push cs
-        op_push(ctx_.seg.cs);
-        goto next_instr;
-      case 0x1e:    // push ds
-        op_push(ctx_.seg.ds);
-        goto next_instr;
-      case 0x1f:    // pop ds
-        op_pop(ctx_.seg.ds);
-        goto next_instr;
-
-      case 0xa0:    // mov AL Ob
-        ctx_.a.l = *mem_.get<byte>(ctx_.seg.get(), fetchw());
-        goto next_instr;
-      case 0xa1:    // mov AX Ov
-        ctx_.a.x = *mem_.get<word>(ctx_.seg.get(), fetchw());
-        goto next_instr;
-      case 0xa2:    // mov Ob AL
-        *mem_.get<byte>(ctx_.seg.get(), fetchw()) = ctx_.a.l;
-        goto next_instr;
-      case 0xa3:    // mov Ov AX
-        *mem_.get<word>(ctx_.seg.get(), fetchw()) = ctx_.a.x;
-        goto next_instr;
-
-      case 0xf4:    // hlt
-        return kExitHalt;
+    case 0xe8:    // call Jv
+      op_push(ctx_.ip);
+    case 0xe9:    // jmp Jv
+    case 0xeb:    // jmp Jb
+      ctx_.ip += in.imm;
+      return kContinue;
+    case 0x9a:    // call Ap
+      op_push(ctx_.seg.cs);
+      op_push(ctx_.ip);
+    case 0xea:    // jmp Ap
+      ctx_.seg.cs = in.imm2;
+      ctx_.ip = in.imm;
+      return kContinue;
+
+    case 0x0e:    // push cs
+      op_push(ctx_.seg.cs);
+      return kContinue;
+    case 0x1e:    // push ds
+      op_push(ctx_.seg.ds);
+      return kContinue;
+    case 0x1f:    // pop ds
+      op_pop(ctx_.seg.ds);
+      return kContinue;
+
+    case 0x9c:    // pushf
+      op_push(0xf002 | ctx_.flag.get());
+      return kContinue;
+    case 0x9d: {  // popf
+      word v;
+      op_pop(v);
+      ctx_.flag.set(v);
+      return kContinue;
+    }
+    case 0x9e:    // sahf
+      ctx_.flag.set((ctx_.flag.get() & 0xff00) | ctx_.a.h);
+      return kContinue;
+    case 0x9f:    // lahf
+      ctx_.a.h = 0x02 | ctx_.flag.get();
+      return kContinue;
+    case 0xf5:    // cmc
+      ctx_.flag.set_c(!ctx_.flag.c());
+      return kContinue;
+    case 0xf8:    // clc
+    case 0xf9:    // stc
+      ctx_.flag.set_c(b & 1);
+      return kContinue;
+    case 0xfc:    // cld
+    case 0xfd:    // std
+      ctx_.flag.d = b & 1;
+      return kContinue;
+
+    case 0xa0:    // mov AL Ob
+      ctx_.a.l = to_byte(decode_rm(in));
+      return kContinue;
+    case 0xa1:    // mov AX Ov
+      ctx_.a.x = to_word(decode_rm(in, false));
+      return kContinue;
+    case 0xa2:    // mov Ob AL
+      to_byte(decode_rm(in, true, false)) = ctx_.a.l;
+      track_rm_write(in, 1);
+      return kContinue;
+    case 0xa3:    // mov Ov AX
+      to_word(decode_rm(in, false, false)) = ctx_.a.x;
+      track_rm_write(in, 2);
+      return kContinue;
+
+    case 0xa4: case 0xa6: case 0xaa: case 0xac: case 0xae:
+      op_string<byte>(in, b);   // movsb, cmpsb, stosb, lodsb, scasb
+      return kContinue;
+    case 0xa5: case 0xa7: case 0xab: case 0xad: case 0xaf:
+      op_string<word>(in, b & ~1);
+      return kContinue;
+    case 0xa8:    // test AL Ib
+      op_test<byte>(ctx_.a.l, in.imm);
+      return kContinue;
+    case 0xa9:    // test AX Iv
+      op_test<word>(ctx_.a.x, in.imm);
+      return kContinue;
+
+    case 0xf4:    // hlt
+      return kExitHalt;
 
 invalid_instr:
-      default:
-        fprintf(stderr, "Invalid opcode: %x\n", b);
-        dump_status();
-        return kExitInvalidOpcode;
-    }   // end of opcode switch
+    default:
+      fprintf(stderr, "Invalid opcode: %x\n", b);
+      dump_status();
+      return kExitInvalidOpcode;
+  }   // end of opcode switch
+}
 
-next_instr:
-    pfx_.repe = pfx_.repne = pfx_.lock = 0;
-    ctx_.seg.reset();
-    continue;
-  }   // end of fetch opcode loop
+// Handler table: one entry per opcode, then one entry per ModRM reg field of
+// each group opcode, in the order handler_index() numbers them.
+#define OPCODE_ROW(X, r)                                                  \
+  X(0x##r##0) X(0x##r##1) X(0x##r##2) X(0x##r##3)                         \
+  X(0x##r##4) X(0x##r##5) X(0x##r##6) X(0x##r##7)                         \
+  X(0x##r##8) X(0x##r##9) X(0x##r##a) X(0x##r##b)                         \
+  X(0x##r##c) X(0x##r##d) X(0x##r##e) X(0x##r##f)
+#define OPCODE_TABLE(X)                                                   \
+  OPCODE_ROW(X, 0) OPCODE_ROW(X, 1) OPCODE_ROW(X, 2) OPCODE_ROW(X, 3)     \
+  OPCODE_ROW(X, 4) OPCODE_ROW(X, 5) OPCODE_ROW(X, 6) OPCODE_ROW(X, 7)     \
+  OPCODE_ROW(X, 8) OPCODE_ROW(X, 9) OPCODE_ROW(X, a) OPCODE_ROW(X, b)     \
+  OPCODE_ROW(X, c) OPCODE_ROW(X, d) OPCODE_ROW(X, e) OPCODE_ROW(X, f)
+#define GROUP_ROW(X, op)                                                  \
+  X(op, 0) X(op, 1) X(op, 2) X(op, 3) X(op, 4) X(op, 5) X(op, 6) X(op, 7)
+#define GROUP_TABLE(X)                                                    \
+  GROUP_ROW(X, 0x80) GROUP_ROW(X, 0x81) GROUP_ROW(X, 0x82)                \
+  GROUP_ROW(X, 0x83) GROUP_ROW(X, 0xd0) GROUP_ROW(X, 0xd1)                \
+  GROUP_ROW(X, 0xd2) GROUP_ROW(X, 0xd3) GROUP_ROW(X, 0xf6)                \
+  GROUP_ROW(X, 0xf7)
+// Fused groups in the order of their handlers, after the table above,
+// with the opcode of the compare for compare and Jcc
+#define FUSED_TABLE(X)                                                    \
+  X(kFuseCmpJcc, 0x38) X(kFuseCmpJcc, 0x39) X(kFuseCmpJcc, 0x3a)          \
+  X(kFuseCmpJcc, 0x3b) X(kFuseCmpJcc, 0x3c) X(kFuseCmpJcc, 0x3d)          \
+  X(kFuseCmpJcc, 0x80) X(kFuseCmpJcc, 0x81) X(kFuseCmpJcc, 0x82)          \
+  X(kFuseCmpJcc, 0x83) X(kFuseTestJcc, 0xa8) X(kFuseTestJcc, 0xa9)        \
+  X(kFuseTestJcc, 0xf6) X(kFuseTestJcc, 0xf7) X(kFuseIncJcc, 0)           \
+  X(kFuseDecJcc, 0)                                                       \
+  X(kFuseStepLoop, 0) X(kFuseStep2Loop, 0) X(kFusePushCall, 0)            \
+  X(kFusePush2Call, 0) X(kFuseEnter, 0) X(kFusePopRet, 0)                 \
+  X(kFusePop2Ret, 0)
+
+template<int B, int Reg>
+Cpu::ExitStatus Cpu::exec_op(Cpu &cpu, const Instr &in) {
+  return cpu.execute(in, B, Reg);
 }
 
-void *Cpu::decode_rm(byte b, bool is_8bit) {
-  byte modbits = (b >> 6) & 3;
-  byte rmbits = b & 7;
+const Cpu::Handler Cpu::kHandlers[kHandlerCount] = {
+#define OPCODE_HANDLER(op) &Cpu::exec_op<op, -1>,
+#define GROUP_HANDLER(op, reg) &Cpu::exec_op<op, reg>,
+  OPCODE_TABLE(OPCODE_HANDLER)
+  GROUP_TABLE(GROUP_HANDLER)
+#undef OPCODE_HANDLER
+#undef GROUP_HANDLER
+};
 
-  // mod = 0b11: register only
-  if (modbits == 3) {
-    if (is_8bit) return &ctx_.reg_gen[rmbits & 3].v[rmbits >> 2];
-    else return &ctx_.reg_all[rmbits];
-  }
+inline Cpu::ExitStatus Cpu::dispatch(const Instr &in) {
+#ifdef TOY8086_SWITCH_DISPATCH
+  return execute(in, in.opcode, -1);
+#else
+  return kHandlers[in.handler](*this, in);
+#endif
+}
 
-  uint16_t base;
-  switch (rmbits) {
-    case 0: base = ctx_.b.x + ctx_.si;  break;
-    case 1: base = ctx_.b.x + ctx_.di;  break;
-    case 2: base = ctx_.bp + ctx_.si;   break;
-    case 3: base = ctx_.bp + ctx_.di;   break;
-    case 4: base = ctx_.si;             break;
-    case 5: base = ctx_.di;             break;
-    case 6:
-      if (modbits == 0) {
-        // mod = 0b00, rm = 0b110: EA = disp16
-        base = 0;
-        modbits = 2;
-      } else {
-        base = ctx_.bp;
-      }
+#ifdef TOY8086_FUSION
+// Whether condition |cc| of a Jcc holds right after cmp or test of |a| and
+// |b| giving |r|, decided from the operands without branching. Parity is
+// left to the flags.
+template<typename T, bool Test>
+static bool fused_condition(byte cc, T a, T b, T r) {
+  typedef typename std::make_signed<T>::type S;
+  bool c = !Test && a < b;
+  bool o = !Test && S((a ^ b) & (a ^ r)) < 0;
+  bool z = r == 0, s = S(r) < 0, l = s != o;
+  // jo, jb, je, jbe, js, (jp), jl, jle
+  unsigned holds = o | c << 1 | z << 2 | (c | z) << 3 | s << 4 | l << 6 |
+                   (l | z) << 7;
+  return ((holds >> (cc >> 1)) & 1) != (cc & 1);
+}
+
+template<int B>
+inline void Cpu::fused_compare_jcc(const Instr *in) {
+  const bool kTest = B >= 0xa8;
+  const bool is_8bit = !(B & 1);
+  const Instr &op = in[0], &jcc = in[1];
+  word imm = op.imm;
+  void *dst, *src;
+  switch (B) {
+    case 0x38: case 0x39:                         // Eb Gb, Ev Gv
+      dst = decode_rm(op, is_8bit);
+      src = decode_reg(op, is_8bit);
+      break;
+    case 0x3a: case 0x3b:                         // Gb Eb, Gv Ev
+      src = decode_rm(op, is_8bit);
+      dst = decode_reg(op, is_8bit);
       break;
-    case 7:
-      base = ctx_.b.x;
+    case 0x3c: case 0x3d: case 0xa8: case 0xa9:   // AL Ib, AX Iv
+      dst = &ctx_.a.l;
+      src = &imm;
+      break;
+    default:                                      // groups 1 and 3
+      dst = decode_rm(op, is_8bit);
+      src = &imm;
       break;
   }
-
-  if (modbits == 1) {
-    return mem_.get<void>(ctx_.seg.get(), base + fetch());
-  } else if (modbits == 2) {
-    return mem_.get<void>(ctx_.seg.get(), base + fetchw());
+  ctx_.ip += op.length + jcc.length;
+  retired_ += 2;
+
+  byte cc = jcc.opcode & 0xf;
+  bool taken;
+  if (is_8bit) {
+    byte a = to_byte(dst), s = to_byte(src);
+    if (kTest) op_test(a, s);
+    else       op_cmp(a, s);
+    taken = fused_condition<byte, kTest>(cc, a, s, kTest ? a & s : a - s);
   } else {
-    return mem_.get<void>(ctx_.seg.get(), base);
+    word a = to_word(dst), s = to_word(src);
+    if (kTest) op_test(a, s);
+    else       op_cmp(a, s);
+    taken = fused_condition<word, kTest>(cc, a, s, kTest ? a & s : a - s);
   }
+  if ((cc >> 1) == 5) taken = ctx_.flag.test(cc);   // jp, jnp
+  if (taken) ctx_.ip += jcc.imm;
 }
 
-void *Cpu::decode_reg(byte b, bool is_8bit) {
-  byte regbits = (b >> 3) & 7;
+template<bool Dec>
+inline void Cpu::fused_incdec_jcc(const Instr *in) {
+  word &reg = ctx_.reg_all[in[0].opcode & 7];
+  if (Dec) op_dec(reg);
+  else     op_inc(reg);
+  ctx_.ip += in[0].length + in[1].length;
+  retired_ += 2;
+  if (ctx_.flag.test(in[1].opcode & 0xf)) ctx_.ip += in[1].imm;
+}
+
+// Runs an inc, dec, add or sub of a register, setting the flags only if
+// |flags|.
+void Cpu::run_step(const Instr &in, bool flags) {
+  ctx_.ip += in.length;
+  ++retired_;
+  if (in.opcode < 0x50) {   // inc, dec r16
+    word &reg = ctx_.reg_all[in.opcode & 7];
+    bool dec = in.opcode >= 0x48;
+    if (!flags) reg += dec ? -1 : 1;
+    else if (dec) op_dec(reg);
+    else op_inc(reg);
+  } else {                  // add, sub r16, imm
+    word &reg = ctx_.reg_all[in.modrm & 7];
+    word imm = in.imm;
+    bool sub = ((in.modrm >> 3) & 7) == 5;
+    if (!flags) reg += sub ? -imm : imm;
+    else if (sub) op_sub(reg, imm);
+    else op_add(reg, imm);
+  }
+}
+
+void Cpu::fused_step_loop(const Instr *in, int steps) {
+  // The flags of a step are dead if a later add or sub sets them all; inc
+  // and dec keep CF
+  run_step(in[0], steps == 1 || in[1].opcode < 0x50);
+  if (steps == 2) run_step(in[1], true);
+  const Instr &loop = in[steps];
+  ctx_.ip += loop.length;
+  ++retired_;
+  if (--ctx_.c.x) ctx_.ip += loop.imm;
+}
+
+void Cpu::fused_push_call(const Instr *in, int pushes) {
+  for (int i = 0; i < pushes; ++i) {
+    ctx_.ip += in[i].length;
+    ++retired_;
+    op_push(ctx_.reg_all[in[i].opcode & 7]);
+    if (cache_.stale()) return;
+  }
+  const Instr &call = in[pushes];
+  ctx_.ip += call.length;
+  ++retired_;
+  op_push(ctx_.ip);
+  ctx_.ip += call.imm;
+}
+
+void Cpu::fused_enter(const Instr *in) {
+  ctx_.ip += in[0].length;
+  ++retired_;
+  op_push(ctx_.bp);
+  if (cache_.stale()) return;
+  ctx_.ip += in[1].length;
+  ++retired_;
+  ctx_.bp = ctx_.sp;
+}
+
+void Cpu::fused_pop_ret(const Instr *in, int pops) {
+  for (int i = 0; i < pops; ++i) {
+    ctx_.ip += in[i].length;
+    ++retired_;
+    op_pop(ctx_.reg_all[in[i].opcode & 7]);
+  }
+  const Instr &ret = in[pops];
+  ++retired_;
+  op_pop(ctx_.ip);
+  if (ret.opcode == 0xc2) ctx_.sp += ret.imm;
+}
+
+template<int Kind, int B>
+void Cpu::run_fused(const Instr *in) {
+  ++fused_runs_[Kind];
+  uint64_t retired = retired_;
+  switch (Kind) {
+    case kFuseCmpJcc:
+    case kFuseTestJcc:   fused_compare_jcc<B>(in);      break;
+    case kFuseIncJcc:    fused_incdec_jcc<false>(in);   break;
+    case kFuseDecJcc:    fused_incdec_jcc<true>(in);    break;
+    case kFuseStepLoop:  fused_step_loop(in, 1);        break;
+    case kFuseStep2Loop: fused_step_loop(in, 2);        break;
+    case kFusePushCall:  fused_push_call(in, 1);        break;
+    case kFusePush2Call: fused_push_call(in, 2);        break;
+    case kFuseEnter:     fused_enter(in);               break;
+    case kFusePopRet:    fused_pop_ret(in, 1);          break;
+    case kFusePop2Ret:   fused_pop_ret(in, 2);          break;
+  }
+  fused_retired_ += retired_ - retired;
+}
+
+const Cpu::FusedHandler Cpu::kFusedHandlers[kFusedHandlerCount] = {
+#define FUSED_HANDLER(kind, op) {kind, op, &Cpu::run_fused<kind, op>},
+  FUSED_TABLE(FUSED_HANDLER)
+#undef FUSED_HANDLER
+};
+
+// Marks the groups match_fusion() finds in |blk|, first come first served:
+// the first instruction of each gets the handler of the group.
+void Cpu::fuse(Block &blk) {
+  std::vector<Instr> &instrs = blk.instrs;
+  for (size_t i = 0; i < instrs.size();) {
+    Fusion kind;
+    if (match_fusion(&instrs[i], instrs.size() - i, kind)) {
+      byte op = kind <= kFuseTestJcc ? instrs[i].opcode : 0;
+      size_t h = 0;
+      while (kFusedHandlers[h].kind != kind ||
+             kFusedHandlers[h].opcode != op) {
+        ++h;
+      }
+      instrs[i].handler = kFusedHandler + h;
+      i += kFusionLength[kind];
+    } else {
+      ++i;
+    }
+  }
+}
+#endif  // TOY8086_FUSION
+
+// Runs |blk| until it ends, an instruction stops the CPU or a write
+// invalidates cached code.
+Cpu::ExitStatus Cpu::run_block(const Block &blk) {
+#ifdef TOY8086_THREADED_DISPATCH
+  // Every handler jumps straight to the next one, so each gets its own
+  // indirect branch for the predictor to learn.
+  static void *const kLabels[] = {
+#define OPCODE_LABEL(op) &&op_##op,
+#define GROUP_LABEL(op, reg) &&grp_##op##_##reg,
+    OPCODE_TABLE(OPCODE_LABEL)
+    GROUP_TABLE(GROUP_LABEL)
+#ifdef TOY8086_FUSION
+#define FUSED_LABEL(kind, op) &&fused_##kind##_##op,
+    FUSED_TABLE(FUSED_LABEL)
+#undef FUSED_LABEL
+#endif
+#undef OPCODE_LABEL
+#undef GROUP_LABEL
+  };
+#ifdef TOY8086_FUSION
+  static_assert(sizeof(kLabels) / sizeof(kLabels[0]) ==
+                kFusedHandler + kFusedHandlerCount, "a label per handler");
+#endif
+
+  const Instr *in = blk.instrs.data();
+  const Instr *end = in + blk.instrs.size();
+  ExitStatus st;
+  goto *kLabels[in->handler];
+
+#define THREADED_HANDLER(label, op, reg)                    \
+  label:                                                    \
+    PROFILE_RETIRE(*in);                                    \
+    CYCLES_RETIRE(*in);                                     \
+    ctx_.ip += in->length;                                  \
+    ++retired_;                                             \
+    st = execute(*in, op, reg);                             \
+    if (st != kContinue) return st;                         \
+    if (cache_.stale() || ++in == end) return kContinue;    \
+    goto *kLabels[in->handler];
+#define OPCODE_LABEL(op) THREADED_HANDLER(op_##op, op, -1)
+#define GROUP_LABEL(op, reg) THREADED_HANDLER(grp_##op##_##reg, op, reg)
+  OPCODE_TABLE(OPCODE_LABEL)
+  GROUP_TABLE(GROUP_LABEL)
+#undef OPCODE_LABEL
+#undef GROUP_LABEL
+#undef THREADED_HANDLER
+#ifdef TOY8086_FUSION
+#define FUSED_LABEL(kind, op)                               \
+  fused_##kind##_##op:                                      \
+    run_fused<kind, op>(in);                                \
+    in += kFusionLength[kind];                              \
+    if (cache_.stale() || in == end) return kContinue;      \
+    goto *kLabels[in->handler];
+  FUSED_TABLE(FUSED_LABEL)
+#undef FUSED_LABEL
+#endif
+#else
+  const Instr *in = blk.instrs.data();
+  const Instr *end = in + blk.instrs.size();
+  while (in != end) {
+#ifdef TOY8086_FUSION
+    if (in->handler >= kFusedHandler) {
+      const FusedHandler &fused = kFusedHandlers[in->handler - kFusedHandler];
+      (this->*fused.run)(in);
+      in += kFusionLength[fused.kind];
+      if (cache_.stale()) break;
+      continue;
+    }
+#endif
+    PROFILE_RETIRE(*in);
+    CYCLES_RETIRE(*in);
+    ctx_.ip += in->length;
+    ++retired_;
+    ExitStatus st = dispatch(*in);
+    if (st != kContinue) return st;
+    if (cache_.stale()) break;    // blk may be among the invalidated blocks
+    ++in;
+  }
+  return kContinue;
+#endif
+}
+
+Cpu::ExitStatus Cpu::run() {
+  return run_for(UINT64_MAX);
+}
+
+Cpu::ExitStatus Cpu::run_for(uint64_t max_instructions) {
+  bool bounded = max_instructions < UINT64_MAX - retired_;
+  budget_end_ = bounded ? retired_ + max_instructions : UINT64_MAX;
+  jit_.limit_chains(bounded);
+
+  ExitStatus st = run_loop();
+  if (display_) display_->present(st != kExitBudget);
+  out_.flush();
+  // A guest only stopped for now keeps the terminal raw until it ends, or
+  // until in_ goes with the Cpu
+  if (st != kExitBudget && st != kExitInputWait) in_.release();
+  return st;
+}
+
+void Cpu::peek(dword linear, void *buf, size_t size) {
+  byte *out = static_cast<byte *>(buf);
+  while (size) {
+    linear &= 0xfffff;
+    size_t n = std::min<size_t>(size, 0x100000 - linear);
+    memcpy(out, mem_.at<byte>(linear), n);
+    linear += n;
+    out += n;
+    size -= n;
+  }
+}
+
+void Cpu::poke(dword linear, const void *buf, size_t size) {
+  const byte *in = static_cast<const byte *>(buf);
+  while (size) {
+    linear &= 0xfffff;
+    size_t n = std::min<size_t>(size, 0x100000 - linear);
+    memcpy(mem_.at<byte>(linear), in, n);
+    on_write_range(linear, n);
+    linear += n;
+    in += n;
+    size -= n;
+  }
+}
+
+// Decodes every instruction as it goes, until the budget runs out.
+Cpu::ExitStatus Cpu::run_uncached() {
+  while (retired_ < budget_end_) {
+    Instr in;
+    decode(in, ctx_.ip);
+    PROFILE_RETIRE(in);
+    CYCLES_RETIRE(in);
+    ctx_.ip += in.length;
+    ++retired_;
+    ExitStatus st = dispatch(in);
+    if (st != kContinue) return st;
+    throttle_.pace(cycles());
+  }
+  return kExitBudget;
+}
+
+Cpu::ExitStatus Cpu::run_loop() {
+  if (!use_block_cache_) return run_uncached();
+
+  jit_frame_.mem = mem_.at<byte>(0);
+  jit_frame_.pages = mem_.tags();
+  for (;;) {
+    if (cache_.stale()) flush_cache();
+    dword pc = linear(ctx_.seg.cs, ctx_.ip);
+    Block *blk = cache_.find(pc);
+    if (!blk) blk = &build_block(pc);
+    // The budget is only checked here, between blocks; the block it runs
+    // out in is run an instruction at a time.
+    if (budget_end_ - retired_ < blk->instrs.size()) return run_uncached();
+
+    // Translated code can't count what it retires, nor the cycles
+#if !defined(TOY8086_PROFILE) && !defined(TOY8086_CYCLES)
+    if (use_jit_ && !throttle_.enabled() && run_native(*blk)) continue;
+#endif
+    ExitStatus st = run_block(*blk);
+    if (st != kContinue) return st;
+    throttle_.pace(cycles());
+  }
+}
+
+// Runs the translation of |blk|, translating it once it gets hot. Returns
+// false if the interpreter has to run it instead.
+bool Cpu::run_native(Block &blk) {
+  if (!blk.native) {
+    if (++blk.hits != Jit::kThreshold) return false;
+    if (!jit_.translate(blk, ctx_.seg.cs, ctx_.ip)) return false;
+    ++translated_;
+  }
+  JitBlock &jb = *blk.native;
+  if (jb.cs != ctx_.seg.cs || jb.ip != ctx_.ip) return false;
+
+  // Chained blocks go on while another whole block fits in the budget
+  uint64_t left = budget_end_ - retired_;
+  if (left > JitFrame::kUnlimited) left = JitFrame::kUnlimited;
+  jit_frame_.retired = 0;
+  jit_frame_.chain_limit =
+    left > Block::kMaxLength ? left - Block::kMaxLength : 0;
+  JitExit *exit = jit_.run(jb, ctx_, jit_frame_);
+  if (!jit_frame_.retired) return false;  // bailed out before the first one
+  retired_ += jit_frame_.retired;
+
+  if (exit->jump && !exit->to) {   // chained ones return past the limit
+    Block *next = cache_.find(linear(ctx_.seg.cs, ctx_.ip));
+    if (next && next->native && next->native->cs == ctx_.seg.cs &&
+        next->native->ip == ctx_.ip) {
+      jit_.chain(*exit, *next->native);
+    }
+  }
+  return true;
+}
+
+void Cpu::flush_cache() {
+  for (dword start : cache_.pending()) {
+    Block *blk = cache_.find(start);
+    if (blk && blk->native) jit_.drop(*blk);
+  }
+  cache_.flush();
+}
+
+inline word Cpu::ea_offset(const Instr &in) {
+  word base;
+  switch (in.ea) {
+    case Instr::kEaBxSi: base = ctx_.b.x + ctx_.si;  break;
+    case Instr::kEaBxDi: base = ctx_.b.x + ctx_.di;  break;
+    case Instr::kEaBpSi: base = ctx_.bp + ctx_.si;   break;
+    case Instr::kEaBpDi: base = ctx_.bp + ctx_.di;   break;
+    case Instr::kEaSi:   base = ctx_.si;             break;
+    case Instr::kEaDi:   base = ctx_.di;             break;
+    case Instr::kEaBp:   base = ctx_.bp;             break;
+    case Instr::kEaBx:   base = ctx_.b.x;            break;
+    default:             base = 0;                   break;
+  }
+  return base + in.disp;
+}
+
+inline void *Cpu::decode_rm(const Instr &in, bool is_8bit, bool read) {
+  // mod = 0b11: register only
+  if (in.ea == Instr::kEaReg) {
+    byte rmbits = in.modrm & 7;
+    if (is_8bit) return &ctx_.reg_gen[rmbits & 3].v[rmbits >> 2];
+    else return &ctx_.reg_all[rmbits];
+  }
+
+  ea_linear_ = linear(ctx_.seg.reg_seg[in.seg], ea_offset(in));
+  if (read) on_read(ea_linear_, is_8bit ? 1 : 2);
+  return mem_.at<void>(ea_linear_);
+}
+
+void *Cpu::decode_reg(const Instr &in, bool is_8bit) {
+  byte regbits = (in.modrm >> 3) & 7;
   if (is_8bit) return &ctx_.reg_gen[regbits & 3].v[regbits >> 2];
   else return &ctx_.reg_all[regbits];
 }
 
+// Only the terminal needs switching out of line mode; other streams are read
+// as they are.
+int Cpu::read_char(bool echo) {
+  if (display_) display_->present(true);
+  out_.flush();   // the guest may be prompting for this
+  uint32_t v;
+  int c = replay(kTraceInput, v) ? int32_t(v) : in_.get();
+  record(kTraceInput, c);
+  if (echo && c >= 0 && in_.interactive()) {
+    out_.put(c);
+    out_.flush();
+  }
+  return c;
+}
+
 Cpu::ExitStatus Cpu::handle_interrupt(byte interrupt) {
   switch (interrupt) {
     case 0x21: {  // DOS interrupt
+      if ((ctx_.a.h == 0x01 || ctx_.a.h == 0x08) &&
+          (stop_for_input_ ||
+           (yield_for_input_ && !replayer_ && !in_.ready()))) {
+        return kExitInputWait;    // the INT 21h does not retire
+      }
       switch (ctx_.a.h) {
         case 0x01:  // get char from stdin
-          ctx_.a.l = (char) getonechar(true);
+          ctx_.a.l = (char) read_char(true);
           break;
         case 0x02:  // print char to stdout
-          printf("%c", ctx_.d.l);
+          out_.put(ctx_.d.l);
           ctx_.a.l = ctx_.d.l;  // side effect
           break;
         case 0x08:  // get char from stdin without echo
-          ctx_.a.l = (char) getonechar(false);
+          ctx_.a.l = (char) read_char(false);
           break;
         case 0x09: { // print string terminated by '$' to stdout
-          for (word dx = ctx_.d.x; ; dx++) {
-            char b = *mem_.get<char>(ctx_.seg.get(), dx);
-            if (b != '$') {
-              printf("%c", b);
-            } else {
-              break;
-            }
+          // Searched in runs up to where the segment or the memory wraps.
+          word dx = ctx_.d.x;
+          for (size_t left = 0x10000; left;) {
+            const char *s = mem_.get<char>(ctx_.seg.ds, dx);
+            size_t run = std::min<size_t>(left, 0x10000 - dx);
+            run = std::min<size_t>(run, 0x100000 - linear(ctx_.seg.ds, dx));
+            const char *end = static_cast<const char *>(memchr(s, '$', run));
+            out_.write(s, end ? end - s : run);
+            if (end) break;
+            left -= run;
+            dx += run;
           }
           break;
         }
@@ -818,24 +1584,21 @@ Cpu::ExitStatus Cpu::handle_interrupt(byte interrupt) {
       break;
     case 0x1a: {
       switch (ctx_.a.h) {
-        case 0x00: {
-          time_t current_time = time(NULL);
-          struct tm *current_tm = localtime(&current_time);
-          dword ticks = (current_tm->tm_hour * 3600 + current_tm->tm_min * 60
-                         + current_tm->tm_sec) * 0x1800b0u / (24 * 60 * 60);
-          // result: CX:DX
+        case 0x00: {  // tick count since midnight in CX:DX
+          if (display_) display_->present(false);   // the guest idles here
+          uint32_t v;
+          if (!replay(kTraceClock, v)) {
+            uint64_t cycles = this->cycles();
+            clock_.pace(cycles);
+            bool midnight;
+            v = clock_.ticks(cycles, midnight) | uint32_t(midnight) << 31;
+          }
+          record(kTraceClock, v);
+          dword ticks = v & 0x7fffffff;
           ctx_.c.x = ticks >> 16;
           ctx_.d.x = ticks & 0xffff;
-          ctx_.a.l = 0;  // FIXME: add some static variables to make it right.
-          if (player_.playing) {
-#ifdef TOY8086_WIN32
-            Beep(player_.frequency, 120);  // FIXME: It cannot be any shorter because of hardware delay.
-#endif
-#ifdef TOY8086_UNIX
-            fprintf(stderr, "Playing using frequency %u\n", player_.frequency);
-            usleep(54925);
-#endif
-          }
+          ctx_.a.l = v >> 31;
+          if (clock_.mode() == Clock::kRealTime) ppi_.sound(ticks);
         }
           break;
       }
@@ -1,81 +1,158 @@
+#ifndef _CPU_H_
+#define _CPU_H_
+
 #include "helper.h"
 #include "mem.h"
+#include "segment.h"
+#include "block_cache.h"
+#include "clock.h"
+#include "console.h"
+#include "devices.h"
+#include "display.h"
+#include "fusion.h"
+#include "trace.h"
+#include "timing.h"
+#include "jit.h"
+#include <memory>
 #ifdef TOY8086_MSVC
 #  include <intrin.h>
 #  define __builtin_popcount __popcnt16
 #endif
 
+// Arithmetic flags, evaluated lazily. ALU operations only record what they
+// did; each flag is computed from that record when something reads it. Flags
+// that are set directly live in |bits|, laid out as in the FLAGS register.
 struct Flag {
-  union {
-    struct {
-      bool o : 1;
-      bool s : 1;
-      bool z : 1;
-      bool a : 1;
-      bool p : 1;
-      bool c : 1;
-    };  // 6 fields
-    word values;
+  enum Op : byte {
+    kOpNone,      // every flag is in |bits|
+    kOpAdd,
+    kOpAdc,       // carry in is bit 0 of |bits|
+    kOpSub,
+    kOpSbb,       // borrow in is bit 0 of |bits|
+    kOpInc,       // CF is bit 0 of |bits|
+    kOpDec,       // CF is bit 0 of |bits|
+    kOpLogic,
   };
 
+  enum Bit {
+    kBitC = 1 << 0,
+    kBitP = 1 << 2,
+    kBitA = 1 << 4,
+    kBitZ = 1 << 6,
+    kBitS = 1 << 7,
+    kBitD = 1 << 10,
+    kBitO = 1 << 11,
+    kBitAll = kBitC | kBitP | kBitA | kBitZ | kBitS | kBitO,
+  };
+
+  byte op = kOpNone;
+  word sign = 0;        // sign bit of the operation width
+  word dst = 0, src = 0, res = 0;
+  word bits = 0;
+  bool d = false;       // DF; no instruction computes it, so it is never lazy
+
+  // Records |kind| applied to |lhs| and |rhs| giving |result|. |carry| is
+  // the carry (or borrow) in for adc/sbb and the preserved CF for inc/dec.
   template<typename T>
-  void set_a(T dst, T src, T ret) {
-    a = (dst ^ src ^ ret) & 0x10;
+  void set_lazy(Op kind, T lhs, T rhs, T result, bool carry = false) {
+    op = kind;
+    sign = T(1) << (sizeof(T) * 8 - 1);
+    dst = lhs;
+    src = rhs;
+    res = result;
+    bits = carry;
   }
 
-  void set_szp(byte v) {
-    z = (v == 0);
-    s = (v & 0x80);
-    p = !(__builtin_popcount(v) & 1);
+  bool c() const {
+    switch (op) {
+      case kOpAdd:   return res < src;
+      case kOpAdc:   return res < src || (res == src && (bits & kBitC));
+      case kOpSub:   return res > dst;
+      case kOpSbb:   return res > dst || (res == dst && (bits & kBitC));
+      case kOpLogic: return false;
+      default:       return bits & kBitC;
+    }
   }
 
-  void set_szp(word v) {
-    z = (v == 0);
-    s = (v & 0x8000);
-    p = !(__builtin_popcount(static_cast<byte>(v)) & 1);
+  bool o() const {
+    switch (op) {
+      // Addition overflows when dst and src have the same sign and the
+      // result does not; subtraction when dst and src have different signs
+      // and the result's sign differs from dst.
+      case kOpAdd: case kOpAdc: case kOpInc:
+        return (dst ^ src ^ sign) & (res ^ src) & sign;
+      case kOpSub: case kOpSbb: case kOpDec:
+        return (dst ^ src) & (res ^ dst) & sign;
+      case kOpLogic:
+        return false;
+      default:
+        return bits & kBitO;
+    }
   }
 
-};  // Flag
-
-struct Segment {
-  enum Id {
-    kSegDefault       = -1,
-    kSegEs,
-    kSegCs,
-    kSegSs,
-    kSegDs,
-    kSegFs,
-    kSegGs,
-    kSegMax
-  };
+  bool a() const {
+    switch (op) {
+      case kOpNone:  return bits & kBitA;
+      case kOpLogic: return false;
+      default:       return (dst ^ src ^ res) & 0x10;
+    }
+  }
 
-  union {
-    struct {
-      word es, cs, ss, ds, fs, gs;
-    };
-    word reg_seg[kSegMax];
-  };
+  bool z() const { return op == kOpNone ? bits & kBitZ : res == 0; }
+  bool s() const { return op == kOpNone ? bits & kBitS : res & sign; }
+  bool p() const {
+    if (op == kOpNone) return bits & kBitP;
+    return !(__builtin_popcount(static_cast<byte>(res)) & 1);
+  }
 
-  Id id;
+  // Whether the condition of the Jcc with low opcode nibble |cc| holds.
+  bool test(byte cc) const {
+    bool v;
+    switch (cc >> 1) {
+      case 0:  v = o();                     break;   // jo
+      case 1:  v = c();                     break;   // jb
+      case 2:  v = z();                     break;   // je
+      case 3:  v = c() || z();              break;   // jbe
+      case 4:  v = s();                     break;   // js
+      case 5:  v = p();                     break;   // jp
+      case 6:  v = s() != o();              break;   // jl
+      default: v = s() != o() || z();       break;   // jle
+    }
+    return v != bool(cc & 1);   // odd ones are the negations
+  }
 
-  int get(Id default_segment = kSegDs) {
-    if (id == kSegDefault) return reg_seg[default_segment];
-    return reg_seg[id];
+  // All flags in the FLAGS register layout.
+  word get() const {
+    word dir = d * kBitD;
+    if (op == kOpNone) return bits | dir;
+    return c() * kBitC | p() * kBitP | a() * kBitA | z() * kBitZ |
+           s() * kBitS | o() * kBitO | dir;
   }
 
-  void set(Id id) {
-    this->id = id;
+  void set(word v) {
+    op = kOpNone;
+    bits = v & kBitAll;
+    d = v & kBitD;
   }
 
-  void reset() {
-    id = kSegDefault;
+  void set_bit(Bit bit, bool v) {
+    word all = get();
+    set(v ? all | bit : all & ~bit);
   }
 
-  Segment() {
-    reset();
-    memset(reg_seg, 0, sizeof(reg_seg));
+  void set_c(bool v) { set_bit(kBitC, v); }
+  void set_o(bool v) { set_bit(kBitO, v); }
+  void set_a(bool v) { set_bit(kBitA, v); }
+
+  template<typename T>
+  void set_szp(T v) {
+    word all = get() & ~(kBitZ | kBitS | kBitP);
+    if (v == 0) all |= kBitZ;
+    if (v & (T(1) << (sizeof(T) * 8 - 1))) all |= kBitS;
+    if (!(__builtin_popcount(static_cast<byte>(v)) & 1)) all |= kBitP;
+    set(all);
   }
-};  // Segment
+};  // Flag
 
 struct Context {
   union GeneralRegister {
@@ -112,11 +189,20 @@ struct Context {
   Flag flag;
 };  // Context
 
-struct BeepPlayer {
-  bool playing = false;
-  dword frequency = 0xffffffff;
-  byte device_8255 = 0xfd;
-};  // BeepPlayer
+// A guest frozen by Cpu::freeze(). Every Cpu constructed from it starts in
+// the same state and shares its memory copy-on-write.
+struct GuestImage {
+  MemoryImage mem;
+  Context ctx;
+  DeviceState devices;
+  // Where guest time stood, so that it goes on from there rather than from
+  // 0: the devices keep times taken from Cpu::cycles().
+  uint64_t retired = 0;
+  uint64_t cycles = 0;
+
+  GuestImage(const Memory &m, const Context &c, const DeviceState &d)
+    : mem(m), ctx(c), devices(d) {}
+};  // GuestImage
 
 class Cpu {
 public:
@@ -125,41 +211,233 @@ public:
     kExitDebugInterrupt,
     kExitInvalidOpcode,
     kExitInvalidInstruction,
+    kExitInputWait,   // stop_for_input_ or yield_for_input_: IP is at the INT
+                      // asking for input
+    kExitBudget,      // run_for() ran its instructions
     kContinue
   };
 
   Memory mem_;
   Context ctx_;
-  BeepPlayer player_;
+  // State of the motherboard devices below, kept apart so that it is frozen
+  // and saved with the guest.
+  DeviceState devices_;
+
+  // I/O ports, with the motherboard devices attached. Attach more devices
+  // to give the guest other hardware.
+  IoBus io_;
+  Pic pic_{devices_.pic};
+  Pit pit_{devices_.pit};
+  Ppi ppi_{devices_.ppi, pit_};
+  KeyboardController keyboard_{devices_.keyboard};
+
+  // Console of the guest.
+  ConsoleIn in_;
+  Console out_;
+
+  // Disable to decode every instruction again each time it is executed.
+  bool use_block_cache_ = true;
+  // Translate hot blocks to native code. Needs the block cache.
+  bool use_jit_ = false;
+  // Run common instruction groups in cached blocks as superinstructions;
+  // see fusion.h. Applies to blocks cached from then on. Not available with
+  // TOY8086_PROFILE or TOY8086_CYCLES.
+  bool use_fusion_ = false;
+  // Instructions retired by run(), including those of the guest frozen into
+  // the GuestImage this one was forked from.
+  uint64_t retired_ = 0;
+  // Fused groups run, per Fusion, and the instructions they retired: fewer
+  // than the groups hold when a write into cached code cut one short.
+  uint64_t fused_runs_[kFusionCount] = {};
+  uint64_t fused_retired_ = 0;
+  // Blocks translated by the JIT, counting those translated again after
+  // the JIT dropped every translation.
+  uint64_t translated_ = 0;
+#ifdef TOY8086_CYCLES
+  // 8086 cycles of the instructions retired; see instr_cycles().
+  uint64_t cycles_ = 0;
+#endif
+  // Guest time for INT 1Ah. Fast-forward unless set to real time.
+  Clock clock_;
+  // Holds the guest to a clock rate if enabled. Translated code is not
+  // used then, as it only returns to be paced when it has to.
+  Throttle throttle_;
+  // Stop with kExitInputWait, rather than read, once the guest asks for
+  // console input; run() again to resume.
+  bool stop_for_input_ = false;
+  // Stop with kExitInputWait, rather than block, once the guest asks for
+  // console input that has not arrived yet; run() again once in_ is ready().
+  // See GuestLoop.
+  bool yield_for_input_ = false;
+  // Record the nondeterministic inputs of the run to, or replay them from,
+  // a trace. Not owned.
+  TraceRecorder *recorder_ = nullptr;
+  TraceReplayer *replayer_ = nullptr;
+
+  // Renders the text screen to |out| (if not null) and mirrors it into the
+  // file at |shared_path| (if not null). See TextDisplay.
+  bool open_display(FILE *out, const char *shared_path);
+
+  // Maps |device|, not owned, over [|linear|, |linear| + |size|) of guest
+  // memory; see MemoryDevice and Rom.
+  void map_memory(dword linear, size_t size, MemoryDevice *device);
 
   void dump_status();
+#ifdef TOY8086_PROFILE
+  // Prints the hottest opcodes and CS:IP addresses.
+  void dump_profile(size_t top = 20);
+#endif
   ExitStatus run();
+  // Runs at most |max_instructions| instructions, and returns kExitBudget
+  // if the guest has not stopped by then. Call again to go on.
+  ExitStatus run_for(uint64_t max_instructions);
+  // Runs a single instruction; kExitBudget if it did not stop the guest.
+  ExitStatus step() { return run_for(1); }
+
+  // Copy guest memory from and to |buf|, from linear address |linear| on,
+  // wrapping around at the top of memory.
+  void peek(dword linear, void *buf, size_t size);
+  void poke(dword linear, const void *buf, size_t size);
 
-  Cpu() {
+  // Guest cycles so far: modeled with TOY8086_CYCLES, and otherwise
+  // estimated from the instruction count.
+  uint64_t cycles() const {
+#ifdef TOY8086_CYCLES
+    return cycles_;
+#else
+    return retired_ * Clock::kCyclesPerInstruction;
+#endif
+  }
+
+  Cpu() : cache_(mem_.tags()) {
     memset(&ctx_.reg_all, 0, sizeof(ctx_.reg_all));
+    attach_devices();
+  }
+
+  // Forks a guest from |image|. Only the pages it writes get copied.
+  explicit Cpu(const GuestImage &image)
+    : mem_(image.mem), ctx_(image.ctx), devices_(image.devices),
+      retired_(image.retired), cache_(mem_.tags()) {
+#ifdef TOY8086_CYCLES
+    cycles_ = image.cycles;
+#endif
+    attach_devices();
+  }
+
+  // Freezes the current guest state, typically right after loading, so that
+  // many instances can be forked from it.
+  std::shared_ptr<GuestImage> freeze() const {
+    auto image = std::make_shared<GuestImage>(mem_, ctx_, devices_);
+    image->retired = retired_;
+    image->cycles = cycles();
+    return image;
   }
 
 private:
-  struct {
-    bool repe:         1;
-    bool repne:        1;
-    bool lock:         1;
-  } pfx_;
+  BlockCache cache_;
+  std::unique_ptr<TextDisplay> display_;
+  Jit jit_;
+  JitFrame jit_frame_;
+  dword ea_linear_;   // linear address of the last memory operand
+  bool trap_reads_ = false;           // some mapped device traps reads
+  uint64_t budget_end_ = UINT64_MAX;  // retired_ at which run_for() stops
+
+  // Guest code from CS:0 to the end of the segment or of memory, so that
+  // decoding needs no linear address or bounds of its own. Refilled when
+  // CS is found changed, which covers far transfers and interrupts.
+  struct FetchWindow {
+    word cs = 0;
+    const byte *code = nullptr;   // guest memory at CS:0
+    dword size = 0;               // bytes before the segment or memory ends
+  } fetch_;
 
-  byte& fetch() {
-    byte &tmp = *mem_.get<byte>(ctx_.seg.cs, ctx_.ip);
-    ctx_.ip += sizeof(byte);
-    return tmp;
+  static dword linear(word seg, word offset) {
+    return ((seg << 4) + offset) & 0xfffff;
   }
 
-  word& fetchw() {
-    word &tmp = *mem_.get<word>(ctx_.seg.cs, ctx_.ip);
-    ctx_.ip += sizeof(word);
-    return tmp;
+  typedef ExitStatus (*Handler)(Cpu &cpu, const Instr &in);
+  // One per opcode, then one per ModRM reg field of the 10 group opcodes
+  static constexpr size_t kHandlerCount = 256 + 10 * 8;
+  static const Handler kHandlers[kHandlerCount];
+  // Fused groups get handlers after the others, as many as kFusedHandlers
+  // lists: one per Fusion, and one per opcode of the compare for compare
+  // and Jcc, so that its operand forms fold away.
+  struct FusedHandler {
+    Fusion kind;
+    byte opcode;    // of the compare, or 0
+    void (Cpu::*run)(const Instr *in);
+  };
+  static constexpr size_t kFusedHandler = kHandlerCount;
+  static constexpr size_t kFusedHandlerCount = 23;
+  static const FusedHandler kFusedHandlers[kFusedHandlerCount];
+
+#ifdef TOY8086_PROFILE
+  // Retired instructions per handler and per linear CS:IP.
+  uint64_t handler_hits_[kHandlerCount] = {};
+  std::vector<uint64_t> ip_hits_ = std::vector<uint64_t>(1 << 20);
+#endif
+
+  void attach_devices() {
+    io_.attach(Pic::kPort, Pic::kPorts, &pic_);
+    io_.attach(Pit::kPort, Pit::kPorts, &pit_);
+    io_.attach(Ppi::kPort, Ppi::kPorts, &ppi_);
+    io_.attach(KeyboardController::kDataPort, 1, &keyboard_);
+    io_.attach(KeyboardController::kStatusPort, 1, &keyboard_);
   }
 
-  void *decode_rm(byte b, bool is_8bit = true);
-  void *decode_reg(byte b, bool is_8bit = true);
+  ExitStatus run_loop();
+  ExitStatus run_uncached();
+  void decode(Instr &in, word ip);
+  Block &build_block(dword start);
+  void fuse(Block &blk);
+  ExitStatus run_block(const Block &blk);
+  bool run_native(Block &blk);
+  void flush_cache();
+  ExitStatus dispatch(const Instr &in);
+  TOY8086_ALWAYS_INLINE ExitStatus execute(const Instr &in, byte b, int reg);
+  template<int B, int Reg> static ExitStatus exec_op(Cpu &cpu,
+                                                     const Instr &in);
+
+  // Fused groups; each stops early only if a write leaves the cache stale.
+  // Out of line, so that run_block() compiles as it does without them.
+  template<int Kind, int B> TOY8086_NOINLINE void run_fused(const Instr *in);
+  template<int B> void fused_compare_jcc(const Instr *in);
+  template<bool Dec> void fused_incdec_jcc(const Instr *in);
+  void run_step(const Instr &in, bool flags);
+  void fused_step_loop(const Instr *in, int steps);
+  void fused_push_call(const Instr *in, int pushes);
+  void fused_enter(const Instr *in);
+  void fused_pop_ret(const Instr *in, int pops);
+
+  TOY8086_ALWAYS_INLINE word ea_offset(const Instr &in);
+  // Pointer to the operand, in guest memory or the Context. A memory
+  // operand is reported as read unless |read| is false.
+  TOY8086_ALWAYS_INLINE void *decode_rm(const Instr &in, bool is_8bit = true,
+                                       bool read = true);
+  void *decode_reg(const Instr &in, bool is_8bit = true);
+
+  // Records a guest write of at most a page in memory, and reports it to
+  // the block cache if it hit a tagged page.
+  void on_write(dword linear, size_t size) {
+    if (mem_.mark(linear, size)) cache_.on_write(linear, size);
+  }
+  // on_write() for a write that may span any number of pages.
+  void on_write_range(dword linear, size_t size) {
+    if (mem_.mark_range(linear, size)) cache_.on_write(linear, size);
+  }
+
+  // Reports a guest read of at most a word to the devices trapping reads
+  // there, if any.
+  void on_read(dword linear, size_t size) {
+    if (trap_reads_ && (mem_.tags_at(linear) & BlockCache::kPageDevice)) {
+      cache_.on_read(linear, size);
+    }
+  }
+
+  // Records a write through the last memory operand.
+  void track_rm_write(const Instr &in, size_t size) {
+    if (in.ea < Instr::kEaReg) on_write(ea_linear_, size);
+  }
 
   template<typename T> void op_add(T &dst, T &src);
   template<typename T> void op_adc(T &dst, T &src);
@@ -170,6 +448,8 @@ private:
   template<typename T> void op_xor(T &dst, T &src);
   template<typename T> void op_cmp(T dst, T src);
   template<typename T> void op_test(T dst, T src);
+  template<typename T> void op_inc(T &dst);
+  template<typename T> void op_dec(T &dst);
 
   template<typename T> void op_not(T &dst);
   template<typename T> void op_neg(T &dst);
@@ -195,6 +475,19 @@ private:
   void op_xchg(word &dst, word &src);
   template<typename D, typename S> void op_in(D &dst, S src);
   template<typename D, typename S> void op_out(D dst, S &src);
+  template<typename T> void op_string(const Instr &in, byte op);
+  template<typename T> bool op_string_bulk(byte op, byte prefix,
+                                           word src_seg);
+
+  bool replay(TraceEvent kind, uint32_t &value) {
+    return replayer_ && replayer_->next(kind, retired_, value);
+  }
+  void record(TraceEvent kind, uint32_t value) {
+    if (recorder_) recorder_->record(kind, retired_, value);
+  }
 
+  int read_char(bool echo);
   Cpu::ExitStatus handle_interrupt(byte interrupt);
 };
+
+#endif
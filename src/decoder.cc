@@ -0,0 +1,229 @@
+#include "decoder.h"
+
+namespace {
+
+enum OpFlag : byte {
+  kOpPrefix  = 1 << 0,
+  kOpModrm   = 1 << 1,
+  kOpImm8    = 1 << 2,    // sign-extended; 8-bit operations use the low byte
+  kOpImm16   = 1 << 3,
+  kOpFar     = 1 << 4,    // Ap: offset, then segment
+  kOpMoffs   = 1 << 5,    // disp16 memory operand without a ModRM byte
+  kOpTestImm = 1 << 6,    // group 3: an immediate only for reg = 0 (test)
+  kOpEnds    = 1 << 7,    // ends a block
+};
+
+struct OpInfo {
+  byte flags;   // OpFlag
+  byte kind;    // OpClass, | kWide
+};
+
+constexpr bool in_range(int b, int lo, int hi) { return b >= lo && b <= hi; }
+
+constexpr bool is_prefix(int b) {
+  return b == 0xf0 || b == 0xf2 || b == 0xf3 ||
+         b == 0x26 || b == 0x2e || b == 0x36 || b == 0x3e;
+}
+
+// add, or, adc, sbb, and, sub, xor, cmp in their 6 forms
+constexpr bool is_alu(int b) { return b < 0x40 && (b & 7) < 6; }
+
+// No operands beyond the opcode byte
+constexpr bool is_bare(int b) {
+  return in_range(b, 0x40, 0x5f) || in_range(b, 0x90, 0x97) ||
+         b == 0x0e || b == 0x1e || b == 0x1f || in_range(b, 0x9c, 0x9f) ||
+         b == 0xf5 || b == 0xf8 || b == 0xf9 || b == 0xfc || b == 0xfd ||
+         in_range(b, 0xa4, 0xa7) || in_range(b, 0xaa, 0xaf);
+}
+
+constexpr byte op_flags(int b) {
+  return is_prefix(b) ? kOpPrefix
+    : is_alu(b) ? ((b & 7) < 4 ? kOpModrm : (b & 7) == 4 ? kOpImm8 : kOpImm16)
+    : b == 0x80 || b == 0x82 || b == 0x83 || b == 0xc6 ? kOpModrm | kOpImm8
+    : b == 0x81 || b == 0xc7 ? kOpModrm | kOpImm16
+    : in_range(b, 0x88, 0x8e) || in_range(b, 0xd0, 0xd3) ? kOpModrm
+    : b == 0xf6 || b == 0xf7 ? kOpModrm | kOpTestImm
+    : in_range(b, 0xb0, 0xb7) || in_range(b, 0xe4, 0xe7) || b == 0xa8
+      ? kOpImm8
+    : in_range(b, 0xb8, 0xbf) || b == 0xa9 ? kOpImm16
+    : in_range(b, 0xa0, 0xa3) ? kOpMoffs
+    : in_range(b, 0x70, 0x7f) || in_range(b, 0xe0, 0xe2) || b == 0xeb ||
+      b == 0xcd ? kOpImm8 | kOpEnds
+    : b == 0xe8 || b == 0xe9 || b == 0xc2 || b == 0xca ? kOpImm16 | kOpEnds
+    : b == 0x9a || b == 0xea ? kOpFar | kOpEnds
+    : is_bare(b) ? 0
+    : kOpEnds;    // c3, cb, cc, f4, and whatever is not implemented
+}
+
+constexpr byte op_class(int b) {
+  return is_prefix(b) ? kClassPrefix
+    : is_alu(b) || in_range(b, 0x80, 0x83) || in_range(b, 0x40, 0x4f) ||
+      in_range(b, 0xd0, 0xd3) || b == 0xf6 || b == 0xf7 || b == 0xa8 ||
+      b == 0xa9 ? kClassAlu
+    : in_range(b, 0x88, 0x8e) || in_range(b, 0x91, 0x97) ||
+      in_range(b, 0xa0, 0xa3) || in_range(b, 0xb0, 0xbf) || b == 0xc6 ||
+      b == 0xc7 ? kClassMove
+    : in_range(b, 0x50, 0x5f) || b == 0x0e || b == 0x1e || b == 0x1f ||
+      b == 0x9c || b == 0x9d ? kClassStack
+    : in_range(b, 0x70, 0x7f) || in_range(b, 0xe0, 0xe2) ||
+      in_range(b, 0xe8, 0xeb) || b == 0x9a || b == 0xc2 || b == 0xc3 ||
+      b == 0xca || b == 0xcb ? kClassBranch
+    : b == 0xcc || b == 0xcd ? kClassInterrupt
+    : in_range(b, 0xa4, 0xa7) || in_range(b, 0xaa, 0xaf) ? kClassString
+    : in_range(b, 0xe4, 0xe7) || in_range(b, 0xec, 0xef) ? kClassIo
+    : b == 0x9e || b == 0x9f || b == 0xf5 || b == 0xf8 || b == 0xf9 ||
+      b == 0xfc || b == 0xfd ? kClassFlags
+    : b == 0x90 || b == 0xf4 ? kClassMisc
+    : kClassInvalid;
+}
+
+// Whether the operands are words: the w bit, except where the opcode
+// implies the width.
+constexpr bool op_wide(int b) {
+  return in_range(b, 0x40, 0x5f) || in_range(b, 0x90, 0x97) ||
+         in_range(b, 0x8c, 0x8e) || b == 0x0e || b == 0x1e || b == 0x1f ||
+         b == 0x9c || b == 0x9d ? true
+    : in_range(b, 0xb0, 0xbf) ? b >= 0xb8
+    : b & 1;
+}
+
+constexpr OpInfo op_info(int b) {
+  return {op_flags(b), byte(op_class(b) | (op_wide(b) ? kWide : 0))};
+}
+
+#define OP_ROW(r)                                                           \
+  op_info(r + 0x0), op_info(r + 0x1), op_info(r + 0x2), op_info(r + 0x3),   \
+  op_info(r + 0x4), op_info(r + 0x5), op_info(r + 0x6), op_info(r + 0x7),   \
+  op_info(r + 0x8), op_info(r + 0x9), op_info(r + 0xa), op_info(r + 0xb),   \
+  op_info(r + 0xc), op_info(r + 0xd), op_info(r + 0xe), op_info(r + 0xf)
+
+constexpr OpInfo kOpTable[256] = {
+  OP_ROW(0x00), OP_ROW(0x10), OP_ROW(0x20), OP_ROW(0x30),
+  OP_ROW(0x40), OP_ROW(0x50), OP_ROW(0x60), OP_ROW(0x70),
+  OP_ROW(0x80), OP_ROW(0x90), OP_ROW(0xa0), OP_ROW(0xb0),
+  OP_ROW(0xc0), OP_ROW(0xd0), OP_ROW(0xe0), OP_ROW(0xf0),
+};
+
+#undef OP_ROW
+
+// ModRM byte: Instr::Ea in the low nibble, displacement bytes in bits 4-5,
+// and kModrmStack if the address defaults to SS (BP based).
+enum { kModrmStack = 1 << 6 };
+
+constexpr byte modrm_info(int m) {
+  return (m >> 6) == 3 ? Instr::kEaReg
+    : (m >> 6) == 0 && (m & 7) == 6 ? Instr::kEaDisp | 2 << 4
+    : byte((m & 7) | (m >> 6) << 4 |
+           ((m & 7) == 2 || (m & 7) == 3 || (m & 7) == 6 ? kModrmStack : 0));
+}
+
+#define MODRM_ROW(r)                                                        \
+  modrm_info(r + 0x0), modrm_info(r + 0x1), modrm_info(r + 0x2),            \
+  modrm_info(r + 0x3), modrm_info(r + 0x4), modrm_info(r + 0x5),            \
+  modrm_info(r + 0x6), modrm_info(r + 0x7), modrm_info(r + 0x8),            \
+  modrm_info(r + 0x9), modrm_info(r + 0xa), modrm_info(r + 0xb),            \
+  modrm_info(r + 0xc), modrm_info(r + 0xd), modrm_info(r + 0xe),            \
+  modrm_info(r + 0xf)
+
+constexpr byte kModrmTable[256] = {
+  MODRM_ROW(0x00), MODRM_ROW(0x10), MODRM_ROW(0x20), MODRM_ROW(0x30),
+  MODRM_ROW(0x40), MODRM_ROW(0x50), MODRM_ROW(0x60), MODRM_ROW(0x70),
+  MODRM_ROW(0x80), MODRM_ROW(0x90), MODRM_ROW(0xa0), MODRM_ROW(0xb0),
+  MODRM_ROW(0xc0), MODRM_ROW(0xd0), MODRM_ROW(0xe0), MODRM_ROW(0xf0),
+};
+
+#undef MODRM_ROW
+
+static_assert(kOpTable[0x05].flags == kOpImm16, "add AX, Iv");
+static_assert(kOpTable[0xf7].flags == (kOpModrm | kOpTestImm), "group 3");
+static_assert(kModrmTable[0x46] == (Instr::kEaBp | 1 << 4 | kModrmStack),
+              "[bp + disp8]");
+
+}  // namespace
+
+bool decode_instr(const byte *code, size_t size, Instr &in) {
+  size_t pos = 0;
+  int seg = Segment::kSegDefault;
+  byte b;
+  in.prefix = 0;
+  for (;;) {
+    if (pos == size) goto truncated;
+    b = code[pos++];
+    if (!(kOpTable[b].flags & kOpPrefix)) break;
+    switch (b) {
+      case 0xf0: in.prefix |= Instr::kPfxLock;  break;
+      case 0xf2: in.prefix |= Instr::kPfxRepne; break;
+      case 0xf3: in.prefix |= Instr::kPfxRepe;  break;
+      case 0x26: seg = Segment::kSegEs; break;
+      case 0x36: seg = Segment::kSegSs; break;
+      case 0x2e: seg = Segment::kSegCs; break;
+      case 0x3e: seg = Segment::kSegDs; break;
+    }
+  }
+
+  if (seg != Segment::kSegDefault) in.prefix |= Instr::kPfxSeg;
+
+  {
+    const OpInfo op = kOpTable[b];
+    in.opcode = b;
+    in.modrm = 0;
+    in.ea = Instr::kEaNone;
+    in.ends_block = op.flags & kOpEnds;
+    in.kind = op.kind;
+    in.disp = in.imm = in.imm2 = 0;
+
+    auto word_at = [&](size_t at) -> word {
+      return code[at] | code[at + 1] << 8;
+    };
+
+    size_t imm_size = op.flags & kOpImm8 ? 1 : op.flags & kOpImm16 ? 2 : 0;
+    if (op.flags & kOpModrm) {
+      if (pos == size) goto truncated;
+      byte modrm = in.modrm = code[pos++];
+      byte info = kModrmTable[modrm];
+      size_t disp_size = (info >> 4) & 3;
+      if (size - pos < disp_size) goto truncated;
+      in.ea = info & 0xf;
+      if (disp_size == 1) in.disp = (int8_t) code[pos];
+      else if (disp_size == 2) in.disp = word_at(pos);
+      pos += disp_size;
+
+      if (seg == Segment::kSegDefault && (info & kModrmStack)) {
+        seg = Segment::kSegSs;
+      }
+      byte reg = (modrm >> 3) & 7;
+      if ((op.flags & kOpTestImm) && reg == 0) imm_size = b & 1 ? 2 : 1;
+      if (b == 0x8e && reg == Segment::kSegCs) in.ends_block = true;
+    } else if (op.flags & kOpMoffs) {
+      if (size - pos < 2) goto truncated;
+      in.ea = Instr::kEaDisp;
+      in.disp = word_at(pos);
+      pos += 2;
+    } else if (op.flags & kOpFar) {
+      if (size - pos < 4) goto truncated;
+      in.imm = word_at(pos);
+      in.imm2 = word_at(pos + 2);
+      pos += 4;
+    }
+
+    if (size - pos < imm_size) goto truncated;
+    if (imm_size == 1) in.imm = (int8_t) code[pos];
+    else if (imm_size == 2) in.imm = word_at(pos);
+    pos += imm_size;
+
+    in.seg = seg == Segment::kSegDefault ? Segment::kSegDs : seg;
+    in.length = pos;
+    return true;
+  }
+
+truncated:
+  in.opcode = size ? code[0] : 0;
+  in.modrm = 0;
+  in.ea = Instr::kEaNone;
+  in.seg = Segment::kSegDs;
+  in.length = 1;
+  in.ends_block = true;
+  in.kind = kClassInvalid;
+  in.disp = in.imm = in.imm2 = 0;
+  return false;
+}
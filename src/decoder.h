@@ -0,0 +1,79 @@
+#ifndef _DECODER_H_
+#define _DECODER_H_
+
+#include "helper.h"
+#include "segment.h"
+
+// What an opcode does, roughly; for tools that look at code without running
+// it. Instr::kind holds one of these, with kWide or-ed in.
+enum OpClass : byte {
+  kClassInvalid,
+  kClassPrefix,
+  kClassAlu,        // arithmetic, logic, shifts, test, mul/div
+  kClassMove,       // mov, lea, xchg
+  kClassStack,      // push, pop, pushf, popf
+  kClassBranch,     // jumps, calls, returns, loops
+  kClassInterrupt,  // int3, int
+  kClassString,
+  kClassIo,
+  kClassFlags,      // clc, stc, cmc, cld, std, sahf, lahf
+  kClassMisc,       // nop, hlt
+
+  kWide = 0x80,     // word operands
+};
+
+// A predecoded instruction. Everything the executor needs is resolved once
+// at decode time, so executing a cached instruction never touches the code
+// bytes again.
+struct Instr {
+  // Effective address formula of the ModRM operand. The first eight values
+  // are the rm field of the ModRM byte.
+  enum Ea {
+    kEaBxSi,
+    kEaBxDi,
+    kEaBpSi,
+    kEaBpDi,
+    kEaSi,
+    kEaDi,
+    kEaBp,
+    kEaBx,
+    kEaDisp,    // mod = 0b00, rm = 0b110: EA = disp16
+    kEaReg,     // mod = 0b11: register operand
+    kEaNone,    // no ModRM byte
+  };
+
+  enum Prefix {
+    kPfxLock  = 1,
+    kPfxRepne = 2,
+    kPfxRepe  = 4,
+    kPfxSeg   = 8,    // a segment override, already applied to seg
+  };
+
+  byte opcode;
+  byte modrm;
+  byte ea;        // Ea
+  byte seg;       // Segment::Id of the memory operand, override applied
+  byte prefix;    // Prefix bits
+  byte length;    // including prefixes
+  bool ends_block;
+  byte kind;      // OpClass, | kWide
+  word handler;   // index into Cpu::kHandlers; not set by decode_instr()
+  word disp;
+  word imm;
+  word imm2;      // segment of far pointers
+#ifdef TOY8086_CYCLES
+  word cycles;    // instr_cycles(); not set by decode_instr()
+#endif
+};  // Instr
+
+// Longest instruction decode_instr() needs to see; only piles of redundant
+// prefixes come near it.
+static constexpr size_t kMaxInstrLength = 16;
+
+// Decodes the instruction at |code|, of which |size| bytes may be read, into
+// |in|. Table driven and free of side effects. Unknown opcodes decode to a
+// single byte of kClassInvalid that ends the block. Returns false, with |in|
+// such an invalid byte, if the instruction is longer than |size|.
+bool decode_instr(const byte *code, size_t size, Instr &in);
+
+#endif
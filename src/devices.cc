@@ -0,0 +1,180 @@
+#include "devices.h"
+#include "clock.h"
+#include <algorithm>
+#ifdef TOY8086_WIN32
+#  include <windows.h>
+#endif
+
+byte Pic::in(word port, uint64_t) {
+  if (port & 1) return s_.mask;
+  return 0;   // IRR or ISR, as selected by read_isr
+}
+
+void Pic::out(word port, byte value, uint64_t) {
+  if (!(port & 1)) {
+    if (value & 0x10) {           // ICW1
+      s_.init_words = value & 2 ? 1 : 2;    // ICW2, and ICW3 unless single
+      s_.init_icw4 = value & 1;
+      if (s_.init_icw4) ++s_.init_words;
+      s_.mask = 0;
+    } else if ((value & 0x18) == 0x08) {    // OCW3
+      if (value & 2) s_.read_isr = value & 1;
+    }
+    return;                       // OCW2, the EOI, has nothing to end
+  }
+  if (s_.init_words) {
+    --s_.init_words;
+    return;
+  }
+  s_.mask = value;                // OCW1
+}
+
+static uint64_t pit_clock(uint64_t cycles) {
+  return cycles / Pit::kCyclesPerClock;
+}
+
+word Pit::count(int i, uint64_t cycles) const {
+  const PitCounter &c = s_.counters[i];
+  uint64_t now = pit_clock(cycles);
+  uint64_t elapsed = now > c.start ? now - c.start : 0;
+  uint32_t n = c.reload ? c.reload : 0x10000;
+  switch (c.mode) {
+    case 2:   // rate generator
+      return word(n - elapsed % n);
+    case 3:   // square wave: counts down by 2, twice per period
+      return n < 2 ? word(n) : word(n - 2 * (elapsed % (n / 2)));
+    default:  // one-shot modes go on counting past 0
+      return word(n - elapsed);
+  }
+}
+
+bool Pit::output(int i, uint64_t cycles) const {
+  const PitCounter &c = s_.counters[i];
+  uint64_t now = pit_clock(cycles);
+  uint64_t elapsed = now > c.start ? now - c.start : 0;
+  uint32_t n = c.reload ? c.reload : 0x10000;
+  switch (c.mode) {
+    case 0:   return elapsed >= n;
+    case 2:   return elapsed % n != n - 1;
+    case 3:   return elapsed % n < (n + 1) / 2;
+    default:  return true;
+  }
+}
+
+dword Pit::frequency(int i) const {
+  word reload = s_.counters[i].reload;
+  return Clock::kHz / kCyclesPerClock / (reload ? reload : 0x10000);
+}
+
+byte Pit::in(word port, uint64_t cycles) {
+  int i = port & 3;
+  if (i == 3) return 0xff;        // the control word can't be read back
+  PitCounter &c = s_.counters[i];
+  word v = c.latched ? c.latch : count(i, cycles);
+  bool high = c.access == 2 || (c.access == 3 && c.read_high);
+  if (c.access == 3) c.read_high = !c.read_high;
+  if (!c.read_high) c.latched = false;    // the whole latch was read
+  return high ? v >> 8 : v & 0xff;
+}
+
+void Pit::out(word port, byte value, uint64_t cycles) {
+  int i = port & 3;
+  if (i == 3) {                   // control word
+    i = value >> 6;
+    if (i == 3) return;           // read-back is 8254 only
+    PitCounter &c = s_.counters[i];
+    byte access = (value >> 4) & 3;
+    if (!access) {                // latch the count
+      if (!c.latched) c.latch = count(i, cycles);
+      c.latched = true;
+      return;
+    }
+    c.access = access;
+    c.mode = (value >> 1) & 7;
+    if (c.mode > 5) c.mode -= 4;  // 6 and 7 are 2 and 3
+    c.write_high = c.read_high = c.latched = false;
+    return;
+  }
+
+  PitCounter &c = s_.counters[i];
+  switch (c.access) {
+    case 1:
+      c.reload = value;
+      break;
+    case 2:
+      c.reload = value << 8;
+      break;
+    default:
+      c.write_high = !c.write_high;
+      if (c.write_high) {
+        c.reload = (c.reload & 0xff00) | value;
+        return;                   // loaded with the high byte
+      }
+      c.reload = (c.reload & 0x00ff) | value << 8;
+      break;
+  }
+  c.start = pit_clock(cycles);
+}
+
+byte Ppi::in(word port, uint64_t cycles) {
+  // Memory refresh is requested every 18 timer clocks
+  bool refresh = cycles / (18 * Pit::kCyclesPerClock) & 1;
+  byte status = refresh << 4 | pit_.output(2, cycles) << 5;
+  switch (port) {
+    case kPort:     return (s_.port_b & 0xcf) | status;
+    case kPort + 1: return status;
+    default:        return 0xff;
+  }
+}
+
+void Ppi::out(word port, byte value, uint64_t) {
+  if (port == kPort) s_.port_b = value;
+}
+
+void Ppi::sound(dword tick) {
+  if (!speaker_on() || tick == s_.beep_tick) return;
+  s_.beep_tick = tick;
+#ifdef TOY8086_WIN32
+  Beep(pit_.frequency(2), 120);  // FIXME: It cannot be any shorter because of hardware delay.
+#endif
+#ifdef TOY8086_UNIX
+  fprintf(stderr, "Playing using frequency %u\n", pit_.frequency(2));
+#endif
+}
+
+byte KeyboardController::in(word port, uint64_t) {
+  if (port == kStatusPort) {
+    return 0x14 | s_.full;        // not inhibited, self test passed
+  }
+  s_.full = false;
+  return s_.output;
+}
+
+void KeyboardController::out(word port, byte value, uint64_t) {
+  if (port == kStatusPort) {
+    s_.pending = 0;
+    switch (value) {
+      case 0x20: reply(s_.command); break;    // read the command byte
+      case 0x60:                              // write the command byte
+      case 0xd1: s_.pending = value; break;   // write the output port
+      case 0xaa: reply(0x55); break;          // self test
+      case 0xab: reply(0x00); break;          // interface test
+    }
+    return;
+  }
+  if (s_.pending == 0x60) s_.command = value;
+  else if (!s_.pending) reply(0xfa);          // the keyboard acknowledges
+  s_.pending = 0;
+}
+
+Rom::Rom(Memory &mem, dword linear, size_t size)
+  : mem_(mem), start_(linear),
+    contents_(mem.at<byte>(linear), mem.at<byte>(linear) + size) {}
+
+void Rom::on_write(dword linear, size_t size) {
+  dword first = std::max(linear, start_);
+  dword last = std::min(dword(linear + size), dword(start_ + contents_.size()));
+  if (first < last) {
+    memcpy(mem_.at<byte>(first), &contents_[first - start_], last - first);
+  }
+}
@@ -0,0 +1,154 @@
+#ifndef _DEVICES_H_
+#define _DEVICES_H_
+
+#include "block_cache.h"
+#include "io_bus.h"
+#include "mem.h"
+#include <vector>
+
+// The devices of the PC motherboard, for the I/O bus and guest memory. The
+// state of those on the bus lives in plain structs collected in a
+// DeviceState, which is frozen and saved along with the rest of a guest.
+
+struct PicState {
+  byte mask = 0xbc;           // IRQ 0, 1, 6 enabled, as the BIOS leaves it
+  byte init_words = 0;        // initialization words still to come at 21h
+  bool init_icw4 = false;     // the last of them is ICW4
+  bool read_isr = false;      // 20h reads the in-service register
+};
+
+struct PitCounter {
+  word reload = 0;            // 0 counts 65536
+  byte access = 3;            // 1 low byte, 2 high byte, 3 low then high
+  byte mode = 3;
+  bool write_high = false;    // low then high: the high byte is next
+  bool read_high = false;
+  bool latched = false;
+  word latch = 0;
+  uint64_t start = 0;         // PIT clock at which |reload| was loaded
+};
+
+struct PitState {
+  PitCounter counters[3];
+};
+
+struct PpiState {
+  byte port_b = 0xfd;         // as last written to 61h
+  dword beep_tick = 0xffffffff;   // BIOS tick of the last beep
+};
+
+struct KeyboardState {
+  byte output = 0;            // the byte waiting at 60h
+  bool full = false;          // ... and not read yet
+  byte command = 0x45;        // the controller's command byte
+  byte pending = 0;           // a command taking a data byte at 60h next
+};
+
+struct DeviceState {
+  PicState pic;
+  PitState pit;
+  PpiState ppi;
+  KeyboardState keyboard;
+};
+
+// 8259 interrupt controller at 20h-21h. No hardware interrupts are raised,
+// so nothing is ever requested or in service; what the guest programs, the
+// mask and the initialization sequence, is kept.
+class Pic : public IoDevice {
+public:
+  static constexpr word kPort = 0x20;
+  static constexpr size_t kPorts = 2;
+
+  explicit Pic(PicState &s) : s_(s) {}
+
+  byte in(word port, uint64_t cycles) override;
+  void out(word port, byte value, uint64_t cycles) override;
+
+private:
+  PicState &s_;
+};  // Pic
+
+// 8253 interval timer at 40h-43h, clocked at a quarter of the CPU clock.
+// Counter 0 drives the BIOS tick and counter 2 the speaker; their counts
+// follow guest time.
+class Pit : public IoDevice {
+public:
+  static constexpr word kPort = 0x40;
+  static constexpr size_t kPorts = 4;
+  static constexpr uint64_t kCyclesPerClock = 4;
+
+  explicit Pit(PitState &s) : s_(s) {}
+
+  byte in(word port, uint64_t cycles) override;
+  void out(word port, byte value, uint64_t cycles) override;
+
+  // Count and output of counter |i| at guest time |cycles|
+  word count(int i, uint64_t cycles) const;
+  bool output(int i, uint64_t cycles) const;
+  // Frequency of the square wave of counter |i|, in Hz
+  dword frequency(int i) const;
+
+private:
+  PitState &s_;
+};  // Pit
+
+// 8255 peripheral interface at 61h-63h. Port B gates counter 2 of the timer
+// onto the speaker; reading it back also shows the refresh toggle and the
+// counter 2 output that guests time delays with.
+class Ppi : public IoDevice {
+public:
+  static constexpr word kPort = 0x61;
+  static constexpr size_t kPorts = 3;
+
+  Ppi(PpiState &s, const Pit &pit) : s_(s), pit_(pit) {}
+
+  byte in(word port, uint64_t cycles) override;
+  void out(word port, byte value, uint64_t cycles) override;
+
+  bool speaker_on() const { return (s_.port_b & 3) == 3; }
+  // Beeps at the speaker frequency if it is on, once per BIOS tick |tick|
+  // rather than once per poll of the clock.
+  void sound(dword tick);
+
+private:
+  PpiState &s_;
+  const Pit &pit_;
+};  // Ppi
+
+// 8042 keyboard controller at 60h and 64h. Keys reach the guest through DOS
+// rather than here; the controller only answers its commands.
+class KeyboardController : public IoDevice {
+public:
+  static constexpr word kDataPort = 0x60;
+  static constexpr word kStatusPort = 0x64;
+
+  explicit KeyboardController(KeyboardState &s) : s_(s) {}
+
+  byte in(word port, uint64_t cycles) override;
+  void out(word port, byte value, uint64_t cycles) override;
+
+private:
+  void reply(byte value) {
+    s_.output = value;
+    s_.full = true;
+  }
+
+  KeyboardState &s_;
+};  // KeyboardController
+
+// Read-only memory: keeps the bytes of guest memory in [|linear|, |linear| +
+// |size|) as they are when it is made, by undoing every write to them. Map
+// it there with Cpu::map_memory().
+class Rom : public MemoryDevice {
+public:
+  Rom(Memory &mem, dword linear, size_t size);
+
+  void on_write(dword linear, size_t size) override;
+
+private:
+  Memory &mem_;
+  dword start_;
+  std::vector<byte> contents_;
+};  // Rom
+
+#endif
@@ -0,0 +1,107 @@
+#include "display.h"
+#include <algorithm>
+#include <cstring>
+#ifdef TOY8086_UNIX
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#endif
+
+// ANSI colour numbers of the 8 VGA base colours
+static const int kAnsiColor[8] = {0, 4, 2, 6, 1, 5, 3, 7};
+
+TextDisplay::TextDisplay(const byte *vram, FILE *out)
+    : vram_(vram), out_(out) {
+  std::fill(shown_, shown_ + kCells, 0xffff);
+  for (size_t i = 0; i < kCells; ++i) dirty_[i / 64] |= uint64_t(1) << i % 64;
+  dirty_count_ = kCells;    // the first frame draws everything
+}
+
+TextDisplay::~TextDisplay() {
+  present(true);
+#ifdef TOY8086_UNIX
+  if (shared_) munmap(shared_, kSize);
+#endif
+}
+
+bool TextDisplay::share(const char *path) {
+#ifdef TOY8086_UNIX
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) return false;
+  void *p = MAP_FAILED;
+  if (ftruncate(fd, kSize) == 0) {
+    p = mmap(nullptr, kSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (p == MAP_FAILED) return false;
+  shared_ = static_cast<byte *>(p);
+  memcpy(shared_, vram_, kSize);
+  return true;
+#else
+  (void) path;
+  return false;
+#endif
+}
+
+void TextDisplay::on_write(dword linear, size_t size) {
+  const dword base = kBase;
+  dword begin = std::max(linear, base) - base;
+  dword end = std::min<dword>(linear + size, base + kSize) - base;
+  for (dword cell = begin / 2; cell < (end + 1) / 2; ++cell) {
+    uint64_t bit = uint64_t(1) << cell % 64;
+    if (!(dirty_[cell / 64] & bit)) {
+      dirty_[cell / 64] |= bit;
+      ++dirty_count_;
+    }
+  }
+  if (++writes_ % kWritesPerClockCheck == 0) present(false);
+}
+
+void TextDisplay::present(bool force) {
+  if (!dirty_count_) return;
+  auto now = std::chrono::steady_clock::now();
+  if (!force && now - last_frame_ < std::chrono::milliseconds(1000 / kMaxFps)) return;
+  last_frame_ = now;
+  render();
+}
+
+void TextDisplay::render() {
+  frame_.clear();
+  int attr = -1;
+  size_t next = kCells;     // cell the terminal cursor is at, if known
+  char buf[32];
+
+  for (size_t word_index = 0; word_index < sizeof(dirty_) / 8; ++word_index) {
+    for (uint64_t bits = dirty_[word_index]; bits; bits &= bits - 1) {
+      size_t cell = word_index * 64 + __builtin_ctzll(bits);
+      word v = vram_[cell * 2] | vram_[cell * 2 + 1] << 8;
+      if (shared_) memcpy(shared_ + cell * 2, vram_ + cell * 2, 2);
+      if (v == shown_[cell]) continue;
+      shown_[cell] = v;
+
+      if (cell != next) {
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
+                 int(cell / kCols) + 1, int(cell % kCols) + 1);
+        frame_ += buf;
+      }
+      if ((v >> 8) != attr) {
+        attr = v >> 8;
+        snprintf(buf, sizeof(buf), "\x1b[0;%d;%d%sm",
+                 (attr & 8 ? 90 : 30) + kAnsiColor[attr & 7],
+                 40 + kAnsiColor[(attr >> 4) & 7], attr & 0x80 ? ";5" : "");
+        frame_ += buf;
+      }
+      byte c = v & 0xff;
+      frame_ += c >= 0x20 && c < 0x7f ? char(c) : c ? '?' : ' ';
+      next = (cell + 1) % kCols ? cell + 1 : kCells;   // no relying on wrap
+    }
+    dirty_[word_index] = 0;
+  }
+  dirty_count_ = 0;
+
+  if (out_ && !frame_.empty()) {
+    snprintf(buf, sizeof(buf), "\x1b[0m\x1b[%d;1H", kRows + 1);
+    frame_ += buf;    // park the cursor below the screen
+    fwrite(frame_.data(), 1, frame_.size(), out_);
+    fflush(out_);
+  }
+}
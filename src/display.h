@@ -0,0 +1,52 @@
+#ifndef _DISPLAY_H_
+#define _DISPLAY_H_
+
+#include "block_cache.h"
+#include <chrono>
+#include <string>
+
+// The 80x25 colour text mode at B800:0000, without a window. Guest writes
+// into it mark cells dirty as they happen; present() sends just the cells
+// that changed to a terminal as ANSI escape sequences, at most kMaxFps
+// times per second. The text buffer can also be mirrored into a shared
+// file for an external viewer.
+class TextDisplay : public WriteWatcher {
+public:
+  static constexpr dword kBase = 0xb8000;
+  static constexpr int kCols = 80;
+  static constexpr int kRows = 25;
+  static constexpr size_t kCells = kCols * kRows;
+  static constexpr size_t kSize = kCells * 2;    // character, attribute
+  static constexpr int kMaxFps = 30;
+  // Writes between looks at the host clock for a frame being due
+  static constexpr uint32_t kWritesPerClockCheck = 1024;
+
+  // Renders |vram| to |out| if it is not null.
+  TextDisplay(const byte *vram, FILE *out);
+  ~TextDisplay();
+
+  // Mirrors the text buffer into |path|, kSize bytes laid out as in guest
+  // memory. UNIX only.
+  bool share(const char *path);
+
+  void on_write(dword linear, size_t size) override;
+
+  // Renders the dirty cells, unless the last frame is too recent and
+  // |force| is not set.
+  void present(bool force);
+
+private:
+  void render();
+
+  const byte *vram_;
+  FILE *out_;
+  byte *shared_ = nullptr;
+  uint64_t dirty_[(kCells + 63) / 64] = {};
+  size_t dirty_count_ = 0;
+  uint32_t writes_ = 0;
+  word shown_[kCells];        // what the terminal shows; 0xffff: unknown
+  std::string frame_;
+  std::chrono::steady_clock::time_point last_frame_;
+};  // TextDisplay
+
+#endif
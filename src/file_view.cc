@@ -0,0 +1,44 @@
+#include "file_view.h"
+#ifdef TOY8086_UNIX
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#endif
+
+FileView::FileView(const char *path) {
+#ifdef TOY8086_UNIX
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    size_ = st.st_size;
+    ok_ = true;
+    if (size_) {
+      void *p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        data_ = static_cast<const byte *>(p);
+        mapped_ = true;
+      } else {
+        ok_ = false;
+      }
+    }
+  }
+  close(fd);
+#else
+  FILE *f = fopen(path, "rb");
+  if (!f) return;
+  fseek(f, 0, SEEK_END);
+  copy_.resize(ftell(f));
+  rewind(f);
+  ok_ = fread(copy_.data(), 1, copy_.size(), f) == copy_.size();
+  fclose(f);
+  data_ = copy_.data();
+  size_ = copy_.size();
+#endif
+}
+
+FileView::~FileView() {
+#ifdef TOY8086_UNIX
+  if (mapped_) munmap(const_cast<byte *>(data_), size_);
+#endif
+}
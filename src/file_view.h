@@ -0,0 +1,25 @@
+#ifndef _FILE_VIEW_H_
+#define _FILE_VIEW_H_
+
+#include "helper.h"
+#include <vector>
+
+// Read-only contents of a file: mapped on UNIX, read into memory elsewhere.
+class FileView {
+public:
+  explicit FileView(const char *path);
+  ~FileView();
+
+  bool ok() const { return ok_; }
+  const byte *data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  const byte *data_ = nullptr;
+  size_t size_ = 0;
+  bool ok_ = false;
+  bool mapped_ = false;
+  std::vector<byte> copy_;
+};  // FileView
+
+#endif
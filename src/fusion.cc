@@ -0,0 +1,117 @@
+#include "fusion.h"
+
+const byte kFusionLength[kFusionCount] = {
+  2, 2, 2, 2, 2, 3, 2, 3, 2, 2, 3,
+};
+
+const char *const kFusionNames[kFusionCount] = {
+  "cmp+jcc", "test+jcc", "inc+jcc", "dec+jcc", "step+loop",
+  "step+step+loop", "push+call", "push+push+call", "push bp+mov bp",
+  "pop+ret", "pop+pop+ret",
+};
+
+namespace {
+
+byte reg_field(const Instr &in) { return (in.modrm >> 3) & 7; }
+
+// Fused instructions take no prefixes but segment overrides, which are
+// already applied.
+bool plain(const Instr &in) { return !(in.prefix & ~Instr::kPfxSeg); }
+
+bool is_jcc(const Instr &in) {
+  return in.opcode >= 0x70 && in.opcode <= 0x7f;
+}
+
+bool is_cmp(const Instr &in) {
+  if (in.opcode >= 0x38 && in.opcode <= 0x3d) return true;
+  return in.opcode >= 0x80 && in.opcode <= 0x83 && reg_field(in) == 7;
+}
+
+bool is_test(const Instr &in) {
+  switch (in.opcode) {
+    case 0xa8: case 0xa9: return true;
+    case 0xf6: case 0xf7: return reg_field(in) == 0;
+    default: return false;
+  }
+}
+
+// inc, dec r16, or add, sub r16 with an immediate
+bool is_step(const Instr &in) {
+  if (in.opcode >= 0x40 && in.opcode <= 0x4f) return true;
+  return (in.opcode == 0x81 || in.opcode == 0x83) &&
+         in.ea == Instr::kEaReg && (reg_field(in) == 0 || reg_field(in) == 5);
+}
+
+bool is_push(const Instr &in) {
+  return in.opcode >= 0x50 && in.opcode <= 0x57;
+}
+
+bool is_pop(const Instr &in) {
+  return in.opcode >= 0x58 && in.opcode <= 0x5f;
+}
+
+bool is_ret(const Instr &in) { return in.opcode == 0xc3 || in.opcode == 0xc2; }
+
+bool is_mov_bp_sp(const Instr &in) {
+  return (in.opcode == 0x8b && in.modrm == 0xec) ||
+         (in.opcode == 0x89 && in.modrm == 0xe5);
+}
+
+}  // namespace
+
+bool match_fusion(const Instr *in, size_t left, Fusion &kind) {
+  for (size_t i = 0; i < left && i < 3; ++i) {
+    if (!plain(in[i])) {
+      left = i;
+      break;
+    }
+  }
+  if (left < 2) return false;
+
+  const Instr &a = in[0], &b = in[1];
+  if (is_jcc(b)) {
+    if (is_cmp(a)) kind = kFuseCmpJcc;
+    else if (is_test(a)) kind = kFuseTestJcc;
+    else if (a.opcode >= 0x40 && a.opcode <= 0x47) kind = kFuseIncJcc;
+    else if (a.opcode >= 0x48 && a.opcode <= 0x4f) kind = kFuseDecJcc;
+    else return false;
+    return true;
+  }
+  if (is_step(a)) {
+    if (b.opcode == 0xe2) {
+      kind = kFuseStepLoop;
+      return true;
+    }
+    if (left > 2 && is_step(b) && in[2].opcode == 0xe2) {
+      kind = kFuseStep2Loop;
+      return true;
+    }
+    return false;
+  }
+  if (is_push(a)) {
+    if (b.opcode == 0xe8) {
+      kind = kFusePushCall;
+      return true;
+    }
+    if (left > 2 && is_push(b) && in[2].opcode == 0xe8) {
+      kind = kFusePush2Call;
+      return true;
+    }
+    if (a.opcode == 0x55 && is_mov_bp_sp(b)) {
+      kind = kFuseEnter;
+      return true;
+    }
+    return false;
+  }
+  if (is_pop(a)) {
+    if (is_ret(b)) {
+      kind = kFusePopRet;
+      return true;
+    }
+    if (left > 2 && is_pop(b) && is_ret(in[2])) {
+      kind = kFusePop2Ret;
+      return true;
+    }
+  }
+  return false;
+}
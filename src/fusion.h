@@ -0,0 +1,42 @@
+#ifndef _FUSION_H_
+#define _FUSION_H_
+
+#include "decoder.h"
+
+// Fused groups retire several instructions at once, which per-instruction
+// profiles and cycle counts can't follow.
+#if !defined(TOY8086_PROFILE) && !defined(TOY8086_CYCLES)
+#  define TOY8086_FUSION
+#endif
+
+// Superinstructions: short runs of instructions that guest code is full of,
+// run by the interpreter as one handler each. A fused group goes through
+// one dispatch instead of several, and computes only the flags that can be
+// read after it: a compare and its branch decide straight from the
+// operands, and of pointer steps before a LOOP only the last sets flags.
+enum Fusion : byte {
+  kFuseCmpJcc,        // cmp ...; jcc
+  kFuseTestJcc,       // test ...; jcc
+  kFuseIncJcc,        // inc r16; jcc
+  kFuseDecJcc,        // dec r16; jcc
+  kFuseStepLoop,      // inc / dec / add / sub r16; loop
+  kFuseStep2Loop,     // the same with two steps
+  kFusePushCall,      // push r16; call near
+  kFusePush2Call,     // push r16; push r16; call near
+  kFuseEnter,         // push bp; mov bp, sp
+  kFusePopRet,        // pop r16; ret near
+  kFusePop2Ret,       // pop r16; pop r16; ret near
+
+  kFusionCount
+};
+
+// Instructions in a group of each kind.
+extern const byte kFusionLength[kFusionCount];
+// Names for statistics.
+extern const char *const kFusionNames[kFusionCount];
+
+// Finds the group starting at |in|, which is followed by |left| - 1 more
+// instructions of the same block. Returns false if there is none.
+bool match_fusion(const Instr *in, size_t left, Fusion &kind);
+
+#endif
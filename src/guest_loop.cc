@@ -0,0 +1,111 @@
+#include "guest_loop.h"
+#include <cerrno>
+#ifdef __linux__
+#  include <sys/epoll.h>
+#endif
+
+#ifdef __linux__
+GuestLoop::GuestLoop(Done done) : done_(done),
+                                  epoll_(epoll_create1(EPOLL_CLOEXEC)) {}
+GuestLoop::~GuestLoop() { if (epoll_ >= 0) close(epoll_); }
+#else
+GuestLoop::GuestLoop(Done done) : done_(done) {}
+GuestLoop::~GuestLoop() {}
+#endif
+
+Cpu &GuestLoop::add(std::unique_ptr<Cpu> cpu) {
+  cpu->yield_for_input_ = true;
+  ready_.push_back(std::move(cpu));
+  return *ready_.back();
+}
+
+bool GuestLoop::run_once(int timeout_ms) {
+  if (!waiting_.empty()) wait(ready_.empty() ? timeout_ms : 0);
+  for (size_t n = ready_.size(); n; --n) {
+    std::unique_ptr<Cpu> cpu = std::move(ready_.front());
+    ready_.pop_front();
+    Cpu::ExitStatus st = cpu->run_for(kSlice);
+    if (st == Cpu::kExitBudget) {
+      ready_.push_back(std::move(cpu));
+    } else if (st == Cpu::kExitInputWait && !cpu->stop_for_input_) {
+      park(std::move(cpu));
+    } else if (done_) {
+      done_(*cpu, st);
+    }
+  }
+  return size() != 0;
+}
+
+// Sources that can't be waited for, like regular files, are always ready
+// anyway; their guests go straight back to ready_. Guests whose source
+// fails otherwise are dropped rather than left to spin.
+void GuestLoop::park(std::unique_ptr<Cpu> cpu) {
+  Cpu *key = cpu.get();
+#ifdef __linux__
+  int fd = cpu->in_.fd();
+  auto it = readers_.find(fd);
+  if (it == readers_.end()) {
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      if (errno == EPERM) {
+        ready_.push_back(std::move(cpu));
+      } else if (done_) {
+        done_(*cpu, Cpu::kExitInputWait);
+      }
+      return;
+    }
+    it = readers_.emplace(fd, std::vector<Cpu *>()).first;
+  }
+  it->second.push_back(key);
+#elif defined(TOY8086_UNIX)
+  fds_.push_back(pollfd{cpu->in_.fd(), POLLIN, 0});
+  polled_.push_back(key);
+#else
+  ready_.push_back(std::move(cpu));
+  return;
+#endif
+  waiting_[key] = std::move(cpu);
+}
+
+// Moves the guests whose input became readable to the back of ready_.
+void GuestLoop::wait(int timeout_ms) {
+#ifdef __linux__
+  epoll_event events[64];
+  int n;
+  do {
+    n = epoll_wait(epoll_, events, 64, timeout_ms);
+  } while (n < 0 && errno == EINTR);
+  for (int i = 0; i < n; ++i) {
+    int fd = events[i].data.fd;
+    epoll_ctl(epoll_, EPOLL_CTL_DEL, fd, nullptr);
+    auto it = readers_.find(fd);
+    for (Cpu *cpu : it->second) resume(cpu);
+    readers_.erase(it);
+  }
+#elif defined(TOY8086_UNIX)
+  int n;
+  do {
+    n = poll(fds_.data(), fds_.size(), timeout_ms);
+  } while (n < 0 && errno == EINTR);
+  for (size_t i = 0; n > 0 && i < fds_.size();) {
+    if (!fds_[i].revents) {
+      ++i;
+      continue;
+    }
+    resume(polled_[i]);
+    fds_[i] = fds_.back();
+    fds_.pop_back();
+    polled_[i] = polled_.back();
+    polled_.pop_back();
+    --n;
+  }
+#endif
+}
+
+void GuestLoop::resume(Cpu *cpu) {
+  auto it = waiting_.find(cpu);
+  ready_.push_back(std::move(it->second));
+  waiting_.erase(it);
+}
@@ -0,0 +1,65 @@
+#ifndef _GUEST_LOOP_H_
+#define _GUEST_LOOP_H_
+
+#include "cpu.h"
+#include <deque>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#if defined(TOY8086_UNIX) && !defined(__linux__)
+#  include <poll.h>
+#endif
+
+// Runs many guests on the calling thread. A guest runs until it asks for
+// console input that has not arrived (see Cpu::yield_for_input_), then waits
+// along with every other waiting guest for its input source to become
+// readable: in one epoll set on Linux, in one poll() elsewhere on UNIX.
+// Guests that keep running take turns in slices of kSlice instructions.
+class GuestLoop {
+public:
+  static constexpr uint64_t kSlice = 1 << 20;
+
+  // Called with how a guest stopped right before the loop drops it: other
+  // than to wait for input, or kExitInputWait if its input source can't be
+  // waited for.
+  typedef std::function<void(Cpu &, Cpu::ExitStatus)> Done;
+
+  explicit GuestLoop(Done done = nullptr);
+  ~GuestLoop();
+
+  GuestLoop(const GuestLoop &) = delete;
+  GuestLoop &operator=(const GuestLoop &) = delete;
+
+  // Takes over |cpu|, to run from the next run_once() on.
+  Cpu &add(std::unique_ptr<Cpu> cpu);
+
+  // Picks up the guests whose input arrived, waiting up to |timeout_ms|
+  // (-1 for ever) for some if no guest is ready, then gives every ready
+  // guest a slice. Returns false once there are no guests left.
+  bool run_once(int timeout_ms = -1);
+  void run() { while (run_once()) {} }
+
+  size_t size() const { return ready_.size() + waiting_.size(); }
+  size_t waiting() const { return waiting_.size(); }
+
+private:
+  void park(std::unique_ptr<Cpu> cpu);
+  void wait(int timeout_ms);
+  void resume(Cpu *cpu);
+
+  Done done_;
+  std::deque<std::unique_ptr<Cpu>> ready_;
+  std::unordered_map<Cpu *, std::unique_ptr<Cpu>> waiting_;
+#ifdef __linux__
+  int epoll_;                 // the input of waiting_
+  // Input fd -> the guests waiting for it. A file is in an epoll set at
+  // most once, however many guests read it.
+  std::unordered_map<int, std::vector<Cpu *>> readers_;
+#elif defined(TOY8086_UNIX)
+  std::vector<pollfd> fds_;   // the input of waiting_, and whose it is
+  std::vector<Cpu *> polled_;
+#endif
+};  // GuestLoop
+
+#endif
@@ -0,0 +1,38 @@
+#include "io_bus.h"
+
+namespace {
+
+class OpenBus : public IoDevice {
+public:
+  byte in(word, uint64_t) override { return 0xff; }
+  void out(word, byte, uint64_t) override {}
+};
+
+}  // namespace
+
+// Shared by every bus for the pages with nothing attached
+IoBus::Page *IoBus::open_page() {
+  static OpenBus open_bus;
+  static Page *page = [] {
+    Page *p = new Page;
+    for (IoDevice *&port : p->ports) port = &open_bus;
+    return p;
+  }();
+  return page;
+}
+
+IoBus::IoBus() {
+  for (Page *&page : pages_) page = open_page();
+}
+
+void IoBus::attach(word first, size_t count, IoDevice *device) {
+  if (!device) device = open_page()->ports[0];
+  for (size_t port = first; port < first + count && port < 0x10000; ++port) {
+    Page *&page = pages_[port >> kPageBits];
+    if (page == open_page()) {
+      own_.emplace_back(new Page(*page));
+      page = own_.back().get();
+    }
+    page->ports[port & (kPageSize - 1)] = device;
+  }
+}
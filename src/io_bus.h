@@ -0,0 +1,62 @@
+#ifndef _IO_BUS_H_
+#define _IO_BUS_H_
+
+#include "helper.h"
+#include <memory>
+#include <vector>
+
+// Something answering IN and OUT on the ports it is attached at. |cycles| is
+// the guest time of the access; see Cpu::cycles(). Word accesses arrive as
+// two byte accesses, to the port and the one after it, as on the 8-bit bus
+// of the PC.
+class IoDevice {
+public:
+  virtual ~IoDevice() {}
+  virtual byte in(word port, uint64_t cycles) = 0;
+  virtual void out(word port, byte value, uint64_t cycles) = 0;
+};  // IoDevice
+
+// The 64K I/O ports, each leading straight to the device attached there, so
+// that an access costs a table lookup and one indirect call. The table comes
+// in pages of 256 ports, and only pages with something attached get their
+// own copy: a guest's devices sit in a page or two. Ports with nothing
+// attached read as FFh and ignore writes.
+class IoBus {
+public:
+  static constexpr size_t kPageBits = 8;
+
+  IoBus();
+
+  IoBus(const IoBus &) = delete;
+  IoBus &operator=(const IoBus &) = delete;
+
+  // Routes ports [|first|, |first| + |count|) to |device|, which is not
+  // owned; null detaches them.
+  void attach(word first, size_t count, IoDevice *device);
+
+  IoDevice *device(word port) const {
+    return pages_[port >> kPageBits]->ports[port & (kPageSize - 1)];
+  }
+
+  byte in(word port, uint64_t cycles) {
+    return device(port)->in(port, cycles);
+  }
+  void out(word port, byte value, uint64_t cycles) {
+    device(port)->out(port, value, cycles);
+  }
+
+private:
+  static constexpr size_t kPageSize = 1 << kPageBits;
+  static constexpr size_t kPages = 0x10000 >> kPageBits;
+
+  struct Page {
+    IoDevice *ports[kPageSize];
+  };
+
+  static Page *open_page();   // never written
+
+  Page *pages_[kPages];
+  std::vector<std::unique_ptr<Page>> own_;    // those not open_page()
+};  // IoBus
+
+#endif
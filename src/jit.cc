@@ -0,0 +1,704 @@
+#include "jit.h"
+#include "cpu.h"
+#include <algorithm>
+#include <cstddef>
+#ifdef TOY8086_JIT
+#  include <sys/mman.h>
+#endif
+
+#ifdef TOY8086_JIT
+namespace {
+
+enum HostReg {
+  kRax, kRcx, kRdx, kRbx, kRsp, kRbp, kRsi, kRdi,
+  kR8, kR9, kR10, kR11,
+};
+
+// A host ModRM operand. Bases are never RSP/R12; [base + index] is never
+// based on RBP/R13 without a displacement.
+struct Operand {
+  enum Kind {
+    kReg,           // base
+    kBaseDisp,      // [base + disp]
+    kBaseIndex,     // [base + index << scale + disp]
+    kIndexDisp,     // [index << scale + disp32]
+  };
+
+  Kind kind;
+  int base;
+  int index;
+  int scale;
+  int32_t disp;
+};
+
+Operand host_reg(int r) { return {Operand::kReg, r, 0, 0, 0}; }
+
+// Guest registers live in the Context pointed to by RDI.
+Operand ctx_at(int offset) { return {Operand::kBaseDisp, kRdi, 0, 0, offset}; }
+
+// The JitFrame is pointed to by RSI.
+Operand frame_at(int offset) { return {Operand::kBaseDisp, kRsi, 0, 0, offset}; }
+
+// Guest memory: R11 holds the memory base, R10 the linear address.
+Operand guest_mem() { return {Operand::kBaseIndex, kR11, kR10, 0, 0}; }
+
+int reg16(int r) { return offsetof(Context, reg_all) + 2 * r; }
+int reg8(int r) { return offsetof(Context, reg_all) + 2 * (r & 3) + (r >> 2); }
+int seg_reg(int s) {
+  return offsetof(Context, seg) + offsetof(Segment, reg_seg) + 2 * s;
+}
+
+constexpr int kRegCx = 1;
+constexpr int kRegSp = 4;
+
+class Emitter {
+public:
+  std::vector<byte> buf;
+
+  size_t pos() const { return buf.size(); }
+  void put(byte b) { buf.push_back(b); }
+  void put(std::initializer_list<byte> bytes) {
+    buf.insert(buf.end(), bytes);
+  }
+  void put16(word v) { put(v & 0xff); put(v >> 8); }
+  void put32(uint32_t v) { put16(v & 0xffff); put16(v >> 16); }
+  void put64(uint64_t v) { put32(v & 0xffffffff); put32(v >> 32); }
+
+  // [66] [REX] opcode ModRM [SIB] [disp] for an operand of |size| bytes.
+  void op(int size, std::initializer_list<byte> opcode, int r,
+          const Operand &m) {
+    if (size == 2) put(0x66);
+    byte rex = 0x40;
+    if (size == 8) rex |= 8;
+    if (r & 8) rex |= 4;
+    if (m.kind >= Operand::kBaseIndex && (m.index & 8)) rex |= 2;
+    if (m.kind != Operand::kIndexDisp && (m.base & 8)) rex |= 1;
+    if (rex != 0x40) put(rex);
+    put(opcode);
+    modrm(r & 7, m);
+  }
+
+  size_t jcc32(int cc) {
+    put({0x0f, byte(0x80 | cc)});
+    put32(0);
+    return pos() - 4;
+  }
+
+  size_t jmp32() {
+    put(0xe9);
+    put32(0);
+    return pos() - 4;
+  }
+
+  size_t jcc8(byte opcode) {
+    put({opcode, 0});
+    return pos() - 1;
+  }
+
+  // Points the rel32 at |at| to the current position.
+  void bind32(size_t at) {
+    uint32_t rel = pos() - (at + 4);
+    for (int i = 0; i < 4; ++i) buf[at + i] = rel >> (8 * i);
+  }
+
+  void bind8(size_t at) {
+    buf[at] = pos() - (at + 1);
+  }
+
+private:
+  void modrm(int r, const Operand &m) {
+    bool disp8 = m.disp == (int8_t) m.disp;
+    switch (m.kind) {
+      case Operand::kReg:
+        put(0xc0 | r << 3 | (m.base & 7));
+        break;
+      case Operand::kBaseDisp:
+        put((disp8 ? 0x40 : 0x80) | r << 3 | (m.base & 7));
+        if (disp8) put(m.disp);
+        else put32(m.disp);
+        break;
+      case Operand::kBaseIndex: {
+        byte sib = m.scale << 6 | (m.index & 7) << 3 | (m.base & 7);
+        if (m.disp == 0) {
+          put({byte(0x04 | r << 3), sib});
+        } else {
+          put({byte((disp8 ? 0x44 : 0x84) | r << 3), sib});
+          if (disp8) put(m.disp);
+          else put32(m.disp);
+        }
+        break;
+      }
+      case Operand::kIndexDisp:
+        put({byte(0x04 | r << 3), byte(m.scale << 6 | (m.index & 7) << 3 | 5)});
+        put32(m.disp);
+        break;
+    }
+  }
+};  // Emitter
+
+enum FlagUse {
+  kFlagsNone,
+  kFlagsWrite,        // writes all six
+  kFlagsRead,
+  kFlagsReadWrite,
+  kFlagsPartial,      // inc / dec keep CF
+};
+
+int alu_op(const Instr &in) {
+  return in.opcode < 0x40 ? in.opcode >> 3 : (in.modrm >> 3) & 7;
+}
+
+bool is_alu(byte b) {
+  return (b < 0x40 && (b & 7) < 6) || (b >= 0x80 && b <= 0x83);
+}
+
+bool translatable(const Instr &in) {
+  byte b = in.opcode;
+  if (is_alu(b)) return true;
+  switch (b) {
+    case 0x8d:
+      return in.ea != Instr::kEaReg;
+    case 0x54: case 0x5c:   // push sp / pop sp
+      return false;
+    case 0x88: case 0x89: case 0x8a: case 0x8b:
+    case 0xc6: case 0xc7:
+    case 0xa0: case 0xa1: case 0xa2: case 0xa3:
+    case 0x0e: case 0x1e: case 0x1f:
+    case 0x90: case 0x91: case 0x92: case 0x93:
+    case 0x94: case 0x95: case 0x96: case 0x97:
+    case 0xe0: case 0xe1: case 0xe2:
+    case 0xe8: case 0xe9: case 0xeb: case 0xc3:
+      return true;
+  }
+  return (b >= 0x40 && b <= 0x5f) ||    // inc, dec, push, pop
+         (b >= 0x70 && b <= 0x7f) ||    // jcc
+         (b >= 0xb0 && b <= 0xbf);      // mov reg, imm
+}
+
+// Control transfers end the translation with their own exits.
+bool is_transfer(byte b) {
+  return (b >= 0x70 && b <= 0x7f) || (b >= 0xe0 && b <= 0xe2) ||
+         b == 0xe8 || b == 0xe9 || b == 0xeb || b == 0xc3;
+}
+
+FlagUse flag_use(const Instr &in) {
+  byte b = in.opcode;
+  if (is_alu(b)) {
+    int op = alu_op(in);
+    return op == 2 || op == 3 ? kFlagsReadWrite : kFlagsWrite;   // adc, sbb
+  }
+  if (b >= 0x40 && b <= 0x4f) return kFlagsPartial;
+  if ((b >= 0x70 && b <= 0x7f) || b == 0xe0 || b == 0xe1) return kFlagsRead;
+  return kFlagsNone;
+}
+
+class Translator {
+public:
+  Translator(JitBlock &jb, bool trap_reads)
+    : jb_(jb), trap_reads_(trap_reads) {}
+
+  Emitter e;
+  size_t chain_entry;
+  // A chainable exit; positions of its jumps and of its limit check
+  struct Site {
+    JitExit *exit;
+    size_t jump, check, checked_jump;
+  };
+  std::vector<Site> sites;
+
+  void translate(const Block &blk) {
+    size_t n = 0;
+    while (n < blk.instrs.size() && translatable(blk.instrs[n])) ++n;
+
+    // Guest flags are live at the end of the block; see which instructions
+    // need them preserved and whether the entry must load them.
+    std::vector<bool> live_before(n), live_after(n);
+    bool live = true;
+    for (size_t i = n; i-- > 0;) {
+      live_after[i] = live;
+      switch (flag_use(blk.instrs[i])) {
+        case kFlagsWrite:     live = false; break;
+        case kFlagsRead:
+        case kFlagsReadWrite: live = true;  break;
+        default:                            break;
+      }
+      live_before[i] = live;
+    }
+
+    if (live_before[0]) e.put({0x52, 0x9d});   // push rdx; popfq
+    chain_entry = e.pos();
+
+    word ip = jb_.ip;
+    for (size_t i = 0; i < n; ++i) {
+      const Instr &in = blk.instrs[i];
+      ip_ = ip;
+      index_ = i;
+      live_ = live_before[i];
+      ip += in.length;
+      emit(in, ip, live_after[i]);
+    }
+
+    if (!is_transfer(blk.instrs[n - 1].opcode)) {
+      // Ran out of translatable instructions, or the block was cut short.
+      emit_exit(ip, n, n == blk.instrs.size());
+    }
+
+    for (auto &bail : bails_) {
+      e.bind32(bail.jump);
+      if (bail.flags_saved) e.put({0x04, 0x7f, 0x9e});   // add al, 7f; sahf
+      emit_exit(bail.ip, bail.retired, false);
+    }
+  }
+
+private:
+  struct Bail {
+    size_t jump;
+    word ip;
+    int retired;
+    bool flags_saved;
+  };
+
+  JitBlock &jb_;
+  bool trap_reads_;   // leave before reading device pages too
+  std::vector<Bail> bails_;
+  word ip_;           // of the instruction being translated
+  size_t index_;
+  bool live_;         // guest flags live before it
+
+  // Sets IP, counts |retired| instructions and leaves translated code,
+  // through a patchable jump if the target is fixed.
+  void emit_exit(word ip, int retired, bool chainable, bool set_ip = true) {
+    if (set_ip) {
+      e.op(2, {0xc7}, 0, ctx_at(offsetof(Context, ip)));
+      e.put16(ip);
+    }
+    Operand counter = frame_at(offsetof(JitFrame, retired));
+    e.op(8, {0x8b}, kRdx, counter);
+    e.op(8, {0x8d}, kRdx, {Operand::kBaseDisp, kRdx, 0, 0, retired});
+    e.op(8, {0x89}, kRdx, counter);
+
+    jb_.exits.push_back(JitExit{&jb_, nullptr, nullptr, nullptr, nullptr});
+    JitExit *exit = &jb_.exits.back();
+    Site site = {exit, 0, 0, 0};
+    if (chainable) site.jump = e.jmp32();   // falls through unless chained
+
+    size_t ret = e.pos();
+    e.put({0x48, 0xba});    // mov rdx, exit
+    e.put64(reinterpret_cast<uint64_t>(exit));
+    e.put({0x9c, 0x58, 0xc3});    // pushfq; pop rax; ret
+    if (!chainable) return;
+
+    // Where the jump goes instead while chains are limited: returns once
+    // the counter reaches the chain limit. Tested without touching the host
+    // flags: RCX = limit - counter - 1, whose top byte is zero unless it
+    // went negative.
+    site.check = e.pos();
+    e.op(8, {0x8b}, kRcx, frame_at(offsetof(JitFrame, chain_limit)));
+    e.op(8, {0xf7}, 2, host_reg(kRdx));   // not rdx
+    e.op(8, {0x8d}, kRcx, {Operand::kBaseIndex, kRcx, kRdx, 0, 0});
+    e.put({0x48, 0x0f, 0xc9});            // bswap rcx
+    e.put({0x0f, 0xb6, 0xc9});            // movzx ecx, cl
+    e.put({0xe3, 0x02});                  // jrcxz +2
+    e.put({0xeb, byte(ret - (e.pos() + 2))});   // jmp ret
+    site.checked_jump = e.jmp32();
+    sites.push_back(site);
+  }
+
+  // R10 = 16-bit effective address offset.
+  void emit_offset(const Instr &in) {
+    static const int kBase[] = { 3, 3, 5, 5, 6, 7, 5, 3 };
+    static const int kIndex[] = { 6, 7, 6, 7, -1, -1, -1, -1 };
+    int32_t disp = (int16_t) in.disp;
+
+    if (in.ea == Instr::kEaDisp) {
+      e.put({0x41, 0xba});    // mov r10d, imm32
+      e.put32(in.disp);
+      return;
+    }
+
+    e.op(4, {0x0f, 0xb7}, kR10, ctx_at(reg16(kBase[in.ea])));
+    if (kIndex[in.ea] >= 0) {
+      e.op(4, {0x0f, 0xb7}, kR11, ctx_at(reg16(kIndex[in.ea])));
+      e.op(4, {0x8d}, kR10, {Operand::kBaseIndex, kR10, kR11, 0, disp});
+    } else if (disp) {
+      e.op(4, {0x8d}, kR10, {Operand::kBaseDisp, kR10, 0, 0, disp});
+    } else {
+      return;
+    }
+    e.op(4, {0x0f, 0xb7}, kR10, host_reg(kR10));    // movzx r10d, r10w
+  }
+
+  // R10 = linear address of segment |seg| : R10, R11 = memory base. Before a
+  // write of |size| bytes, leaves for the interpreter if the page is tagged
+  // (it holds cached code, say) or if a word would straddle two pages, and
+  // marks the page dirty otherwise. While reads are trapped, leaves before
+  // reads starting in device pages too.
+  void emit_linear(int seg, int size, bool write) {
+    e.op(4, {0x0f, 0xb7}, kR11, ctx_at(seg_reg(seg)));
+    e.op(4, {0x8d}, kR11, {Operand::kIndexDisp, 0, kR11, 3, 0});
+    e.op(4, {0x8d}, kR10, {Operand::kBaseIndex, kR10, kR11, 1, 0});
+
+    if (live_) e.put({0x9f, 0x0f, 0x90, 0xc0});    // lahf; seto al
+    e.op(4, {0x81}, 4, host_reg(kR10));     // and r10d, 0xfffff
+    e.put32(0xfffff);
+    if (write || trap_reads_) {
+      if (write && size > 1) {
+        e.op(1, {0x80}, 7, host_reg(kR10));   // cmp r10b, 0xff
+        e.put(0xff);
+        bails_.push_back(Bail{e.jcc32(0x4), ip_, int(index_), live_});
+      }
+      e.op(4, {0x89}, kR10, host_reg(kR9));
+      e.op(4, {0xc1}, 5, host_reg(kR9));    // shr r9d, kPageBits
+      e.put(Memory::kPageBits);
+      e.op(8, {0x8b}, kR8, frame_at(offsetof(JitFrame, pages)));
+      Operand tags = {Operand::kBaseIndex, kR8, kR9, 0, 0};
+      if (write) {
+        e.op(1, {0x80}, 7, tags);           // cmp byte [tags], 0
+        e.put(0);
+      } else {
+        e.op(1, {0xf6}, 0, tags);           // test byte [tags], kPageDevice
+        e.put(BlockCache::kPageDevice);
+      }
+      bails_.push_back(Bail{e.jcc32(0x5), ip_, int(index_), live_});
+      if (write) {
+        e.op(1, {0xc6}, 0, {Operand::kBaseIndex, kR8, kR9, 0,   // dirty
+                            int32_t(Memory::kPages)});
+        e.put(1);
+      }
+    }
+    if (live_) e.put({0x04, 0x7f, 0x9e});    // add al, 7f; sahf
+    e.op(8, {0x8b}, kR11, frame_at(offsetof(JitFrame, mem)));
+  }
+
+  Operand rm_operand(const Instr &in, int size, bool write) {
+    if (in.ea == Instr::kEaReg) {
+      int rm = in.modrm & 7;
+      return ctx_at(size == 1 ? reg8(rm) : reg16(rm));
+    }
+    emit_offset(in);
+    emit_linear(in.seg, size, write);
+    return guest_mem();
+  }
+
+  Operand reg_operand(const Instr &in, int size) {
+    int r = (in.modrm >> 3) & 7;
+    return ctx_at(size == 1 ? reg8(r) : reg16(r));
+  }
+
+  void emit_push(const Operand *value, word imm) {
+    Operand sp = ctx_at(reg16(kRegSp));
+    e.op(4, {0x0f, 0xb7}, kR10, sp);
+    e.op(4, {0x8d}, kR10, {Operand::kBaseDisp, kR10, 0, 0, -2});
+    e.op(4, {0x0f, 0xb7}, kR10, host_reg(kR10));
+    e.op(4, {0x89}, kR10, host_reg(kRdx));
+    emit_linear(Segment::kSegSs, 2, true);
+    if (value) {
+      e.op(4, {0x0f, 0xb7}, kRax, *value);
+      e.op(2, {0x89}, kRax, guest_mem());
+    } else {
+      e.op(2, {0xc7}, 0, guest_mem());
+      e.put16(imm);
+    }
+    e.op(2, {0x89}, kRdx, sp);
+  }
+
+  void emit_pop(const Operand &dst) {
+    Operand sp = ctx_at(reg16(kRegSp));
+    e.op(4, {0x0f, 0xb7}, kR10, sp);
+    e.op(4, {0x89}, kR10, host_reg(kRdx));
+    emit_linear(Segment::kSegSs, 2, false);
+    e.op(4, {0x0f, 0xb7}, kRax, guest_mem());
+    e.op(2, {0x89}, kRax, dst);
+    e.op(4, {0x8d}, kRdx, {Operand::kBaseDisp, kRdx, 0, 0, 2});
+    e.op(2, {0x89}, kRdx, sp);
+  }
+
+  void emit(const Instr &in, word next_ip, bool live_after) {
+    byte b = in.opcode;
+    int retired = index_ + 1;
+
+    if (is_alu(b)) {
+      int op = alu_op(in);
+      int size = (b & 1) ? 2 : 1;
+      byte w = size - 1;
+      byte form = b < 0x40 ? b & 7 : 0;
+      if (b < 0x40 && form < 2) {           // Eb Gb, Ev Gv
+        Operand dst = rm_operand(in, size, op != 7);
+        e.op(size, {byte(0x8a | w)}, kRax, reg_operand(in, size));
+        e.op(size, {byte(op << 3 | w)}, kRax, dst);
+      } else if (b < 0x40 && form < 4) {    // Gb Eb, Gv Ev
+        e.op(size, {byte(0x8a | w)}, kRax, rm_operand(in, size, false));
+        e.op(size, {byte(op << 3 | w)}, kRax, reg_operand(in, size));
+      } else {                              // AL Ib, AX Iv, group 1
+        Operand dst = b < 0x40 ? ctx_at(reg16(0)) : rm_operand(in, size, op != 7);
+        e.op(size, {byte(0x80 | w)}, op, dst);
+        if (size == 1) e.put(in.imm);
+        else e.put16(in.imm);
+      }
+      // AF is undefined after logic operations; the interpreter clears it.
+      if (live_after && (op == 1 || op == 4 || op == 6)) {
+        e.put({0x9f, 0x80, 0xe4, 0xef, 0x9e});    // lahf; and ah, ef; sahf
+      }
+      return;
+    }
+
+    switch (b) {
+      case 0x88: case 0x89: case 0x8a: case 0x8b: {   // mov
+        int size = (b & 1) ? 2 : 1;
+        byte w = size - 1;
+        if (b < 0x8a) {
+          Operand dst = rm_operand(in, size, true);
+          e.op(size, {byte(0x8a | w)}, kRax, reg_operand(in, size));
+          e.op(size, {byte(0x88 | w)}, kRax, dst);
+        } else {
+          e.op(size, {byte(0x8a | w)}, kRax, rm_operand(in, size, false));
+          e.op(size, {byte(0x88 | w)}, kRax, reg_operand(in, size));
+        }
+        return;
+      }
+
+      case 0xc6: case 0xc7: {   // mov Eb Ib, Ev Iv
+        int size = b == 0xc6 ? 1 : 2;
+        e.op(size, {b}, 0, rm_operand(in, size, true));
+        if (size == 1) e.put(in.imm);
+        else e.put16(in.imm);
+        return;
+      }
+
+      case 0xa0: case 0xa1: case 0xa2: case 0xa3: {   // mov moffs
+        int size = (b & 1) ? 2 : 1;
+        byte w = size - 1;
+        Operand mem = rm_operand(in, size, b >= 0xa2);
+        if (b < 0xa2) {
+          e.op(size, {byte(0x8a | w)}, kRax, mem);
+          e.op(size, {byte(0x88 | w)}, kRax, ctx_at(reg16(0)));
+        } else {
+          e.op(size, {byte(0x8a | w)}, kRax, ctx_at(reg16(0)));
+          e.op(size, {byte(0x88 | w)}, kRax, mem);
+        }
+        return;
+      }
+
+      case 0x8d:    // lea
+        emit_offset(in);
+        e.op(2, {0x89}, kR10, reg_operand(in, 2));
+        return;
+
+      case 0x0e: case 0x1e: {   // push cs / ds
+        Operand seg = ctx_at(seg_reg(b == 0x0e ? Segment::kSegCs
+                                                : Segment::kSegDs));
+        emit_push(&seg, 0);
+        return;
+      }
+      case 0x1f:    // pop ds
+        emit_pop(ctx_at(seg_reg(Segment::kSegDs)));
+        return;
+
+      case 0x90:    // nop
+        return;
+      case 0x91: case 0x92: case 0x93:    // xchg
+      case 0x94: case 0x95: case 0x96: case 0x97:
+        e.op(4, {0x0f, 0xb7}, kRax, ctx_at(reg16(0)));
+        e.op(4, {0x0f, 0xb7}, kRdx, ctx_at(reg16(b & 7)));
+        e.op(2, {0x89}, kRdx, ctx_at(reg16(0)));
+        e.op(2, {0x89}, kRax, ctx_at(reg16(b & 7)));
+        return;
+
+      case 0xe8:    // call Jv
+        emit_push(nullptr, next_ip);
+        emit_exit(next_ip + in.imm, retired, true);
+        return;
+      case 0xe9: case 0xeb:   // jmp Jv, jmp Jb
+        emit_exit(next_ip + in.imm, retired, true);
+        return;
+      case 0xc3:    // ret
+        emit_pop(ctx_at(offsetof(Context, ip)));
+        emit_exit(0, retired, false, false);
+        return;
+
+      case 0xe0: case 0xe1: case 0xe2: {    // loopnz / loopz / loop
+        Operand cx = ctx_at(reg16(kRegCx));
+        e.op(4, {0x0f, 0xb7}, kRcx, cx);
+        e.op(4, {0x8d}, kRcx, {Operand::kBaseDisp, kRcx, 0, 0, -1});
+        e.op(2, {0x89}, kRcx, cx);
+        size_t zero = e.jcc8(0xe3);    // jecxz
+        size_t cond = 0;
+        if (b != 0xe2) cond = e.jcc8(b == 0xe0 ? 0x74 : 0x75);
+        emit_exit(next_ip + in.imm, retired, true);
+        e.bind8(zero);
+        if (b != 0xe2) e.bind8(cond);
+        emit_exit(next_ip, retired, true);
+        return;
+      }
+    }
+
+    if (b >= 0x40 && b <= 0x4f) {   // inc, dec
+      e.op(2, {0xff}, b < 0x48 ? 0 : 1, ctx_at(reg16(b & 7)));
+    } else if (b >= 0x50 && b <= 0x57) {
+      Operand reg = ctx_at(reg16(b & 7));
+      emit_push(&reg, 0);
+    } else if (b >= 0x58 && b <= 0x5f) {
+      emit_pop(ctx_at(reg16(b & 7)));
+    } else if (b >= 0xb0 && b <= 0xb7) {
+      e.op(1, {0xc6}, 0, ctx_at(reg8(b & 7)));
+      e.put(in.imm);
+    } else if (b >= 0xb8 && b <= 0xbf) {
+      e.op(2, {0xc7}, 0, ctx_at(reg16(b & 7)));
+      e.put16(in.imm);
+    } else if (b >= 0x70 && b <= 0x7f) {    // jcc: same condition codes
+      size_t taken = e.jcc32(b & 0xf);
+      emit_exit(next_ip, retired, true);
+      e.bind32(taken);
+      emit_exit(next_ip + in.imm, retired, true);
+    }
+  }
+};  // Translator
+
+uint64_t host_flags(const Flag &f) {
+  // The arithmetic flags sit where FLAGS has them. DF stays clear on the
+  // host, as the ABI expects; translated code has no string instructions.
+  return 0x2 | (f.get() & Flag::kBitAll);
+}
+
+void set_guest_flags(Flag &f, uint64_t rflags) {
+  f.set((rflags & Flag::kBitAll) | f.d * Flag::kBitD);
+}
+
+struct JitResult {
+  uint64_t rflags;
+  JitExit *exit;
+};
+
+typedef JitResult (*NativeCode)(Context *ctx, JitFrame *frame,
+                                uint64_t rflags);
+
+}  // namespace
+
+Jit::Jit() : code_(nullptr), code_used_(0), limited_(false),
+             trap_reads_(false) {}
+
+Jit::~Jit() {
+  reset();
+  if (code_) munmap(code_, kCodeSize);
+}
+
+bool Jit::translate(Block &blk, word cs, word ip) {
+  if (!translatable(blk.instrs[0])) return false;
+  // Mapped on first use: guests that never get hot code, and those not
+  // using the JIT at all, pay nothing for it. Pages are only committed as
+  // they are written.
+  if (!code_) {
+    void *p = mmap(nullptr, kCodeSize, PROT_READ | PROT_WRITE | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) return false;
+    code_ = static_cast<byte *>(p);
+  }
+  if (code_used_ + kMaxBlockCode > kCodeSize) reset();
+
+  JitBlock *jb = new JitBlock();
+  jb->block = &blk;
+  jb->cs = cs;
+  jb->ip = ip;
+
+  Translator t(*jb, trap_reads_);
+  t.translate(blk);
+  if (t.e.pos() > kMaxBlockCode) {
+    delete jb;
+    return false;
+  }
+
+  byte *code = code_ + code_used_;
+  memcpy(code, t.e.buf.data(), t.e.pos());
+  code_used_ += (t.e.pos() + 15) & ~size_t(15);
+  jb->entry = code;
+  jb->chain_entry = code + t.chain_entry;
+  for (auto &site : t.sites) {
+    site.exit->jump = code + site.jump;
+    site.exit->check = code + site.check;
+    site.exit->checked_jump = code + site.checked_jump;
+  }
+
+  blk.native = jb;
+  blocks_.insert(jb);
+  return true;
+}
+
+JitExit *Jit::run(JitBlock &jb, Context &ctx, JitFrame &frame) {
+  NativeCode code = reinterpret_cast<NativeCode>(jb.entry);
+  JitResult ret = code(&ctx, &frame, host_flags(ctx.flag));
+  set_guest_flags(ctx.flag, ret.rflags);
+  return ret.exit;
+}
+
+static void patch(byte *jump, const byte *target) {
+  int32_t rel = target - (jump + 4);
+  memcpy(jump, &rel, sizeof(rel));
+}
+
+void Jit::chain(JitExit &exit, JitBlock &to) {
+  patch(exit.checked_jump, to.chain_entry);
+  patch(exit.jump, limited_ ? exit.check : to.chain_entry);
+  exit.to = &to;
+  to.incoming.push_back(&exit);
+}
+
+void Jit::limit_chains(bool limited) {
+  if (limited == limited_) return;
+  limited_ = limited;
+  for (JitBlock *jb : blocks_) {
+    for (JitExit &exit : jb->exits) {
+      if (exit.to) patch(exit.jump, limited ? exit.check : exit.to->chain_entry);
+    }
+  }
+}
+
+void Jit::trap_reads(bool trap) {
+  if (trap == trap_reads_) return;
+  trap_reads_ = trap;
+  reset();
+}
+
+void Jit::unchain(JitExit &exit) {
+  int32_t rel = 0;    // fall through to the exit's return sequence
+  memcpy(exit.jump, &rel, sizeof(rel));
+  exit.to = nullptr;
+}
+
+void Jit::drop(Block &blk) {
+  JitBlock *jb = blk.native;
+  for (JitExit *exit : jb->incoming) unchain(*exit);
+  for (JitExit &exit : jb->exits) {
+    if (!exit.to || exit.to == jb) continue;
+    auto &in = exit.to->incoming;
+    in.erase(std::find(in.begin(), in.end(), &exit));
+  }
+  blocks_.erase(jb);
+  delete jb;
+  blk.native = nullptr;
+}
+
+void Jit::reset() {
+  for (JitBlock *jb : blocks_) {
+    jb->block->native = nullptr;
+    jb->block->hits = 0;    // to be translated again once hot again
+    delete jb;
+  }
+  blocks_.clear();
+  code_used_ = 0;
+}
+
+#else   // TOY8086_JIT
+
+Jit::Jit() : code_(nullptr), code_used_(0), limited_(false),
+             trap_reads_(false) {}
+Jit::~Jit() {}
+bool Jit::translate(Block &, word, word) { return false; }
+JitExit *Jit::run(JitBlock &, Context &, JitFrame &) { return nullptr; }
+void Jit::chain(JitExit &, JitBlock &) {}
+void Jit::unchain(JitExit &) {}
+void Jit::limit_chains(bool) {}
+void Jit::trap_reads(bool) {}
+void Jit::drop(Block &blk) { blk.native = nullptr; }
+void Jit::reset() {}
+
+#endif  // TOY8086_JIT
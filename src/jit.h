@@ -0,0 +1,93 @@
+#ifndef _JIT_H_
+#define _JIT_H_
+
+#include "block_cache.h"
+#include <deque>
+#include <unordered_set>
+#include <vector>
+
+#if defined(TOY8086_UNIX) && defined(__x86_64__)
+#  define TOY8086_JIT
+#endif
+
+struct Context;
+struct JitBlock;
+
+// State shared with translated code besides the guest Context.
+struct JitFrame {
+  byte *mem;                  // guest memory base
+  byte *pages;                // Memory::tags(), then Memory::dirty()
+  uint64_t retired;           // instructions retired by translated code
+  uint64_t chain_limit;       // while chains are limited, chained exits are
+                              // taken only while retired is below; at most
+                              // kUnlimited
+  static constexpr uint64_t kUnlimited = uint64_t(1) << 55;
+};
+
+// A way out of a translated block. Exits to a fixed CS:IP jump through a
+// patchable rel32, so they can be chained straight into the successor.
+struct JitExit {
+  JitBlock *from;
+  byte *jump;                 // rel32 of the chaining jmp, null if dynamic
+  JitBlock *to;               // chained successor
+  byte *check;                // chain limit check, which jumps on through
+  byte *checked_jump;         // this rel32
+};
+
+struct JitBlock {
+  Block *block;
+  word cs, ip;                // translated for this entry point only
+  byte *entry;                // loads the guest flags into the host flags
+  byte *chain_entry;          // guest flags already in the host flags
+  std::deque<JitExit> exits;
+  std::vector<JitExit *> incoming;
+};
+
+// Translates hot blocks into x86-64 code working directly on the Context and
+// guest memory. Guest registers stay in the Context; guest flags live in the
+// host flags while translated code runs. Anything not handled here (INT,
+// IN/OUT, far transfers, ...) ends the translation and is left to the
+// interpreter. Translated code never writes into a tagged page, one holding
+// cached code say, nor reads device pages while reads are trapped: it leaves
+// to the interpreter before such an access instead.
+class Jit {
+public:
+  static constexpr uint32_t kThreshold = 32;  // executions before translating
+
+  Jit();
+  ~Jit();
+
+  // Translates |blk| for entry at |cs|:|ip|. Fails if the first instruction
+  // cannot be translated, or if there is no memory for the code.
+  bool translate(Block &blk, word cs, word ip);
+
+  // Runs translated code from |jb| until it leaves translated code, and
+  // returns the exit taken.
+  JitExit *run(JitBlock &jb, Context &ctx, JitFrame &frame);
+
+  void chain(JitExit &exit, JitBlock &to);
+  // Makes chained exits check JitFrame::chain_limit before going on, or
+  // go straight to their successors again.
+  void limit_chains(bool limited);
+  // Makes translations leave before reading pages tagged kPageDevice, or
+  // read them directly again. Drops every translation made the other way.
+  void trap_reads(bool trap);
+  void drop(Block &blk);
+  // Drops every translation. Blocks count their hits from 0 again, so that
+  // the hot ones get translated again.
+  void reset();
+
+private:
+  static constexpr size_t kCodeSize = 16 << 20;
+  static constexpr size_t kMaxBlockCode = 16 << 10;
+
+  void unchain(JitExit &exit);
+
+  byte *code_;                  // mapped by the first translate()
+  size_t code_used_;
+  bool limited_;
+  bool trap_reads_;
+  std::unordered_set<JitBlock *> blocks_;
+};  // Jit
+
+#endif
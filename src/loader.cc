@@ -0,0 +1,119 @@
+#include "loader.h"
+#include "file_view.h"
+#include <algorithm>
+
+struct MzHeader {
+  word magic;
+  word block_remain;
+  word block_num;
+  word reloc_num;
+  word hdr_size;
+  word alloc_min;
+  word alloc_max;
+
+  word ss;
+  word sp;
+  word cksum;
+  word ip;
+  word cs;
+
+  word reloc_offset;
+  word overlay_num;
+};
+
+// FNV-1a, with the size mixed in
+static uint64_t content_hash(const byte *data, size_t size) {
+  uint64_t h = 14695981039346656037ull ^ size;
+  for (size_t i = 0; i < size; ++i) {
+    h ^= data[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+// A COM file is a bare image loaded at offset 100h of a single segment.
+static bool parse_com(const byte *data, size_t file_size, Memory &mem,
+                      Context &ctx) {
+  ctx.seg.cs = ctx.seg.ds = ctx.seg.es = ctx.seg.ss = Loader::kPspSegment;
+  ctx.sp = 0xfffe;
+  ctx.ip = 0x100;
+
+  size_t size = std::min<size_t>(file_size, 0x10000 - 0x100);
+  if (size) memcpy(mem.get<byte>(Loader::kPspSegment, 0x100), data, size);
+  return true;
+}
+
+// The load module of an EXE goes right after the PSP. Every relocation entry
+// names a word in the module holding a segment, which gets the load segment
+// added to it.
+static bool parse_mz(const byte *data, size_t file_size, Memory &mem,
+                     Context &ctx) {
+  constexpr size_t kParaSize = 16;
+  constexpr size_t kBlockSize = 512;
+  constexpr word kLoadSegment = Loader::kPspSegment + 0x10;
+
+  MzHeader hdr;
+  memcpy(&hdr, data, sizeof(hdr));
+  if (!hdr.block_num) return false;
+
+  size_t img_end = (hdr.block_num - 1) * kBlockSize;
+  img_end += hdr.block_remain == 0 ? kBlockSize : hdr.block_remain;
+  img_end = std::min(img_end, file_size);
+  size_t img_begin = hdr.hdr_size * kParaSize;
+  if (img_begin > img_end) return false;
+  size_t img_size = img_end - img_begin;
+  if (img_size > (1 << 20) - kLoadSegment * kParaSize) return false;
+
+  size_t reloc_end = hdr.reloc_offset + hdr.reloc_num * size_t(4);
+  if (reloc_end > file_size) return false;
+
+  memcpy(mem.get<byte>(kLoadSegment, 0), data + img_begin, img_size);
+  const byte *reloc = data + hdr.reloc_offset;
+  for (word i = 0; i < hdr.reloc_num; ++i, reloc += 4) {
+    word offset = reloc[0] | reloc[1] << 8;
+    word segment = reloc[2] | reloc[3] << 8;
+    to_word(mem.get<byte>(kLoadSegment + segment, offset)) += kLoadSegment;
+  }
+
+  ctx.seg.cs = hdr.cs + kLoadSegment;
+  ctx.ip = hdr.ip;
+  ctx.seg.ss = hdr.ss + kLoadSegment;
+  ctx.sp = hdr.sp;
+  ctx.seg.ds = ctx.seg.es = Loader::kPspSegment;
+  return true;
+}
+
+std::shared_ptr<GuestImage> Loader::load(const char *path) {
+  FileView file(path);
+  if (!file.ok()) return nullptr;
+  return load(file.data(), file.size());
+}
+
+std::shared_ptr<GuestImage> Loader::load(const byte *data, size_t size) {
+  uint64_t key = content_hash(data, size);
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = cache_.find(key);
+    if (it != cache_.end() && it->second.holds(data, size)) {
+      ++hits_;
+      return it->second.image;
+    }
+  }
+
+  Memory mem;
+  Context ctx;
+  memset(&ctx.reg_all, 0, sizeof(ctx.reg_all));
+  bool is_mz = size >= sizeof(MzHeader) && (data[0] | data[1] << 8) == 0x5a4d;
+  if (!(is_mz ? parse_mz(data, size, mem, ctx)
+              : parse_com(data, size, mem, ctx))) {
+    return nullptr;
+  }
+
+  auto image = std::make_shared<GuestImage>(mem, ctx, DeviceState());
+  std::lock_guard<std::mutex> guard(lock_);
+  Entry &e = cache_.emplace(
+    key, Entry{std::vector<byte>(data, data + size), image}).first->second;
+  // Keeps a racing load of the same program; one whose hash collides with
+  // a cached program's is not cached
+  return e.holds(data, size) ? e.image : image;
+}
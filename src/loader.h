@@ -0,0 +1,44 @@
+#ifndef _LOADER_H_
+#define _LOADER_H_
+
+#include "cpu.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Loads DOS programs (MZ executables, anything else as COM) into GuestImages
+// ready to fork Cpus from. The file is mapped rather than read, and EXE
+// relocations are applied while copying the load module. Parsed images are
+// cached by content, so loading the same program again only hashes it and
+// compares it with the cached copy. Safe to share between threads.
+class Loader {
+public:
+  static constexpr word kPspSegment = 0x700;
+
+  // Null if |path| cannot be read or is not a valid program.
+  std::shared_ptr<GuestImage> load(const char *path);
+  // The same for a program already in memory.
+  std::shared_ptr<GuestImage> load(const byte *data, size_t size);
+
+  size_t cache_hits() const { return hits_; }
+
+private:
+  struct Entry {
+    std::vector<byte> content;    // what the hash alone can't tell apart
+    std::shared_ptr<GuestImage> image;
+
+    bool holds(const byte *data, size_t size) const {
+      return content.size() == size &&
+             std::equal(content.begin(), content.end(), data);
+    }
+  };
+
+  std::mutex lock_;
+  std::unordered_map<uint64_t, Entry> cache_;
+  std::atomic<size_t> hits_{0};
+};  // Loader
+
+#endif
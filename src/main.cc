@@ -1,83 +1,228 @@
 #include "cpu.h"
+#include "loader.h"
+#include "pool.h"
+#include "snapshot.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
-struct MzHeader {
-  word magic;
-  word block_remain;
-  word block_num;
-  word reloc_num;
-  word hdr_size;
-  word alloc_min;
-  word alloc_max;
-
-  word ss;
-  word sp;
-  word cksum;
-  word ip;
-  word cs;
-
-  word reloc_offset;
-  word overlay_num;
-};
-
-bool load_binary(const char *path, Cpu &cpu) {
-  FILE *f = fopen(path, "rb");
-  if (!f) return false;
-
-  fseek(f, 0, SEEK_END);
-  size_t size = ftell(f);
-  fseek(f, 0, SEEK_SET);
-
-  MzHeader hdr;
-  fread(&hdr, 1, sizeof(MzHeader), f);
-
-  if (size < sizeof(MzHeader) || hdr.magic != 0x5a4d) {
-    // load as COM
-    rewind(f);
+struct BatchJob {
+  std::string binary;
+  std::string input;    // empty: the guest reads EOF
+};  // BatchJob
 
-    cpu.ctx_.seg.cs = cpu.ctx_.seg.ds =
-      cpu.ctx_.seg.es = cpu.ctx_.seg.ss = 0x700;
-    cpu.ctx_.sp = 0xfffe;
-    cpu.ctx_.ip = 0x100;
+// One job per line: the binary, then optionally a file fed to its stdin.
+// Blank lines and lines starting with '#' are skipped.
+bool read_manifest(const char *path, std::vector<BatchJob> &jobs) {
+  FILE *f = fopen(path, "r");
+  if (!f) return false;
 
-    void *mem_ptr = cpu.mem_.get<void>(cpu.ctx_.seg.cs, cpu.ctx_.ip);
-    fread(mem_ptr, 1, 0x10000, f);
-    fclose(f);
-    return true;
+  char line[4096];
+  while (fgets(line, sizeof(line), f)) {
+    char binary[2048], input[2048];
+    int n = sscanf(line, "%2047s %2047s", binary, input);
+    if (n < 1 || binary[0] == '#') continue;
+    jobs.push_back({binary, n > 1 ? input : ""});
   }
+  fclose(f);
+  return true;
+}
 
-  constexpr int kParaSize = 16;
-  constexpr int kBlockSize = 512;
+const char *exit_name(Cpu::ExitStatus st) {
+  switch (st) {
+    case Cpu::kExitHalt:                return "halt";
+    case Cpu::kExitDebugInterrupt:      return "debug-interrupt";
+    case Cpu::kExitInvalidOpcode:       return "invalid-opcode";
+    case Cpu::kExitInvalidInstruction:  return "invalid-instruction";
+    case Cpu::kExitInputWait:           return "input-wait";
+    case Cpu::kExitBudget:              return "budget";
+    default:                            return "running";
+  }
+}
 
-  size_t img_size = (hdr.block_num - 1) * kBlockSize;
-  img_size += hdr.block_remain == 0 ? kBlockSize : hdr.block_remain;
-  img_size -= hdr.hdr_size * kParaSize;
-  fseek(f, hdr.hdr_size * kParaSize, SEEK_SET);
+// Runs every job on its own Cpu and streams the results as jobs finish:
+//   job <index> <binary> <status> <instructions> <output size>
+// followed by the captured output and a newline. Jobs running the same program
+// are forked from one cached image.
+int run_batch(const std::vector<BatchJob> &jobs, size_t threads,
+              bool block_cache, bool jit, Clock::Mode clock) {
+  Loader loader;
+  std::mutex print_lock;
+  ThreadPool pool(threads);
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    pool.submit([&, i] {
+      const BatchJob &job = jobs[i];
+      std::shared_ptr<GuestImage> image = loader.load(job.binary.c_str());
+      const char *status = "load-error";
+      uint64_t retired = 0;
+      std::string output;
 
-  void *mem_ptr = cpu.mem_.get<void>(0, 0);
-  fread(mem_ptr, 1, img_size, f);
+      FILE *in = job.input.empty() ? tmpfile() : fopen(job.input.c_str(), "rb");
+      if (image && in) {
+        std::unique_ptr<Cpu> cpu(new Cpu(*image));
+        cpu->in_.redirect(in);
+        cpu->out_.redirect(nullptr);
+        cpu->use_block_cache_ = block_cache;
+        cpu->use_jit_ = jit;
+        cpu->clock_.set_mode(clock);
+        status = exit_name(cpu->run());
+        retired = cpu->retired_;
+        output = cpu->out_.take();
+      }
+      if (in) fclose(in);
 
-  cpu.ctx_.sp = hdr.sp;
-  cpu.ctx_.ip = hdr.ip;
-  cpu.ctx_.seg.ss = hdr.ss;
-  cpu.ctx_.seg.cs = hdr.cs;
-  cpu.ctx_.seg.ds = hdr.cs + (img_size >> 4) + 1;
-  return true;
+      std::lock_guard<std::mutex> guard(print_lock);
+      printf("job %zu %s %s %llu %zu\n", i, job.binary.c_str(), status,
+             (unsigned long long) retired, output.size());
+      fwrite(output.data(), 1, output.size(), stdout);
+      printf("\n");
+      fflush(stdout);
+    });
+  }
+  pool.wait();
+  return 0;
 }
 
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s [FILE]\n", argv[0]);
+  const char *path = nullptr;
+  const char *manifest = nullptr;
+  size_t threads = 0;
+  bool block_cache = true;
+  bool jit = false;
+  bool fusion = false;
+  bool stats = false;
+  Clock::Mode clock = Clock::kFastForward;
+  double mhz = 0;
+  const char *screen = nullptr;
+  const char *screen_shm = nullptr;
+  const char *save_path = nullptr;
+  const char *load_path = nullptr;
+  const char *record_path = nullptr;
+  const char *replay_path = nullptr;
+  bool usage = false;
+  for (int i = 1; i < argc && !usage; ++i) {
+    if (!strcmp(argv[i], "--no-block-cache")) block_cache = false;
+    else if (!strcmp(argv[i], "--jit")) jit = true;
+    else if (!strcmp(argv[i], "--fusion")) fusion = true;
+    else if (!strcmp(argv[i], "--stats")) stats = true;
+    else if (!strcmp(argv[i], "--realtime")) clock = Clock::kRealTime;
+    else if (!strcmp(argv[i], "--mhz") && i + 1 < argc) {
+      mhz = atof(argv[++i]);
+      usage = mhz <= 0;
+    }
+    else if (!strcmp(argv[i], "--screen") && i + 1 < argc) screen = argv[++i];
+    else if (!strcmp(argv[i], "--screen-shm") && i + 1 < argc) {
+      screen_shm = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--save-state") && i + 1 < argc) {
+      save_path = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--load-state") && i + 1 < argc) {
+      load_path = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--record") && i + 1 < argc) {
+      record_path = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--replay") && i + 1 < argc) {
+      replay_path = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--batch") && i + 1 < argc) manifest = argv[++i];
+    else if (!strcmp(argv[i], "--jobs") && i + 1 < argc) threads = atoi(argv[++i]);
+    else if (!path) path = argv[i];
+    else usage = true;
+  }
+  if (usage || (!!path + !!manifest + !!load_path != 1) ||
+      (record_path && replay_path)) {
+    fprintf(stderr, "Usage: %s [--no-block-cache] [--jit] [--fusion] "
+                    "[--realtime]\n"
+                    "           [--mhz MHZ] [--stats] "
+                    "[--screen TTY] [--screen-shm PATH]\n"
+                    "           [--save-state STATE] "
+                    "[--record TRACE | --replay TRACE]\n"
+                    "           FILE | --load-state STATE\n"
+                    "       %s [--no-block-cache] [--jit] [--realtime] "
+                    "[--jobs N] --batch MANIFEST\n", argv[0], argv[0]);
     return 1;
   }
 
-  Cpu cpu;
-  if (!load_binary(argv[1], cpu)) {
-    fprintf(stderr, "Failed to load file %s.\n", argv[1]);
+  if (manifest) {
+    std::vector<BatchJob> jobs;
+    if (!read_manifest(manifest, jobs)) {
+      fprintf(stderr, "Failed to read manifest %s.\n", manifest);
+      return 2;
+    }
+    return run_batch(jobs, threads, block_cache, jit, clock);
+  }
+
+  auto load_begin = std::chrono::steady_clock::now();
+  Loader loader;
+  std::shared_ptr<GuestImage> image =
+    load_path ? load_state(load_path) : loader.load(path);
+  if (!image) {
+    fprintf(stderr, "Failed to load %s %s.\n", load_path ? "state" : "file",
+            load_path ? load_path : path);
+    return 2;
+  }
+  Cpu cpu(*image);
+  std::chrono::duration<double> load_time =
+    std::chrono::steady_clock::now() - load_begin;
+  cpu.use_block_cache_ = block_cache;
+  cpu.use_jit_ = jit;
+  cpu.use_fusion_ = fusion;
+  cpu.clock_.set_mode(clock);
+  cpu.throttle_.set_hz(uint64_t(mhz * 1e6));
+
+  FILE *screen_out = nullptr;
+  if (screen && !(screen_out = fopen(screen, "w"))) {
+    fprintf(stderr, "Failed to open %s.\n", screen);
+    return 2;
+  }
+  if ((screen || screen_shm) && !cpu.open_display(screen_out, screen_shm)) {
+    fprintf(stderr, "Failed to share the screen through %s.\n", screen_shm);
     return 2;
   }
 
+  std::unique_ptr<TraceRecorder> recorder;
+  std::unique_ptr<TraceReplayer> replayer;
+  if (record_path) {
+    recorder.reset(new TraceRecorder(record_path));
+    if (!recorder->ok()) {
+      fprintf(stderr, "Failed to create trace %s.\n", record_path);
+      return 2;
+    }
+    cpu.recorder_ = recorder.get();
+  }
+  if (replay_path) {
+    replayer.reset(new TraceReplayer(replay_path));
+    if (!replayer->ok()) {
+      fprintf(stderr, "Failed to read trace %s.\n", replay_path);
+      return 2;
+    }
+    cpu.replayer_ = replayer.get();
+  }
+
+  // With --save-state, the guest is saved as it first asks for input,
+  // which is where its initialization is typically done. A guest that ends
+  // without asking is an error, as there is no state to save.
+  auto begin = std::chrono::steady_clock::now();
+  uint64_t retired_before = cpu.retired_;   // by a restored guest
+  uint64_t cycles_before = cpu.cycles();
+  cpu.stop_for_input_ = save_path != nullptr;
   auto st = cpu.run();
+  bool saved = false;
+  if (st == Cpu::kExitInputWait) {
+    if (!save_state(cpu, save_path)) {
+      fprintf(stderr, "Failed to save state to %s.\n", save_path);
+      return 2;
+    }
+    saved = true;
+    cpu.stop_for_input_ = false;
+    st = cpu.run();
+  }
   switch (st) {
     case Cpu::kExitHalt:
       printf("Program exited normally.\n");
@@ -91,9 +236,50 @@ int main(int argc, char **argv) {
     case Cpu::kExitInvalidInstruction:
       printf("Program exited because of invaild instruction.\n");
       break;
+    case Cpu::kExitInputWait:
+    case Cpu::kExitBudget:
     case Cpu::kContinue:
       break;
   }
 
+  if (stats) {
+    std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - begin;
+    fprintf(stderr, "Loaded in %.3f ms\n", load_time.count() * 1e3);
+    uint64_t retired = cpu.retired_ - retired_before;
+    fprintf(stderr, "%llu instructions in %.3f s (%.2f MIPS)\n",
+            (unsigned long long) retired, elapsed.count(),
+            retired / elapsed.count() / 1e6);
+#ifdef TOY8086_CYCLES
+    const char *estimated = "";
+#else
+    const char *estimated = "estimated ";
+#endif
+    uint64_t cycles = cpu.cycles() - cycles_before;
+    fprintf(stderr, "%llu %scycles (%.3f s at 4.77 MHz)\n",
+            (unsigned long long) cycles, estimated,
+            double(cycles) / Clock::kHz);
+
+    if (fusion) {
+      uint64_t fused = cpu.fused_retired_;
+      fprintf(stderr, "%llu instructions fused (%.2f%%)\n",
+              (unsigned long long) fused,
+              retired ? 100.0 * fused / retired : 0.0);
+      for (size_t k = 0; k < kFusionCount; ++k) {
+        if (!cpu.fused_runs_[k]) continue;
+        fprintf(stderr, "  %-16s %14llu\n", kFusionNames[k],
+                (unsigned long long) cpu.fused_runs_[k]);
+      }
+    }
+  }
+#ifdef TOY8086_PROFILE
+  cpu.dump_profile();
+#endif
+
+  if (save_path && !saved) {
+    fprintf(stderr, "No state saved to %s: the program never asked for "
+                    "input.\n", save_path);
+    return 2;
+  }
   return 0;
 }
@@ -0,0 +1,114 @@
+#include "mem.h"
+#ifdef TOY8086_UNIX
+#  include <sys/mman.h>
+#  include <stdlib.h>
+#endif
+
+#ifdef TOY8086_UNIX
+// An unlinked file of |size| bytes shared by all mappings of an image.
+static int create_backing(size_t size) {
+#ifdef __linux__
+  int fd = memfd_create("toy8086-image", MFD_CLOEXEC);
+#else
+  char path[] = "/tmp/toy8086-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd >= 0) unlink(path);
+#endif
+  if (fd < 0) return -1;
+  if (ftruncate(fd, size) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+#endif
+
+MemoryImage::MemoryImage(const Memory &mem) : fd_(-1) {
+#ifdef TOY8086_UNIX
+  fd_ = create_backing(Memory::alloc_size_);
+  if (fd_ >= 0) {
+    void *p = mmap(nullptr, Memory::alloc_size_, PROT_WRITE, MAP_SHARED,
+                   fd_, 0);
+    if (p != MAP_FAILED) {
+      memcpy(p, mem.base_, Memory::alloc_size_);
+      munmap(p, Memory::alloc_size_);
+      return;
+    }
+    close(fd_);
+    fd_ = -1;
+  }
+#endif
+  copy_.assign(mem.base_, mem.base_ + Memory::alloc_size_);
+}
+
+MemoryImage::~MemoryImage() {
+#ifdef TOY8086_UNIX
+  if (fd_ >= 0) close(fd_);
+#endif
+}
+
+Memory::Memory(const MemoryImage &image)
+  : mapped_(false), pages_(2 * kPages) {
+#ifdef TOY8086_UNIX
+  if (image.fd_ >= 0) {
+    void *p = mmap(nullptr, alloc_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                   image.fd_, 0);
+    if (p != MAP_FAILED) {
+      base_ = static_cast<byte *>(p);
+      mapped_ = true;
+      return;
+    }
+  }
+#endif
+  base_ = new byte[alloc_size_];
+  if (image.fd_ < 0) {
+    memcpy(base_, image.copy_.data(), alloc_size_);
+    return;
+  }
+#ifdef TOY8086_UNIX
+  // The image is fine but could not be mapped: read it instead.
+  for (size_t done = 0; done < alloc_size_;) {
+    ssize_t n = pread(image.fd_, base_ + done, alloc_size_ - done, done);
+    if (n <= 0) break;
+    done += n;
+  }
+#endif
+}
+
+Memory::~Memory() {
+#ifdef TOY8086_UNIX
+  if (mapped_) {
+    munmap(base_, alloc_size_);
+    return;
+  }
+#endif
+  delete[] base_;
+}
+
+bool Memory::mark_range(size_t linear, size_t size) {
+  size_t first = (linear & mask_) >> kPageBits;
+  size_t last = ((linear + size - 1) & mask_) >> kPageBits;
+  byte *dirty = pages_.data() + kPages;
+  byte tagged = 0;
+  for (size_t p = first;; p = (p + 1) & (kPages - 1)) {
+    dirty[p] = 1;
+    tagged |= pages_[p];
+    if (p == last) return tagged;
+  }
+}
+
+byte Memory::tags_in_range(size_t linear, size_t size) const {
+  size_t first = (linear & mask_) >> kPageBits;
+  size_t last = ((linear + size - 1) & mask_) >> kPageBits;
+  byte tags = 0;
+  for (size_t p = first;; p = (p + 1) & (kPages - 1)) {
+    tags |= pages_[p];
+    if (p == last) return tags;
+  }
+}
+
+size_t Memory::count_dirty() const {
+  size_t n = 0;
+  for_each_dirty([&](size_t) { ++n; });
+  return n;
+}
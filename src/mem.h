@@ -1,27 +1,121 @@
+#ifndef _MEM_H_
+#define _MEM_H_
+
 #include "helper.h"
 #include <cstring>
+#include <vector>
+
+class MemoryImage;
 
 class Memory {
 private:
   byte *base_;
+  bool mapped_;   // a copy-on-write mapping of a MemoryImage
+  std::vector<byte> pages_;   // tags(), then dirty()
 
   // Memory size: 1 MiB
   static constexpr size_t bits_ = 20;
   static constexpr size_t size_ = 1 << bits_;
   static constexpr size_t mask_ = size_ - 1;
+  // One byte more, so that a word at the top of memory stays in bounds
+  static constexpr size_t alloc_size_ = size_ + 1;
+
+  friend class MemoryImage;
 
 public:
-  Memory() {
-    base_ = new byte[size_ + 1];
+  // Writes are tracked per page of 1 << kPageBits bytes.
+  static constexpr size_t kPageBits = 8;
+  static constexpr size_t kPages = size_ >> kPageBits;
+
+  Memory() : mapped_(false), pages_(2 * kPages) {
+    base_ = new byte[alloc_size_];
     memset(base_, 0xcc, size_);
   }
 
-  ~Memory() {
-    delete[] base_;
-  }
+  // Starts from |image|. Where the platform allows, pages are shared with the
+  // image until written.
+  explicit Memory(const MemoryImage &image);
+
+  Memory(const Memory &) = delete;
+  Memory &operator=(const Memory &) = delete;
+
+  ~Memory();
 
   template<typename T>
   T *get(size_t seg, size_t offset) {
     return (T *)(base_ + (((seg << 4) + offset) & mask_));
   }
+
+  template<typename T>
+  T *at(size_t linear) {
+    return (T *)(base_ + (linear & mask_));
+  }
+
+  // Records a write of |size| bytes, at most a page, at |linear|. Returns
+  // whether it touched a tagged page.
+  bool mark(size_t linear, size_t size) {
+    size_t first = (linear & mask_) >> kPageBits;
+    size_t last = ((linear + size - 1) & mask_) >> kPageBits;
+    byte *dirty = pages_.data() + kPages;
+    dirty[first] = dirty[last] = 1;
+    return pages_[first] | pages_[last];
+  }
+
+  // mark() for a write that may span any number of pages.
+  bool mark_range(size_t linear, size_t size);
+
+  // The tags() of the page holding |linear|.
+  byte tags_at(size_t linear) const {
+    return pages_[(linear & mask_) >> kPageBits];
+  }
+  // The tags() of the pages [|linear|, |linear| + |size|) touches, or-ed.
+  byte tags_in_range(size_t linear, size_t size) const;
+
+  // One byte per page, non-zero if the page was written since the last
+  // clear_dirty(). Follows tags() directly, so that translated code reaches
+  // both through one pointer.
+  const byte *dirty() const { return pages_.data() + kPages; }
+  size_t count_dirty() const;
+  // Calls |f| with the index of each dirty page, in ascending order.
+  template<typename F> void for_each_dirty(F f) const;
+  void clear_dirty() { memset(pages_.data() + kPages, 0, kPages); }
+
+  // One byte per page for the users of the memory to tag the pages they
+  // need to hear about writes to, e.g. those holding translated code. The
+  // bits are theirs to define; see BlockCache::PageFlag.
+  byte *tags() { return pages_.data(); }
+  const byte *tags() const { return pages_.data(); }
 };
+
+template<typename F>
+void Memory::for_each_dirty(F f) const {
+  const byte *dirty = this->dirty();
+  for (size_t p = 0; p < kPages; p += sizeof(uint64_t)) {
+    uint64_t any;
+    memcpy(&any, dirty + p, sizeof(any));
+    if (!any) continue;   // skip clean pages 8 at a time
+    for (size_t i = p; i < p + sizeof(uint64_t); ++i) {
+      if (dirty[i]) f(i);
+    }
+  }
+}
+
+// A frozen copy of guest memory. On UNIX it lives in an anonymous shared
+// file (memfd where available), which Memory maps MAP_PRIVATE; elsewhere
+// Memory copies it.
+class MemoryImage {
+public:
+  explicit MemoryImage(const Memory &mem);
+  ~MemoryImage();
+
+  MemoryImage(const MemoryImage &) = delete;
+  MemoryImage &operator=(const MemoryImage &) = delete;
+
+private:
+  friend class Memory;
+
+  int fd_;                  // -1 if the image is kept in copy_
+  std::vector<byte> copy_;
+};
+
+#endif
@@ -0,0 +1,88 @@
+#include "pool.h"
+
+ThreadPool::ThreadPool(size_t threads) {
+  if (!threads) threads = std::thread::hardware_concurrency();
+  if (!threads) threads = 1;
+  for (size_t i = 0; i < threads; ++i) {
+    queues_.emplace_back(new Queue);
+  }
+  for (size_t i = 0; i < threads; ++i) {
+    workers_.emplace_back(&ThreadPool::work, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    stop_ = true;
+  }
+  ready_.notify_all();
+  for (auto &worker : workers_) worker.join();
+}
+
+void ThreadPool::submit(Task task) {
+  size_t target;
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    target = next_++ % queues_.size();
+    ++pending_;
+  }
+  {
+    Queue &q = *queues_[target];
+    std::lock_guard<std::mutex> guard(q.lock);
+    q.tasks.push_back(std::move(task));
+  }
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    ++queued_;
+  }
+  ready_.notify_one();
+}
+
+void ThreadPool::wait() {
+  std::unique_lock<std::mutex> guard(lock_);
+  idle_.wait(guard, [this] { return pending_ == 0; });
+}
+
+bool ThreadPool::pop(size_t self, Task &task) {
+  {
+    Queue &q = *queues_[self];
+    std::lock_guard<std::mutex> guard(q.lock);
+    if (!q.tasks.empty()) {
+      task = std::move(q.tasks.back());
+      q.tasks.pop_back();
+      return true;
+    }
+  }
+  for (size_t i = 1; i < queues_.size(); ++i) {
+    Queue &q = *queues_[(self + i) % queues_.size()];
+    std::lock_guard<std::mutex> guard(q.lock);
+    if (!q.tasks.empty()) {
+      task = std::move(q.tasks.front());
+      q.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::work(size_t self) {
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> guard(lock_);
+      ready_.wait(guard, [this] { return stop_ || queued_ > 0; });
+      if (!queued_) return;   // stopping with nothing left
+      --queued_;              // claim one of the queued tasks
+    }
+
+    // Tasks are counted in queued_ only once they are in a queue, so there
+    // are always at least as many queued tasks as claims. A scan can still
+    // race with other workers and come back empty; scan again then.
+    Task task;
+    while (!pop(self, task)) std::this_thread::yield();
+    task();
+
+    std::lock_guard<std::mutex> guard(lock_);
+    if (--pending_ == 0) idle_.notify_all();
+  }
+}
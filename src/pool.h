@@ -0,0 +1,50 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs tasks on a fixed set of threads. Every worker owns a queue: it takes
+// its own tasks from the back and, once it runs dry, steals from the front of
+// the other queues, so long tasks queued on one worker don't hold up the rest.
+class ThreadPool {
+public:
+  typedef std::function<void()> Task;
+
+  // |threads| = 0 uses one thread per core.
+  explicit ThreadPool(size_t threads = 0);
+  ~ThreadPool();
+
+  void submit(Task task);
+  // Blocks until every submitted task has finished.
+  void wait();
+
+  size_t size() const { return workers_.size(); }
+
+private:
+  struct Queue {
+    std::mutex lock;
+    std::deque<Task> tasks;
+  };
+
+  bool pop(size_t self, Task &task);
+  void work(size_t self);
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+
+  std::mutex lock_;
+  std::condition_variable ready_;   // tasks queued or stopping
+  std::condition_variable idle_;    // nothing pending
+  size_t queued_ = 0;               // submitted, not yet taken
+  size_t pending_ = 0;              // submitted, not yet finished
+  size_t next_ = 0;                 // queue for the next submission
+  bool stop_ = false;
+};  // ThreadPool
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef _SEGMENT_H_
+#define _SEGMENT_H_
+
+#include "helper.h"
+#include <cstring>
+
+struct Segment {
+  enum Id {
+    kSegDefault       = -1,
+    kSegEs,
+    kSegCs,
+    kSegSs,
+    kSegDs,
+    kSegFs,
+    kSegGs,
+    kSegMax
+  };
+
+  union {
+    struct {
+      word es, cs, ss, ds, fs, gs;
+    };
+    word reg_seg[kSegMax];
+  };
+
+  Segment() {
+    memset(reg_seg, 0, sizeof(reg_seg));
+  }
+};  // Segment
+
+#endif
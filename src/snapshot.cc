@@ -0,0 +1,119 @@
+#include "snapshot.h"
+#include "file_view.h"
+#include <vector>
+
+static const char kStateMagic[8] = {'T', '8', '0', '8', '6', 'S', 'T', 'A'};
+static constexpr size_t kPageSize = 4096;
+static constexpr size_t kMemorySize = 1 << 20;
+static constexpr byte kFreshByte = 0xcc;    // what Memory starts out as
+
+struct StateHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t page_size;
+  uint32_t context_size;    // layouts must match exactly
+  uint32_t devices_size;
+  uint32_t pages;           // entries in the page table
+  uint32_t top;             // the byte past the end of memory
+  uint64_t data_offset;     // of the first verbatim page
+  uint64_t retired;         // guest time; see GuestImage
+  uint64_t cycles;
+};
+
+struct PageEntry {
+  uint32_t index;
+  int32_t fill;             // the byte filling the page, -1 if verbatim
+};
+
+bool save_state(Cpu &cpu, const char *path) {
+  const byte *mem = cpu.mem_.at<byte>(0);
+
+  std::vector<PageEntry> table;
+  std::vector<const byte *> verbatim;
+  for (uint32_t i = 0; i < kMemorySize / kPageSize; ++i) {
+    const byte *page = mem + i * kPageSize;
+    if (memcmp(page, page + 1, kPageSize - 1)) {
+      table.push_back({i, -1});
+      verbatim.push_back(page);
+    } else if (page[0] != kFreshByte) {
+      table.push_back({i, page[0]});
+    }
+  }
+
+  StateHeader hdr;
+  memcpy(hdr.magic, kStateMagic, sizeof(hdr.magic));
+  hdr.version = kStateVersion;
+  hdr.page_size = kPageSize;
+  hdr.context_size = sizeof(Context);
+  hdr.devices_size = sizeof(DeviceState);
+  hdr.pages = table.size();
+  hdr.top = mem[kMemorySize];
+  size_t meta = sizeof(hdr) + sizeof(Context) + sizeof(DeviceState) +
+                table.size() * sizeof(PageEntry);
+  hdr.data_offset = (meta + kPageSize - 1) / kPageSize * kPageSize;
+  hdr.retired = cpu.retired_;
+  hdr.cycles = cpu.cycles();
+
+  FILE *f = fopen(path, "wb");
+  if (!f) return false;
+  std::vector<byte> pad(hdr.data_offset - meta);
+  bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+            fwrite(&cpu.ctx_, sizeof(Context), 1, f) == 1 &&
+            fwrite(&cpu.devices_, sizeof(DeviceState), 1, f) == 1 &&
+            fwrite(table.data(), sizeof(PageEntry), table.size(), f) ==
+              table.size() &&
+            fwrite(pad.data(), 1, pad.size(), f) == pad.size();
+  for (const byte *page : verbatim) {
+    ok = ok && fwrite(page, kPageSize, 1, f) == 1;
+  }
+  return fclose(f) == 0 && ok;
+}
+
+std::shared_ptr<GuestImage> load_state(const char *path) {
+  FileView file(path);
+  StateHeader hdr;
+  if (!file.ok() || file.size() < sizeof(hdr)) return nullptr;
+  memcpy(&hdr, file.data(), sizeof(hdr));
+  if (memcmp(hdr.magic, kStateMagic, sizeof(hdr.magic)) ||
+      hdr.version != kStateVersion || hdr.page_size != kPageSize ||
+      hdr.context_size != sizeof(Context) ||
+      hdr.devices_size != sizeof(DeviceState) ||
+      hdr.pages > kMemorySize / kPageSize) {
+    return nullptr;
+  }
+
+  const byte *p = file.data() + sizeof(hdr);
+  size_t meta = sizeof(hdr) + sizeof(Context) + sizeof(DeviceState) +
+                hdr.pages * sizeof(PageEntry);
+  if (meta > file.size() || hdr.data_offset < meta) return nullptr;
+
+  Context ctx;
+  DeviceState devices;
+  memcpy(&ctx, p, sizeof(ctx));
+  p += sizeof(ctx);
+  memcpy(&devices, p, sizeof(devices));
+  p += sizeof(devices);
+
+  Memory mem;
+  byte *base = mem.at<byte>(0);
+  const byte *data = file.data() + hdr.data_offset;
+  for (uint32_t i = 0; i < hdr.pages; ++i) {
+    PageEntry e;
+    memcpy(&e, p + i * sizeof(e), sizeof(e));
+    if (e.index >= kMemorySize / kPageSize) return nullptr;
+    byte *page = base + e.index * kPageSize;
+    if (e.fill >= 0) {
+      memset(page, e.fill, kPageSize);
+      continue;
+    }
+    if (data + kPageSize > file.data() + file.size()) return nullptr;
+    memcpy(page, data, kPageSize);
+    data += kPageSize;
+  }
+  base[kMemorySize] = hdr.top;
+
+  auto image = std::make_shared<GuestImage>(mem, ctx, devices);
+  image->retired = hdr.retired;
+  image->cycles = hdr.cycles;
+  return image;
+}
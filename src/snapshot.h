@@ -0,0 +1,20 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include "cpu.h"
+#include <memory>
+
+// Save states, for resuming a guest where an earlier run left it, e.g. right
+// after a long initialization. A state file holds a header with the guest
+// time, the Context and device state, and then only the memory pages that differ from fresh
+// memory: a page filled with a single byte as that byte, any other page
+// verbatim at a page-aligned offset. Restoring maps the file and copies in
+// the listed pages.
+static constexpr uint32_t kStateVersion = 3;
+
+bool save_state(Cpu &cpu, const char *path);
+
+// Null if |path| is not a state file of this version.
+std::shared_ptr<GuestImage> load_state(const char *path);
+
+#endif
@@ -0,0 +1,113 @@
+#include "timing.h"
+
+// Effective address calculation, by Instr::Ea, without and with a
+// displacement
+static const byte kEaCycles[][2] = {
+  {7, 11},    // bx + si
+  {8, 12},    // bx + di
+  {8, 12},    // bp + si
+  {7, 11},    // bp + di
+  {5, 9},     // si
+  {5, 9},     // di
+  {5, 9},     // bp: only with a displacement
+  {5, 9},     // bx
+  {6, 6},     // disp16
+};
+
+static constexpr word kCyclesSegOverride = 2;
+
+word instr_cycles(const Instr &in) {
+  const byte b = in.opcode;
+  const bool mem = in.ea < Instr::kEaReg;
+  const bool wide = b & 1;
+  const int reg = (in.modrm >> 3) & 7;
+  word c;
+  if (b < 0x40 && (b & 7) < 6) {    // alu
+    bool cmp = b >> 3 == 7;
+    switch (b & 7) {
+      case 0: case 1: c = !mem ? 3 : cmp ? 9 : 16; break;   // E, G
+      case 2: case 3: c = mem ? 9 : 3;             break;   // G, E
+      default:        c = 4;                       break;   // acc, imm
+    }
+  } else if (b >= 0x40 && b <= 0x4f) {    // inc / dec r16
+    c = 2;
+  } else if (b >= 0x50 && b <= 0x57) {    // push r16
+    c = 11;
+  } else if (b >= 0x58 && b <= 0x5f) {    // pop r16
+    c = 8;
+  } else if (b >= 0x70 && b <= 0x7f) {    // jcc, not taken
+    c = 4;
+  } else if (b >= 0x90 && b <= 0x97) {    // nop, xchg AX, r16
+    c = 3;
+  } else if (b >= 0xb0 && b <= 0xbf) {    // mov r, imm
+    c = 4;
+  } else {
+    switch (b) {
+      case 0x0e: case 0x1e: c = 10; break;    // push sreg
+      case 0x1f:            c = 8;  break;    // pop sreg
+      case 0x80: case 0x81: case 0x82: case 0x83:
+        c = !mem ? 4 : reg == 7 ? 10 : 17;
+        break;
+      case 0x88: case 0x89: case 0x8c: c = mem ? 9 : 2; break;
+      case 0x8a: case 0x8b: case 0x8e: c = mem ? 8 : 2; break;
+      case 0x8d: c = 2; break;
+      case 0x9a: c = 28; break;
+      case 0x9c: c = 10; break;
+      case 0x9d: c = 8;  break;
+      case 0x9e: case 0x9f: c = 4; break;
+      case 0xa0: case 0xa1: case 0xa2: case 0xa3:   // address included
+        return 10 + (in.prefix & Instr::kPfxSeg ? kCyclesSegOverride : 0);
+      case 0xa8: case 0xa9: c = 4; break;
+      case 0xa4: case 0xa5: case 0xa6: case 0xa7:
+      case 0xaa: case 0xab: case 0xac: case 0xad: case 0xae: case 0xaf:
+        if (in.prefix & (Instr::kPfxRepe | Instr::kPfxRepne)) {
+          c = 9;
+          break;
+        }
+        switch (b & ~1) {
+          case 0xa4: c = 18; break;
+          case 0xa6: c = 22; break;
+          case 0xaa: c = 11; break;
+          case 0xac: c = 12; break;
+          default:   c = 15; break;
+        }
+        break;
+      case 0xc2: c = 12; break;
+      case 0xc3: c = 8;  break;
+      case 0xc6: case 0xc7: c = mem ? 10 : 4; break;
+      case 0xca: c = 17; break;
+      case 0xcb: c = 18; break;
+      case 0xcc: c = 52; break;
+      case 0xcd: c = 51; break;
+      case 0xd0: case 0xd1: c = mem ? 15 : 2; break;
+      case 0xd2: case 0xd3: c = mem ? 20 : 8; break;   // + kCyclesPerShift
+      case 0xe0: case 0xe2: c = 5; break;   // loopnz, loop; not taken
+      case 0xe1: c = 6; break;              // loopz
+      case 0xe4: case 0xe5: case 0xe6: case 0xe7: c = 10; break;
+      case 0xe8: c = 19; break;
+      case 0xe9: case 0xea: case 0xeb: c = 15; break;
+      case 0xec: case 0xed: case 0xee: case 0xef: c = 8; break;
+      case 0xf4: case 0xf5: case 0xf8: case 0xf9: case 0xfc: case 0xfd:
+        c = 2;
+        break;
+      case 0xf6: case 0xf7: {
+        static const word kGroup3[8][2] = {   // byte, word
+          {5, 5}, {0, 0}, {3, 3}, {3, 3},     // test, -, not, neg
+          {77, 128}, {89, 141}, {85, 153}, {106, 174},  // mul, imul, div, idiv
+        };
+        c = kGroup3[reg][wide];
+        if (mem) c += reg < 2 ? 6 : reg < 4 ? 13 : 6;
+        break;
+      }
+      default:    // not implemented
+        c = 0;
+        break;
+    }
+  }
+
+  if (mem) {
+    c += kEaCycles[in.ea][in.ea != Instr::kEaDisp && (in.modrm >> 6) != 0];
+    if (in.prefix & Instr::kPfxSeg) c += kCyclesSegOverride;
+  }
+  return c;
+}
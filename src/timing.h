@@ -0,0 +1,36 @@
+#ifndef _TIMING_H_
+#define _TIMING_H_
+
+#include "decoder.h"
+
+// 8086 instruction timings, in clock cycles, after the Intel 8086 family
+// user's manual. Where the manual gives a range (MUL, DIV, ...), the middle
+// of it is used; wait states and the extra bus cycle of word transfers at
+// odd addresses are not modeled.
+
+// Cycles of |in| that are known at decode time: the instruction itself,
+// its effective address calculation and segment override. For REP string
+// instructions only the setup; see kCyclesPerRep.
+word instr_cycles(const Instr &in);
+
+// Taken conditional jumps and loops take this many more cycles than
+// falling through.
+static constexpr word kCyclesTaken = 12;
+// LOOPNZ even 14 more
+static constexpr word kCyclesTakenLoopnz = 14;
+// Shifts and rotates by CL, per bit
+static constexpr word kCyclesPerShift = 4;
+
+// Per element of a REP string instruction, by opcode: movs, cmps, stos,
+// lods, scas.
+inline word rep_cycles(byte op) {
+  switch (op & ~1) {
+    case 0xa4: return 17;
+    case 0xa6: return 22;
+    case 0xaa: return 10;
+    case 0xac: return 13;
+    default:   return 15;
+  }
+}
+
+#endif
@@ -0,0 +1,138 @@
+#include "toy8086.h"
+#include "cpu.h"
+#include "loader.h"
+#include <algorithm>
+#include <string>
+
+struct toy8086_guest {
+  std::unique_ptr<Cpu> cpu{new Cpu};
+  FILE *in = nullptr;
+  bool capture = false;
+  std::string output;     // captured, not read yet
+  size_t output_read = 0;
+};
+
+// The enums mirror Cpu::ExitStatus
+static_assert(TOY8086_EXIT_HALT == int(Cpu::kExitHalt) &&
+              TOY8086_EXIT_INPUT_WAIT == int(Cpu::kExitInputWait) &&
+              TOY8086_EXIT_BUDGET == int(Cpu::kExitBudget),
+              "toy8086_exit out of sync with Cpu::ExitStatus");
+
+toy8086_guest *toy8086_create(void) {
+  return new toy8086_guest;
+}
+
+void toy8086_destroy(toy8086_guest *guest) {
+  delete guest;
+}
+
+int toy8086_load(toy8086_guest *guest, const void *program, size_t size) {
+  Loader loader;
+  std::shared_ptr<GuestImage> image =
+    loader.load(static_cast<const byte *>(program), size);
+  if (!image) return -1;
+
+  // Output of the old program not read yet stays ahead of the new one's
+  if (guest->capture) {
+    guest->output.erase(0, guest->output_read);
+    guest->output += guest->cpu->out_.take();
+    guest->output_read = 0;
+  }
+
+  std::unique_ptr<Cpu> cpu(new Cpu(*image));
+  cpu->use_block_cache_ = guest->cpu->use_block_cache_;
+  cpu->use_fusion_ = guest->cpu->use_fusion_;
+  cpu->use_jit_ = guest->cpu->use_jit_;
+  cpu->stop_for_input_ = guest->cpu->stop_for_input_;
+  cpu->yield_for_input_ = guest->cpu->yield_for_input_;
+  if (guest->in) cpu->in_.redirect(guest->in);
+  if (guest->capture) cpu->out_.redirect(nullptr);
+  guest->cpu = std::move(cpu);
+  return 0;
+}
+
+void toy8086_use_jit(toy8086_guest *guest, int enable) {
+  guest->cpu->use_jit_ = enable;
+}
+
+void toy8086_stop_for_input(toy8086_guest *guest, int enable) {
+  guest->cpu->stop_for_input_ = enable;
+}
+
+void toy8086_yield_for_input(toy8086_guest *guest, int enable) {
+  guest->cpu->yield_for_input_ = enable;
+}
+
+void toy8086_set_input(toy8086_guest *guest, FILE *in) {
+  guest->in = in;
+  guest->cpu->in_.redirect(in);
+}
+
+void toy8086_capture_output(toy8086_guest *guest) {
+  guest->capture = true;
+  guest->cpu->out_.redirect(nullptr);
+}
+
+size_t toy8086_read_output(toy8086_guest *guest, char *buf, size_t size) {
+  if (guest->output_read == guest->output.size()) {
+    guest->output = guest->cpu->out_.take();
+    guest->output_read = 0;
+  }
+  size_t n = std::min(size, guest->output.size() - guest->output_read);
+  memcpy(buf, guest->output.data() + guest->output_read, n);
+  guest->output_read += n;
+  return n;
+}
+
+toy8086_exit toy8086_run_for(toy8086_guest *guest,
+                             uint64_t max_instructions) {
+  return toy8086_exit(guest->cpu->run_for(max_instructions));
+}
+
+toy8086_exit toy8086_step(toy8086_guest *guest) {
+  return toy8086_exit(guest->cpu->step());
+}
+
+uint64_t toy8086_retired(const toy8086_guest *guest) {
+  return guest->cpu->retired_;
+}
+
+uint64_t toy8086_cycles(const toy8086_guest *guest) {
+  return guest->cpu->cycles();
+}
+
+uint16_t toy8086_get_reg(const toy8086_guest *guest, toy8086_reg reg) {
+  const Context &ctx = guest->cpu->ctx_;
+  switch (reg) {
+    case TOY8086_IP:    return ctx.ip;
+    case TOY8086_FLAGS: return ctx.flag.get();
+    case TOY8086_ES:    return ctx.seg.es;
+    case TOY8086_CS:    return ctx.seg.cs;
+    case TOY8086_SS:    return ctx.seg.ss;
+    case TOY8086_DS:    return ctx.seg.ds;
+    default:            return ctx.reg_all[reg & 7];
+  }
+}
+
+void toy8086_set_reg(toy8086_guest *guest, toy8086_reg reg, uint16_t value) {
+  Context &ctx = guest->cpu->ctx_;
+  switch (reg) {
+    case TOY8086_IP:    ctx.ip = value;        break;
+    case TOY8086_FLAGS: ctx.flag.set(value);   break;
+    case TOY8086_ES:    ctx.seg.es = value;    break;
+    case TOY8086_CS:    ctx.seg.cs = value;    break;
+    case TOY8086_SS:    ctx.seg.ss = value;    break;
+    case TOY8086_DS:    ctx.seg.ds = value;    break;
+    default:            ctx.reg_all[reg & 7] = value;  break;
+  }
+}
+
+void toy8086_read_memory(const toy8086_guest *guest, uint32_t linear,
+                         void *buf, size_t size) {
+  guest->cpu->peek(linear, buf, size);
+}
+
+void toy8086_write_memory(toy8086_guest *guest, uint32_t linear,
+                          const void *buf, size_t size) {
+  guest->cpu->poke(linear, buf, size);
+}
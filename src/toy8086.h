@@ -0,0 +1,96 @@
+#ifndef _TOY8086_H_
+#define _TOY8086_H_
+
+// C interface for embedding the emulator, in libtoy8086. A guest is one
+// 8086 PC running a DOS program. Guests are independent of each other, so
+// different threads may run different guests; a single guest must not be
+// used from two threads at once.
+//
+//   toy8086_guest *g = toy8086_create();
+//   toy8086_load(g, program, size);
+//   while (toy8086_run_for(g, 100000) == TOY8086_EXIT_BUDGET) {
+//     ... let other guests have the thread ...
+//   }
+//   toy8086_destroy(g);
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct toy8086_guest toy8086_guest;
+
+// Why toy8086_run_for() or toy8086_step() returned
+enum toy8086_exit {
+  TOY8086_EXIT_HALT,                  // the program exited
+  TOY8086_EXIT_DEBUG_INTERRUPT,       // INT 3
+  TOY8086_EXIT_INVALID_OPCODE,
+  TOY8086_EXIT_INVALID_INSTRUCTION,
+  TOY8086_EXIT_INPUT_WAIT,            // see toy8086_stop_for_input()
+                                      // and toy8086_yield_for_input()
+  TOY8086_EXIT_BUDGET,                // ran all the instructions it was given
+};
+
+// Registers for toy8086_get_reg() and toy8086_set_reg()
+enum toy8086_reg {
+  TOY8086_AX, TOY8086_CX, TOY8086_DX, TOY8086_BX,
+  TOY8086_SP, TOY8086_BP, TOY8086_SI, TOY8086_DI,
+  TOY8086_IP, TOY8086_FLAGS,
+  TOY8086_ES, TOY8086_CS, TOY8086_SS, TOY8086_DS,
+};
+
+// A guest with nothing loaded; memory reads as 0xCC (INT 3). Console I/O
+// goes to the process' stdin and stdout until redirected.
+toy8086_guest *toy8086_create(void);
+void toy8086_destroy(toy8086_guest *guest);
+
+// Loads a COM or MZ EXE program of |size| bytes, replacing the guest's
+// state. Execution options, input and output capture carry over, and so
+// does captured output not read yet. Returns 0 on success, -1 if the
+// program is not valid.
+int toy8086_load(toy8086_guest *guest, const void *program, size_t size);
+
+// Execution options; all off by default. With yield_for_input, a guest
+// asking for console input that has not arrived yet stops with
+// TOY8086_EXIT_INPUT_WAIT instead of blocking; run it again once its input
+// is readable.
+void toy8086_use_jit(toy8086_guest *guest, int enable);
+void toy8086_stop_for_input(toy8086_guest *guest, int enable);
+void toy8086_yield_for_input(toy8086_guest *guest, int enable);
+
+// Console input is read from |in|, which stays owned by the caller.
+void toy8086_set_input(toy8086_guest *guest, FILE *in);
+// Console output is kept for toy8086_read_output() from now on.
+void toy8086_capture_output(toy8086_guest *guest);
+// Moves up to |size| bytes of captured output into |buf|; returns how many.
+size_t toy8086_read_output(toy8086_guest *guest, char *buf, size_t size);
+
+// Runs at most |max_instructions| instructions. The budget costs nothing
+// per instruction: it is checked between blocks of straight-line code.
+enum toy8086_exit toy8086_run_for(toy8086_guest *guest,
+                                  uint64_t max_instructions);
+// Runs one instruction.
+enum toy8086_exit toy8086_step(toy8086_guest *guest);
+
+uint64_t toy8086_retired(const toy8086_guest *guest);
+uint64_t toy8086_cycles(const toy8086_guest *guest);
+
+uint16_t toy8086_get_reg(const toy8086_guest *guest, enum toy8086_reg reg);
+void toy8086_set_reg(toy8086_guest *guest, enum toy8086_reg reg,
+                     uint16_t value);
+
+// Copy |size| bytes of guest memory from and to |buf|, starting at linear
+// address |linear| and wrapping around at 1 MiB.
+void toy8086_read_memory(const toy8086_guest *guest, uint32_t linear,
+                         void *buf, size_t size);
+void toy8086_write_memory(toy8086_guest *guest, uint32_t linear,
+                          const void *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
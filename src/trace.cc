@@ -0,0 +1,88 @@
+#include "trace.h"
+#include <cstring>
+
+static const char kTraceMagic[8] = {'T', '8', '0', '8', '6', 'T', 'R', 'C'};
+static constexpr uint32_t kTraceVersion = 1;
+
+TraceRecorder::TraceRecorder(const char *path) : file_(fopen(path, "wb")) {
+  if (!file_) return;
+  chunk_.reserve(kChunkSize + 32);
+  chunk_.insert(chunk_.end(), kTraceMagic, kTraceMagic + sizeof(kTraceMagic));
+  put_varint(kTraceVersion);
+  writer_ = std::thread(&TraceRecorder::write_loop, this);
+}
+
+TraceRecorder::~TraceRecorder() {
+  if (!file_) return;
+  hand_off();
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    closing_ = true;
+  }
+  ready_.notify_one();
+  writer_.join();
+  fclose(file_);
+}
+
+void TraceRecorder::hand_off() {
+  std::vector<byte> next;
+  next.reserve(kChunkSize + 32);
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    full_.push_back(std::move(chunk_));
+  }
+  ready_.notify_one();
+  chunk_.swap(next);
+}
+
+void TraceRecorder::write_loop() {
+  std::unique_lock<std::mutex> guard(lock_);
+  for (;;) {
+    ready_.wait(guard, [this] { return closing_ || !full_.empty(); });
+    if (full_.empty()) return;    // closing, and everything is written
+    std::vector<byte> chunk = std::move(full_.front());
+    full_.pop_front();
+    guard.unlock();
+    fwrite(chunk.data(), 1, chunk.size(), file_);
+    guard.lock();
+  }
+}
+
+TraceReplayer::TraceReplayer(const char *path)
+    : file_(path), ok_(false), pos_(sizeof(kTraceMagic)) {
+  uint64_t version;
+  ok_ = file_.ok() && file_.size() >= sizeof(kTraceMagic) &&
+        !memcmp(file_.data(), kTraceMagic, sizeof(kTraceMagic)) &&
+        get_varint(version) && version == kTraceVersion;
+}
+
+bool TraceReplayer::get_varint(uint64_t &v) {
+  v = 0;
+  for (int shift = 0; pos_ < file_.size() && shift < 64; shift += 7) {
+    byte b = file_.data()[pos_++];
+    v |= uint64_t(b & 0x7f) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+bool TraceReplayer::next(TraceEvent kind, uint64_t retired, uint32_t &value) {
+  if (live_) return false;
+
+  size_t at = pos_;
+  uint64_t delta, v;
+  if (pos_ >= file_.size()) {
+    fprintf(stderr, "Replay: trace ends at instruction %llu; going live.\n",
+            (unsigned long long) retired);
+  } else if (file_.data()[pos_++] != kind || !get_varint(delta) ||
+             !get_varint(v) || last_ + delta != retired) {
+    fprintf(stderr, "Replay: diverged at instruction %llu (trace offset "
+            "%zu); going live.\n", (unsigned long long) retired, at);
+  } else {
+    last_ = retired;
+    value = uint32_t(v);
+    return true;
+  }
+  live_ = true;
+  return false;
+}
@@ -0,0 +1,86 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include "file_view.h"
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Record/replay of the nondeterministic inputs of a guest: console input,
+// the clock and port reads. Everything else follows from the starting state,
+// so feeding these back at the same points makes a run repeat exactly.
+//
+// A trace is a header followed by one record per event: the event kind, the
+// instructions retired since the previous event and the value, both as
+// LEB128 varints.
+enum TraceEvent : byte {
+  kTraceInput = 1,    // console byte, or -1 at the end of input
+  kTraceClock = 2,    // INT 1Ah ticks, bit 31 set if midnight passed
+  kTracePort  = 3,    // value read by IN
+};
+
+// Appends events to a buffer handed to a writer thread in large chunks, so
+// the guest never waits on the file.
+class TraceRecorder {
+public:
+  static constexpr size_t kChunkSize = 64 << 10;
+
+  // Check ok() for whether |path| could be created.
+  explicit TraceRecorder(const char *path);
+  ~TraceRecorder();   // writes out the rest
+
+  bool ok() const { return file_ != nullptr; }
+
+  void record(TraceEvent kind, uint64_t retired, uint32_t value) {
+    chunk_.push_back(kind);
+    put_varint(retired - last_);
+    put_varint(value);
+    last_ = retired;
+    if (chunk_.size() >= kChunkSize) hand_off();
+  }
+
+private:
+  void put_varint(uint64_t v) {
+    for (; v >= 0x80; v >>= 7) chunk_.push_back(byte(v) | 0x80);
+    chunk_.push_back(byte(v));
+  }
+
+  void hand_off();
+  void write_loop();
+
+  FILE *file_;
+  uint64_t last_ = 0;
+  std::vector<byte> chunk_;
+  std::mutex lock_;
+  std::condition_variable ready_;
+  std::deque<std::vector<byte>> full_;
+  bool closing_ = false;
+  std::thread writer_;
+};  // TraceRecorder
+
+// Feeds a recorded trace back. A request that does not match the next event
+// means the run went another way than the recorded one: that is reported
+// once, and the guest gets live inputs from then on.
+class TraceReplayer {
+public:
+  explicit TraceReplayer(const char *path);
+
+  bool ok() const { return ok_; }
+
+  // If the next event is |kind| at |retired|, consumes it into |value|.
+  bool next(TraceEvent kind, uint64_t retired, uint32_t &value);
+
+private:
+  bool get_varint(uint64_t &v);
+
+  FileView file_;
+  bool ok_;
+  bool live_ = false;     // diverged or ran out of events
+  size_t pos_;
+  uint64_t last_ = 0;
+};  // TraceReplayer
+
+#endif
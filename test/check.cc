@@ -0,0 +1,140 @@
+// Checks of guest state that comparing the execution modes with
+// toy-8086-diff cannot catch, as every mode would be wrong the same way.
+// Prints a line per check, and exits with 3 if any failed.
+#include "cpu.h"
+#include "snapshot.h"
+#include <string.h>
+#include <unistd.h>
+
+// Loads |code| as a COM program would be, at 0700:0100.
+static void load(Cpu &cpu, const byte *code, size_t size) {
+  cpu.ctx_.seg.cs = cpu.ctx_.seg.ds =
+    cpu.ctx_.seg.es = cpu.ctx_.seg.ss = 0x700;
+  cpu.ctx_.sp = 0xfffe;
+  cpu.ctx_.ip = 0x100;
+  cpu.poke(0x7100, code, size);
+}
+
+// A device trapping reads, to make the JIT drop its translations.
+class Trap : public MemoryDevice {
+public:
+  bool traps_reads() const override { return true; }
+  void on_write(dword, size_t) override {}
+};  // Trap
+
+// Blocks that were hot when the JIT dropped every translation get
+// translated again.
+static const char *jit_reset() {
+  static const byte kLoop[] = {
+    0x40,               // l: inc ax
+    0xeb, 0xfd,         //    jmp l
+  };
+  Cpu cpu;
+  load(cpu, kLoop, sizeof(kLoop));
+  cpu.use_jit_ = true;
+  cpu.run_for(10000);
+  uint64_t before = cpu.translated_;
+  if (!before) return "skipped: no JIT in this build";
+
+  Trap trap;
+  cpu.map_memory(0x90000, 0x100, &trap);
+  cpu.run_for(10000);
+  if (cpu.translated_ == before) return "loop not translated again";
+  return nullptr;
+}
+
+// Programs counter 2 of the PIT late in a run, then halts.
+static const byte kLatePit[] = {
+  0xb9, 0x88, 0x13,   // mov cx, 5000
+  0xe2, 0xfe,         // l: loop l
+  0xb0, 0xb6,         // mov al, 0b6h   ; counter 2, low then high, mode 3
+  0xe6, 0x43,         // out 43h, al
+  0xb0, 0x00,         // mov al, 0
+  0xe6, 0x42,         // out 42h, al
+  0xe6, 0x42,         // out 42h, al
+  0xf4,               // hlt
+};
+
+// A guest forked from a frozen one goes on with its time, and with the
+// PIT counting where it left off.
+static const char *fork_time() {
+  Cpu cpu;
+  load(cpu, kLatePit, sizeof(kLatePit));
+  if (cpu.run() != Cpu::kExitHalt) return "program did not halt";
+
+  Cpu fork(*cpu.freeze());
+  if (fork.cycles() != cpu.cycles()) return "time started over";
+  uint64_t now = fork.cycles();
+  if (fork.pit_.count(2, now) != cpu.pit_.count(2, now)) {
+    return "PIT count differs";
+  }
+  if (fork.pit_.count(2, now + 400) == fork.pit_.count(2, now)) {
+    return "PIT not counting";
+  }
+  return nullptr;
+}
+
+// Reads the BIOS tick count after a few ticks' worth of instructions.
+static const byte kTicks[] = {
+  0xb9, 0x00, 0x00,   // mov cx, 0
+  0xe2, 0xfe,         // l: loop l      ; 65536 times
+  0xb4, 0x00,         // read: mov ah, 0
+  0xcd, 0x1a,         // int 1ah
+  0xf4,               // hlt
+};
+
+// A guest saved and loaded again reads the same time from INT 1Ah as it
+// would have without the save.
+static const char *state_time() {
+  Cpu cpu;
+  load(cpu, kTicks, sizeof(kTicks));
+  if (cpu.run() != Cpu::kExitHalt) return "program did not halt";
+  dword ticks = cpu.ctx_.c.x << 16 | cpu.ctx_.d.x;
+  if (!ticks) return "no tick passed";
+
+  char path[] = "/tmp/toy8086-check-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) return "skipped: no temporary file";
+  close(fd);
+  cpu.ctx_.ip = 0x105;      // to read again
+  bool saved = save_state(cpu, path);
+  std::shared_ptr<GuestImage> image = saved ? load_state(path) : nullptr;
+  unlink(path);
+  if (!image) return "state not saved and loaded";
+
+  Cpu warm(*image);
+  if (warm.cycles() != cpu.cycles()) return "time started over";
+  if (warm.run() != Cpu::kExitHalt) return "program did not halt again";
+  if (dword(warm.ctx_.c.x << 16 | warm.ctx_.d.x) != ticks) {
+    return "clock started over";
+  }
+  return nullptr;
+}
+
+struct Check {
+  const char *name;
+  // Null if it passed, else what went wrong, or why it could not run in
+  // this build, starting with "skipped"
+  const char *(*run)();
+};
+
+static const Check kChecks[] = {
+  {"jit-reset", jit_reset},
+  {"fork-time", fork_time},
+  {"state-time", state_time},
+};
+
+int main() {
+  int failed = 0;
+  for (const Check &c : kChecks) {
+    const char *what = c.run();
+    bool skipped = what && !strncmp(what, "skipped", 7);
+    printf("%-16s %s\n", c.name,
+           !what ? "ok" : skipped ? what : "FAILED");
+    if (what && !skipped) {
+      printf("  %s\n", what);
+      ++failed;
+    }
+  }
+  return failed ? 3 : 0;
+}